@@ -72,6 +72,13 @@ void display_init( resolution_t res, bitdepth_t bit, uint32_t num_buffers, gamma
 display_context_t display_lock();
 void display_show(display_context_t disp);
 void display_close();
+void display_enable_zbuffer( void );
+void *display_get_zbuffer( void );
+void display_set_cached( int enable );
+void display_flush( display_context_t disp );
+void display_set_dirty_tracking( int enable );
+void display_mark_dirty( display_context_t disp, int x, int y, int width, int height );
+void display_sync_dirty( display_context_t disp );
 
 #ifdef __cplusplus
 }
@@ -53,6 +53,74 @@ typedef struct
     uint32_t data[0];
 } sprite_t;
 
+/** @brief Magic number at the start of a font file, "FNT1" */
+#define FONT_MAGIC      0x464E5431
+
+/** @brief Glyph of a font */
+typedef struct
+{
+    /** @brief X location of the glyph in the atlas */
+    uint16_t x;
+    /** @brief Y location of the glyph in the atlas */
+    uint16_t y;
+    /** @brief Width of the glyph in pixels, 0 if it draws nothing */
+    uint8_t width;
+    /** @brief Height of the glyph in pixels */
+    uint8_t height;
+    /** @brief Horizontal offset from the pen position to the glyph */
+    int8_t x_offset;
+    /** @brief Vertical offset from the top of the line to the glyph */
+    int8_t y_offset;
+    /** @brief Pixels to move the pen after drawing the glyph */
+    uint8_t advance;
+    /** @brief Padding */
+    uint8_t padding;
+} font_glyph_t;
+
+/** @brief Kerning adjustment between two characters */
+typedef struct
+{
+    /** @brief First character of the pair */
+    uint8_t first;
+    /** @brief Second character of the pair */
+    uint8_t second;
+    /** @brief Pixels to add to the advance of the first character */
+    int8_t amount;
+    /** @brief Padding */
+    uint8_t padding;
+} font_kerning_t;
+
+/**
+ * @brief Bitmap font
+ *
+ * Fonts are created with the mkfont tool and loaded with #graphics_load_font.  The file
+ * is used in place: the glyph table follows this header, then the kerning pairs sorted
+ * by first and second character, then the atlas as a 4-bit color index sprite holding
+ * every glyph.  Atlas pixels are 0 where transparent and nonzero where set, so the
+ * atlas can be loaded into TMEM as a single CI4 texture for the RDP.
+ */
+typedef struct
+{
+    /** @brief Must be #FONT_MAGIC */
+    uint32_t magic;
+    /** @brief Number of glyphs in the glyph table */
+    uint16_t num_glyphs;
+    /** @brief Number of kerning pairs */
+    uint16_t num_kerning;
+    /** @brief Character of the first glyph */
+    uint8_t first_char;
+    /** @brief Distance between lines of text in pixels */
+    uint8_t line_height;
+    /** @brief Padding */
+    uint16_t padding;
+    /** @brief Offset in bytes from the start of the font to the kerning pairs */
+    uint32_t kerning_offset;
+    /** @brief Offset in bytes from the start of the font to the atlas sprite */
+    uint32_t atlas_offset;
+    /** @brief Glyph table */
+    font_glyph_t glyphs[0];
+} font_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -66,6 +134,8 @@ void graphics_draw_line_trans( display_context_t disp, int x0, int y0, int x1, i
 void graphics_draw_box( display_context_t disp, int x, int y, int width, int height, uint32_t color );
 void graphics_draw_box_trans( display_context_t disp, int x, int y, int width, int height, uint32_t color );
 void graphics_fill_screen( display_context_t disp, uint32_t c );
+void graphics_draw_triangle( display_context_t disp, int x1, int y1, int x2, int y2, int x3, int y3, uint32_t color );
+void graphics_draw_polygon( display_context_t disp, const int *points, int count, uint32_t color );
 void graphics_set_color( uint32_t forecolor, uint32_t backcolor );
 void graphics_draw_character( display_context_t disp, int x, int y, char c );
 void graphics_draw_text( display_context_t disp, int x, int y, const char * const msg );
@@ -73,6 +143,17 @@ void graphics_draw_sprite( display_context_t disp, int x, int y, sprite_t *sprit
 void graphics_draw_sprite_stride( display_context_t disp, int x, int y, sprite_t *sprite, int offset );
 void graphics_draw_sprite_trans( display_context_t disp, int x, int y, sprite_t *sprite );
 void graphics_draw_sprite_trans_stride( display_context_t disp, int x, int y, sprite_t *sprite, int offset );
+void graphics_draw_box_alpha( display_context_t disp, int x, int y, int width, int height, uint32_t color, uint8_t alpha );
+void graphics_draw_sprite_alpha( display_context_t disp, int x, int y, sprite_t *sprite, uint8_t alpha );
+int graphics_sprite_enable_spans( sprite_t *sprite );
+void graphics_sprite_disable_spans( sprite_t *sprite );
+font_t *graphics_load_font( const char * const path );
+void graphics_free_font( font_t *font );
+void graphics_set_font( font_t *font );
+const font_glyph_t *graphics_get_glyph( const font_t *font, char ch );
+int graphics_get_kerning( const font_t *font, char first, char second );
+sprite_t *graphics_get_font_atlas( font_t *font );
+int graphics_get_text_width( const char * const msg );
 
 #ifdef __cplusplus
 }
@@ -29,6 +29,106 @@ typedef enum
     SYNC_TILE
 } sync_t;
 
+/**
+ * @brief RDP fence
+ *
+ * Identifies a point in the command stream, see #rdp_emit_fence.
+ */
+typedef uint32_t rdp_fence_t;
+
+/**
+ * @brief Counters of the RDP state tracker
+ *
+ * See #rdp_get_state_stats.
+ */
+typedef struct
+{
+    /** @brief Render mode and combiner changes dropped because nothing changed */
+    uint32_t modes_elided;
+    /** @brief Fill, primitive and blend color changes dropped because nothing changed */
+    uint32_t colors_elided;
+    /** @brief Clipping changes dropped because nothing changed */
+    uint32_t scissors_elided;
+    /** @brief Syncs dropped because nothing was drawn since the last one */
+    uint32_t syncs_elided;
+    /** @brief Syncs added before mode changes and texture loads that needed them */
+    uint32_t syncs_inserted;
+} rdp_state_stats_t;
+
+/**
+ * @brief RDP activity over a profiled frame
+ *
+ * See #rdp_profile_begin and #rdp_profile_end.  The hardware counters are 24 bits wide
+ * and count RCP cycles, so they only cover about a quarter of a second.
+ */
+typedef struct
+{
+    /** @brief RCP cycles counted by the RDP clock counter */
+    uint32_t clock;
+    /** @brief Cycles the RDP command buffer was busy */
+    uint32_t busy;
+    /** @brief Cycles the RDP pipeline was busy */
+    uint32_t pipe_busy;
+    /** @brief Cycles TMEM was busy loading textures */
+    uint32_t tmem_busy;
+    /** @brief Bytes of commands sent to the RDP */
+    uint32_t bytes;
+    /** @brief Number of times the RDP was handed new commands */
+    uint32_t kicks;
+    /** @brief CPU ticks elapsed, see #get_ticks */
+    uint32_t cpu_ticks;
+    /** @brief Fraction of the profiled time the RDP pipeline was busy, 0.0 to 1.0 */
+    float utilization;
+} rdp_profile_t;
+
+/**
+ * @brief Offscreen render target
+ *
+ * Allocated with #rdp_surface_alloc.
+ */
+typedef struct
+{
+    /** @brief Uncached, 64 byte aligned pixel data */
+    void *buffer;
+    /** @brief Width in pixels */
+    uint16_t width;
+    /** @brief Height in pixels */
+    uint16_t height;
+    /** @brief Bytes per pixel, 2 or 4 */
+    uint8_t bitdepth;
+    /** @brief Memory as returned by malloc */
+    void *memory;
+} surface_t;
+
+/**
+ * @brief Triangle vertex
+ *
+ * Which fields are used depends on the triangle type selected with #rdp_triangle_setup.
+ */
+typedef struct
+{
+    /** @brief Screen X coordinate in pixels */
+    float x;
+    /** @brief Screen Y coordinate in pixels */
+    float y;
+    /** @brief Depth, from 0.0 (near) to 1.0 (far) */
+    float z;
+    /** @brief Texture S coordinate in texels */
+    float s;
+    /** @brief Texture T coordinate in texels */
+    float t;
+    /** @brief Inverse W for perspective correction, 1.0 when unused */
+    float inv_w;
+    /** @brief Red shade component */
+    uint8_t r;
+    /** @brief Green shade component */
+    uint8_t g;
+    /** @brief Blue shade component */
+    uint8_t b;
+    /** @brief Alpha shade component */
+    uint8_t a;
+} rdp_vertex_t;
+
 /** @} */
 
 #ifdef __cplusplus
@@ -38,18 +138,30 @@ extern "C" {
 void rdp_init( void );
 void rdp_attach_display( display_context_t disp );
 void rdp_detach_display( void );
+void rdp_detach_show( display_context_t disp );
 void rdp_sync( sync_t sync );
 void rdp_set_clipping( uint32_t tx, uint32_t ty, uint32_t bx, uint32_t by );
 void rdp_set_default_clipping( void );
 void rdp_enable_primitive_fill( void );
 void rdp_enable_blend_fill( void );
 void rdp_load_texture( sprite_t *sprite );
+void rdp_load_texture_rect( sprite_t *sprite, int sx, int sy, int width, int height );
+void rdp_load_texture_stride( sprite_t *sprite, int offset );
+void rdp_load_texture_mipmap( sprite_t *sprite, int levels );
 void rdp_draw_textured_rectangle( int tx, int ty, int bx, int by, int flags );
 void rdp_draw_textured_rectangle_scaled( int tx, int ty, int bx, int by, double x_scale, double y_scale, int flags );
+void rdp_draw_textured_rectangle_scaled_fx( int tx, int ty, int bx, int by, int32_t x_scale, int32_t y_scale, int flags );
 void rdp_draw_sprite( int x, int y, int flags );
+void rdp_load_font( font_t *font );
+void rdp_draw_text( font_t *font, int x, int y, const char * const msg );
 void rdp_draw_sprite_scaled( int x, int y, float x_scale, float y_scale, int flags );
+void rdp_draw_sprite_scaled_fx( int x, int y, int32_t x_scale, int32_t y_scale, int flags );
 void rdp_draw_filled_rectangle( int tx, int ty, int bx, int by );
 void rdp_draw_filled_triangle( float x1, float y1, float x2, float y2, float x3, float y3 );
+void rdp_draw_filled_triangle_fx( int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3 );
+void rdp_draw_filled_triangles_fx( const int32_t *coords, int count );
+void rdp_draw_line( int x0, int y0, int x1, int y1, int width );
+void rdp_draw_polyline( const int *points, int count, int width );
 void rdp_close( void );
 
 // RDP new
@@ -58,17 +170,50 @@ void rdp_command( uint32_t data );
 void rdp_cp_sprite( int x, int y, int flags, int cp_x, int cp_y, int line );
 void rdp_cp_sprite_scaled( int x, int y, float x_scale, float y_scale, int flags, int cp_x, int cp_y, int line );
 void rdp_set_fill_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a );
+void rdp_clear_zbuffer( void );
 void rdp_set_prim_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a );
 void rdp_set_blend_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a );
 void rdp_texture_copy( uint64_t mode );
 void rdp_texture_cycle( uint8_t cycle, uint8_t enable_alpha, uint64_t mode );
 void rdp_load_palette( uint8_t pal, uint8_t col_num, uint16_t *palette );
+void rdp_load_palettes( uint16_t *palettes );
+void rdp_invalidate_palettes( void );
 void rdp_select_palette( uint8_t pal );
 void rdp_additive( void );
 void rdp_intensify( uint8_t enable_alpha );
 void rdp_color( uint8_t enable_alpha );
 void rdp_noise( uint8_t type, uint8_t enable_alpha );
 void rdp_triangle_setup( int type );
+void rdp_draw_triangle( const rdp_vertex_t *v1, const rdp_vertex_t *v2, const rdp_vertex_t *v3 );
+void rdp_draw_triangles( const rdp_vertex_t *vertices, int count );
+
+// FENCE new
+rdp_fence_t rdp_emit_fence( void );
+int rdp_fence_done( rdp_fence_t fence );
+void rdp_fence_wait( rdp_fence_t fence );
+int rdp_fence_callback( rdp_fence_t fence, void (*callback)( void *arg ), void *arg );
+
+// BATCH new
+void rdp_batch_sprite( sprite_t *sprite, int x, int y, int flags, int layer );
+void rdp_batch_flush( void );
+
+// SURFACE new
+surface_t *rdp_surface_alloc( int width, int height, int bitdepth );
+void rdp_surface_free( surface_t *surface );
+void rdp_attach_surface( surface_t *surface );
+void rdp_load_surface_as_texture( surface_t *surface, int x, int y, int width, int height );
+
+// STATE new
+void rdp_get_state_stats( rdp_state_stats_t *stats );
+void rdp_reset_state_stats( void );
+
+// PROFILE new
+void rdp_profile_begin( void );
+void rdp_profile_end( rdp_profile_t *profile );
+
+// CAPTURE new
+void rdp_capture_start( uint32_t *buffer, int max_words );
+int rdp_capture_stop( void );
 
 // FRAMEBUFFER new
 uint32_t get_pixel( display_context_t disp, int x, int y );
@@ -13,6 +13,8 @@
 #include "system.h"
 #include "libdragon.h"
 
+extern void __graphics_get_color( uint32_t *forecolor, uint32_t *backcolor );
+
 /**
  * @defgroup console Console Support
  * @ingroup display
@@ -42,16 +44,62 @@
 static void __console_render();
 
 /** @brief Size of the console buffer in bytes */
-#define CONSOLE_SIZE        ((sizeof(char) * CONSOLE_WIDTH * CONSOLE_HEIGHT) + sizeof(char))
+#define CONSOLE_SIZE        (sizeof(char) * CONSOLE_WIDTH * CONSOLE_HEIGHT)
+
+/** @brief Maximum number of display buffers tracked for redraws */
+#define CONSOLE_BUFFERS     3
+
+/** @brief Mask with a bit set for every console line */
+#define ALL_LINES           ((1 << CONSOLE_HEIGHT) - 1)
 
-/** @brief The console buffer */
+/**
+ * @brief The console buffer
+ *
+ * Lines are stored as a ring so scrolling does not move any text.  Empty cells are 0.
+ */
 static char *render_buffer = 0;
+/** @brief Line of the ring shown at the top of the screen */
+static int top_line = 0;
+/** @brief Cursor position in characters from the top left of the screen */
+static int cursor = 0;
+/** @brief Mask of screen lines changed since each display buffer was last rendered */
+static uint32_t dirty_lines[CONSOLE_BUFFERS];
+/** @brief Display buffers that need a full clear before rendering */
+static uint32_t dirty_screen = 0;
+/** @brief Text color the console was last rendered with */
+static uint32_t render_fg = 0xFFFFFFFF;
+/** @brief Background color the console was last rendered with */
+static uint32_t render_bg = 0;
 /** 
  * @brief Internal state of the render mode
  * @see #RENDER_AUTOMATIC and #RENDER_MANUAL
  */
 static int render_now;
 
+/**
+ * @brief Get a character cell of the console
+ *
+ * @param[in] pos
+ *            Position in characters from the top left of the screen
+ *
+ * @return Pointer to the cell in the ring buffer
+ */
+static inline char *__console_cell( int pos )
+{
+    return &render_buffer[((top_line + pos / CONSOLE_WIDTH) % CONSOLE_HEIGHT) * CONSOLE_WIDTH + pos % CONSOLE_WIDTH];
+}
+
+/**
+ * @brief Mark screen lines as needing a redraw in every display buffer
+ *
+ * @param[in] lines
+ *            Mask of screen lines
+ */
+static inline void __console_dirty( uint32_t lines )
+{
+    for( int i = 0; i < CONSOLE_BUFFERS; i++ ) { dirty_lines[i] |= lines; }
+}
+
 /**
  * @brief Set the console rendering mode
  *
@@ -72,11 +120,20 @@ void console_set_render_mode(int mode)
 }
 
 /**
- * @brief Macro to move the console up one line
+ * @brief Move the console up one line
+ *
+ * The top line of the ring is reused as the new, empty bottom line.  Every screen line
+ * shows different text afterwards, so all of them need a redraw.
  */
-#define move_buffer() \
-    memmove(render_buffer, render_buffer + (sizeof(char) * CONSOLE_WIDTH), CONSOLE_SIZE - (CONSOLE_WIDTH * sizeof(char))); \
-    pos -= CONSOLE_WIDTH;
+static void __console_scroll()
+{
+    memset( &render_buffer[top_line * CONSOLE_WIDTH], 0, CONSOLE_WIDTH );
+
+    top_line = (top_line + 1) % CONSOLE_HEIGHT;
+    cursor -= CONSOLE_WIDTH;
+
+    __console_dirty( ALL_LINES );
+}
 
 /**
  * @brief Newlib hook to allow printf/iprintf to appear on console
@@ -90,15 +147,13 @@ void console_set_render_mode(int mode)
  */
 static int __console_write( char *buf, unsigned int len )
 {
-    int pos = strlen(render_buffer);
-
     /* Copy over to screen buffer */
     for(int x = 0; x < len; x++)
     {
-        if(pos == CONSOLE_WIDTH * CONSOLE_HEIGHT)
+        if(cursor == CONSOLE_WIDTH * CONSOLE_HEIGHT)
         {
             /* Need to scroll the buffer */
-            move_buffer();
+            __console_scroll();
         }
 
         switch(buf[x])
@@ -106,51 +161,53 @@ static int __console_write( char *buf, unsigned int len )
             case '\r':
             case '\n':
                 /* Add enough space to get to next line */
-                if(!(pos % CONSOLE_WIDTH))
+                __console_dirty( 1 << (cursor / CONSOLE_WIDTH) );
+
+                if(!(cursor % CONSOLE_WIDTH))
                 {
-                    render_buffer[pos++] = ' ';
+                    *__console_cell( cursor++ ) = ' ';
                 }
 
-                while(pos % CONSOLE_WIDTH)
+                while(cursor % CONSOLE_WIDTH)
                 {
-                    render_buffer[pos++] = ' ';
+                    *__console_cell( cursor++ ) = ' ';
                 }
 
                 /* Make sure we don't run down the end */
-                if(pos == CONSOLE_WIDTH * CONSOLE_HEIGHT)
+                if(cursor == CONSOLE_WIDTH * CONSOLE_HEIGHT)
                 {
-                    move_buffer();
+                    __console_scroll();
                 }
 
                 break;
             case '\t':
                 /* Add enough spaces to go to the next tab stop */
-                if(!(pos % TAB_WIDTH))
+                __console_dirty( 1 << (cursor / CONSOLE_WIDTH) );
+
+                if(!(cursor % TAB_WIDTH))
                 {
-                    render_buffer[pos++] = ' ';
+                    *__console_cell( cursor++ ) = ' ';
                 }
 
-                while(pos % TAB_WIDTH)
+                while(cursor % TAB_WIDTH)
                 {
-                    render_buffer[pos++] = ' ';
+                    *__console_cell( cursor++ ) = ' ';
                 }
 
                 /* Make sure we don't run down the end */
-                if(pos == CONSOLE_WIDTH * CONSOLE_HEIGHT)
+                if(cursor == CONSOLE_WIDTH * CONSOLE_HEIGHT)
                 {
-                    move_buffer();
+                    __console_scroll();
                 }
                 break;
             default:
                 /* Copy character over */
-                render_buffer[pos++] = buf[x];
+                __console_dirty( 1 << (cursor / CONSOLE_WIDTH) );
+                *__console_cell( cursor++ ) = buf[x];
                 break;
         }
     }
 
-    /* Cap off the end! */
-    render_buffer[pos] = 0;
-    
     /* Out to screen! */
     if(render_now == RENDER_AUTOMATIC)
     {
@@ -231,6 +288,12 @@ void console_clear()
 
     /* Remove all data */
     memset(render_buffer, 0, CONSOLE_SIZE);
+    top_line = 0;
+    cursor = 0;
+
+    /* Start every buffer over from a blank screen */
+    __console_dirty( ALL_LINES );
+    dirty_screen = (1 << CONSOLE_BUFFERS) - 1;
     
     /* Should we display? */
     if(render_now == RENDER_AUTOMATIC)
@@ -241,6 +304,9 @@ void console_clear()
 
 /**
  * @brief Helper function to render the console
+ *
+ * Only lines that changed since the display buffer was last rendered are redrawn, or
+ * every line after the colors were changed with #graphics_set_color.
  */
 static void __console_render()
 {
@@ -251,20 +317,42 @@ static void __console_render()
     /* Wait until we get a valid context */
     while(!(dc = display_lock()));
 
-    /* Background color! */
-    graphics_fill_screen( dc, 0 );
+    int buffer = (dc - 1) % CONSOLE_BUFFERS;
+
+    /* Text already drawn in other colors has to be redrawn everywhere */
+    uint32_t fg, bg;
+    __graphics_get_color( &fg, &bg );
+
+    if(fg != render_fg || bg != render_bg)
+    {
+        __console_dirty( ALL_LINES );
+        render_fg = fg;
+        render_bg = bg;
+    }
+
+    if(dirty_screen & (1 << buffer))
+    {
+        /* Background color! */
+        graphics_fill_screen( dc, 0 );
+        dirty_screen &= ~(1 << buffer);
+    }
+
+    uint32_t lines = dirty_lines[buffer];
+    dirty_lines[buffer] = 0;
 
     for(int y = 0; y < CONSOLE_HEIGHT; y++)
     {
+        if(!(lines & (1 << y))) { continue; }
+
+        /* Background color! */
+        graphics_draw_box( dc, 20, 16 + 8 * y, 8 * CONSOLE_WIDTH, 8, 0 );
+
         for(int x = 0; x < CONSOLE_WIDTH; x++)
         {
-            char t_buf = render_buffer[y * CONSOLE_WIDTH + x];
+            char t_buf = *__console_cell( y * CONSOLE_WIDTH + x );
 
-            if(t_buf == 0)
-            {
-                display_show(dc);
-                return;
-            }
+            /* Nothing written here yet, nor further along the line */
+            if(t_buf == 0) { break; }
 
             /* Draw to the screen using the forecolor and backcolor set in the graphics
              * subsystem */
@@ -38,6 +38,12 @@
 /** @brief Maximum number of video backbuffers */
 #define NUM_BUFFERS         3
 
+/** @brief Size of an RDRAM bank in bytes */
+#define RDRAM_BANK_SIZE     0x100000
+
+/** @brief Maximum number of allocations held while searching for a free RDRAM bank */
+#define MAX_BANK_PROBES     8
+
 /** @brief Register location in memory of VI */
 #define REGISTER_BASE       0xA4400000
 /** @brief Number of 32-bit registers at the register base */
@@ -148,14 +154,68 @@ uint32_t __buffers = NUM_BUFFERS;
 /** @brief Pointer to uncached 16-bit aligned version of buffers */
 void *__safe_buffer[NUM_BUFFERS];
 
+/** @brief Pointer to 16-bit aligned version of buffers used for software drawing */
+void *__draw_buffer[NUM_BUFFERS];
+/** @brief Nonzero when software drawing goes through the data cache */
+int __cached_writes = 0;
+
+/** @brief First row of each buffer written through the cache since the last flush */
+static int dirty_top[NUM_BUFFERS];
+/** @brief Last row of each buffer written through the cache since the last flush, below dirty_top when clean */
+static int dirty_bottom[NUM_BUFFERS];
+
+/** @brief Maximum number of dirty rectangles tracked per buffer before they are merged */
+#define MAX_DIRTY_RECTS     16
+
+/** @brief Rectangle of a display buffer */
+typedef struct
+{
+    /** @brief Left edge in pixels */
+    int x0;
+    /** @brief Top edge in pixels */
+    int y0;
+    /** @brief Right edge in pixels, exclusive */
+    int x1;
+    /** @brief Bottom edge in pixels, exclusive */
+    int y1;
+} dirty_rect_t;
+
+/** @brief List of dirty rectangles */
+typedef struct
+{
+    /** @brief Number of rectangles in use */
+    int count;
+    /** @brief Rectangles, possibly overlapping */
+    dirty_rect_t rects[MAX_DIRTY_RECTS];
+} dirty_list_t;
+
+/** @brief Nonzero when drawing is tracked for #display_sync_dirty */
+int __dirty_tracking = 0;
+/** @brief Areas drawn to each buffer since it was locked */
+static dirty_list_t drawn[NUM_BUFFERS];
+/** @brief Areas of each buffer older than in the most recently shown buffer */
+static dirty_list_t stale[NUM_BUFFERS];
+/** @brief Most recently shown buffer, holding the newest contents, or -1 */
+static int newest = -1;
+
+/** @brief Z-buffer memory as returned by malloc */
+static void *zbuffer = 0;
+/** @brief Pointer to uncached 16-bit aligned version of the Z-buffer, or 0 if disabled */
+void *__safe_zbuffer = 0;
+
 /** @brief Currently displayed buffer */
 static int now_showing = -1;
 
 /** @brief Complete drawn buffer to display next */
 static int show_next = -1;
 
-/** @brief Buffer currently being drawn on */
-static int now_drawing = -1;
+/**
+ * @brief Mask of buffers currently being drawn on
+ *
+ * More than one buffer can be locked when the RDP is still rasterizing a finished
+ * frame while the next one is being built.
+ */
+static volatile uint32_t now_drawing = 0;
 
 /**
  * @brief Write a set of video registers to the VI
@@ -205,7 +265,7 @@ static void __display_callback()
 {
     /* Only swap frames if we have a new frame to swap, otherwise just
        leave up the current frame */
-    if(show_next >= 0 && show_next != now_drawing)
+    if(show_next >= 0 && !(now_drawing & (1 << show_next)))
     {
         __write_dram_register( __safe_buffer[show_next] );
 
@@ -214,6 +274,36 @@ static void __display_callback()
     }
 }
 
+/**
+ * @brief Check whether a memory range shares an RDRAM bank with any framebuffer
+ *
+ * @param[in] mem
+ *            Start of the memory range
+ * @param[in] size
+ *            Size of the memory range in bytes
+ *
+ * @retval 1 if the range touches a bank used by a framebuffer
+ * @retval 0 if the range lives in banks of its own
+ */
+static int __shares_bank_with_buffers( void *mem, uint32_t size )
+{
+    uint32_t first = ((uint32_t)mem & 0x1FFFFFFF) / RDRAM_BANK_SIZE;
+    uint32_t last = (((uint32_t)mem & 0x1FFFFFFF) + size - 1) / RDRAM_BANK_SIZE;
+    uint32_t buf_size = __width * __height * __bitdepth + 15;
+
+    for( int i = 0; i < __buffers; i++ )
+    {
+        if( !buffer[i] ) { continue; }
+
+        uint32_t buf_first = ((uint32_t)buffer[i] & 0x1FFFFFFF) / RDRAM_BANK_SIZE;
+        uint32_t buf_last = (((uint32_t)buffer[i] & 0x1FFFFFFF) + buf_size - 1) / RDRAM_BANK_SIZE;
+
+        if( first <= buf_last && buf_first <= last ) { return 1; }
+    }
+
+    return 0;
+}
+
 /**
  * @brief Initialize the display to a particular resolution and bit depth
  *
@@ -355,16 +445,24 @@ void display_init( resolution_t res, bitdepth_t bit, uint32_t num_buffers, gamma
         buffer[i] = malloc( __width * __height * __bitdepth + 15 );
         __safe_buffer[i] = ALIGN_16BYTE( UNCACHED_ADDR( buffer[i] ) );
 
+        __draw_buffer[i] = __safe_buffer[i];
+        dirty_top[i] = 0;
+        dirty_bottom[i] = -1;
+
         /* Baseline is blank */
         memset( __safe_buffer[i], 0, __width * __height * __bitdepth );
     }
 
+    __cached_writes = 0;
+
     /* Set the first buffer as the displaying buffer */
     __write_dram_register( __safe_buffer[0] );
 
     now_showing = 0;
-    now_drawing = -1;
+    now_drawing = 0;
     show_next = -1;
+    newest = -1;
+    __dirty_tracking = 0;
 
     enable_interrupts();
 
@@ -387,14 +485,25 @@ void display_close()
     unregister_VI_handler( __display_callback );
 
     now_showing = -1;
-    now_drawing = -1;
+    now_drawing = 0;
     show_next = -1;
+    newest = -1;
+    __cached_writes = 0;
+    __dirty_tracking = 0;
 
     __width = 0;
     __height = 0;
 
     __write_dram_register( 0 );
 
+    if( zbuffer )
+    {
+        free( zbuffer );
+    }
+
+    zbuffer = 0;
+    __safe_zbuffer = 0;
+
     for( int i = 0; i < __buffers; i++ )
     {
         /* Free framebuffer memory */
@@ -405,17 +514,348 @@ void display_close()
 
         buffer[i] = 0;
         __safe_buffer[i] = 0;
+        __draw_buffer[i] = 0;
+    }
+
+    enable_interrupts();
+}
+
+/**
+ * @brief Allocate a Z-buffer for the current display
+ *
+ * Allocate a 16-bit depth buffer the size of the display, shared by all display contexts.
+ * Once allocated, #rdp_attach_display points the RDP at it and #rdp_clear_zbuffer can
+ * be used to reset it every frame.  The Z-buffer is freed by #display_close.
+ *
+ * The RDP reads and writes the color and depth buffers in lockstep, so the Z-buffer is
+ * placed in a different RDRAM bank than the framebuffers whenever the heap allows it.
+ * This avoids constant page switches within one bank while rasterizing.
+ *
+ * @note This must be called after #display_init.
+ */
+void display_enable_zbuffer( void )
+{
+    if( zbuffer || !__width ) { return; }
+
+    uint32_t size = __width * __height * 2 + 15;
+    void *held[MAX_BANK_PROBES];
+    int num_held = 0;
+    void *candidate = malloc( size );
+
+    /* Best effort: keep filling the remainder of banks shared with a framebuffer
+       until an allocation lands in a bank of its own */
+    while( candidate && __shares_bank_with_buffers( candidate, size ) && num_held < MAX_BANK_PROBES - 1 )
+    {
+        uint32_t end = ((uint32_t)candidate & 0x1FFFFFFF) + size;
+
+        held[num_held++] = candidate;
+        candidate = 0;
+
+        void *spacer = malloc( RDRAM_BANK_SIZE - (end % RDRAM_BANK_SIZE) );
+        if( !spacer ) { break; }
+
+        held[num_held++] = spacer;
+        candidate = malloc( size );
+    }
+
+    if( !candidate || __shares_bank_with_buffers( candidate, size ) )
+    {
+        /* No luck, settle for the first allocation */
+        if( candidate ) { free( candidate ); }
+
+        candidate = num_held ? held[0] : 0;
+        if( num_held ) { held[0] = 0; }
+    }
+
+    for( int i = 0; i < num_held; i++ )
+    {
+        if( held[i] ) { free( held[i] ); }
+    }
+
+    if( !candidate ) { return; }
+
+    zbuffer = candidate;
+    __safe_zbuffer = ALIGN_16BYTE( UNCACHED_ADDR( zbuffer ) );
+
+    /* Baseline is as far away as possible */
+    memset( __safe_zbuffer, 0xFF, __width * __height * 2 );
+}
+
+/**
+ * @brief Return the Z-buffer allocated by #display_enable_zbuffer
+ *
+ * @return An uncached pointer to the 16-bit Z-buffer, or 0 if there is none.
+ */
+void *display_get_zbuffer( void )
+{
+    return __safe_zbuffer;
+}
+
+/**
+ * @brief Draw to display buffers through the data cache
+ *
+ * By default the @ref graphics write every pixel straight to memory, which is slow for
+ * sprite blits, text and fills.  With cached writes enabled, software drawing goes
+ * through the data cache and the rows touched are written back to memory in one pass
+ * by #display_flush, which #display_show and #rdp_attach_display call automatically.
+ *
+ * @note Software drawing to a display context the RDP is attached to must be followed
+ * by #display_flush before the RDP draws over the same area.  The reverse order is not
+ * supported either unless the RDP is idle: a line the CPU pulls into the cache while
+ * the RDP is still drawing holds stale pixels next to the ones written, and writing it
+ * back overwrites the RDP output.  Wait with #rdp_fence_wait before drawing in software
+ * over hardware rendering, or detach the RDP first.
+ *
+ * @param[in] enable
+ *            Nonzero to draw through the cache, zero to draw to memory directly
+ */
+void display_set_cached( int enable )
+{
+    if( !__width ) { return; }
+
+    for( int i = 0; i < __buffers; i++ )
+    {
+        /* Write back whatever was drawn in the old mode */
+        display_flush( i + 1 );
+
+        if( enable )
+        {
+            /* Memory is up to date, drop any stale lines left from before the buffer was allocated */
+            __draw_buffer[i] = ALIGN_16BYTE( buffer[i] );
+            data_cache_hit_invalidate( __draw_buffer[i], __width * __height * __bitdepth );
+        }
+        else
+        {
+            __draw_buffer[i] = __safe_buffer[i];
+        }
+    }
+
+    __cached_writes = enable ? 1 : 0;
+}
+
+/**
+ * @brief Mark rows of a display buffer as written through the cache
+ *
+ * @param[in] disp
+ *            Display context drawn to
+ * @param[in] top
+ *            First row written
+ * @param[in] bottom
+ *            Last row written
+ */
+void __display_mark_rows( display_context_t disp, int top, int bottom )
+{
+    int i = disp - 1;
+
+    if( top < 0 ) { top = 0; }
+    if( bottom >= (int)__height ) { bottom = __height - 1; }
+    if( top > bottom ) { return; }
+
+    if( dirty_top[i] > dirty_bottom[i] )
+    {
+        dirty_top[i] = top;
+        dirty_bottom[i] = bottom;
+    }
+    else
+    {
+        if( top < dirty_top[i] ) { dirty_top[i] = top; }
+        if( bottom > dirty_bottom[i] ) { dirty_bottom[i] = bottom; }
+    }
+}
+
+/**
+ * @brief Write software drawing on a display buffer back to memory
+ *
+ * Only rows drawn since the last flush are written back.  The lines are also dropped
+ * from the cache so that later reads see what the RDP draws.  Does nothing unless
+ * #display_set_cached is enabled.
+ *
+ * This function is safe to call from an interrupt handler.
+ *
+ * @param[in] disp
+ *            A display context retrieved using #display_lock
+ */
+void display_flush( display_context_t disp )
+{
+    if( disp == 0 || !__cached_writes ) { return; }
+
+    int i = disp - 1;
+
+    if( dirty_top[i] > dirty_bottom[i] ) { return; }
+
+    uint32_t stride = __width * __bitdepth;
+
+    data_cache_hit_writeback_invalidate( (uint8_t *)__draw_buffer[i] + dirty_top[i] * stride,
+                                         (dirty_bottom[i] - dirty_top[i] + 1) * stride );
+
+    dirty_top[i] = 0;
+    dirty_bottom[i] = -1;
+}
+
+/**
+ * @brief Add a rectangle to a dirty list
+ *
+ * When the list is full, the rectangle is merged with the one whose bounding box grows
+ * the least.
+ *
+ * @param[in,out] list
+ *                List to add to
+ * @param[in]     rect
+ *                Rectangle to add, already clipped to the display
+ */
+static void __dirty_add( dirty_list_t *list, const dirty_rect_t *rect )
+{
+    int best = -1;
+    int best_growth = 0x7FFFFFFF;
+
+    for( int i = 0; i < list->count; i++ )
+    {
+        dirty_rect_t *cur = &list->rects[i];
+        int x0 = (cur->x0 < rect->x0) ? cur->x0 : rect->x0;
+        int y0 = (cur->y0 < rect->y0) ? cur->y0 : rect->y0;
+        int x1 = (cur->x1 > rect->x1) ? cur->x1 : rect->x1;
+        int y1 = (cur->y1 > rect->y1) ? cur->y1 : rect->y1;
+        int growth = (x1 - x0) * (y1 - y0) - (cur->x1 - cur->x0) * (cur->y1 - cur->y0);
+
+        /* Already covered */
+        if( growth == 0 ) { return; }
+
+        if( growth < best_growth )
+        {
+            best = i;
+            best_growth = growth;
+        }
+    }
+
+    if( list->count < MAX_DIRTY_RECTS )
+    {
+        list->rects[list->count++] = *rect;
+        return;
     }
 
+    dirty_rect_t *cur = &list->rects[best];
+
+    if( rect->x0 < cur->x0 ) { cur->x0 = rect->x0; }
+    if( rect->y0 < cur->y0 ) { cur->y0 = rect->y0; }
+    if( rect->x1 > cur->x1 ) { cur->x1 = rect->x1; }
+    if( rect->y1 > cur->y1 ) { cur->y1 = rect->y1; }
+}
+
+/**
+ * @brief Track drawing to display buffers
+ *
+ * With tracking enabled, the @ref graphics record the area every primitive draws to.
+ * Once a buffer is shown, the areas drawn to it are remembered as out of date in every
+ * other buffer, and #display_sync_dirty copies only those areas forward after locking
+ * a buffer.  Code that only redraws what changed each frame then works with double and
+ * triple buffering without redrawing the whole screen.
+ *
+ * Drawing done directly with the @ref rdp must be reported with #display_mark_dirty.
+ *
+ * @param[in] enable
+ *            Nonzero to track drawing
+ */
+void display_set_dirty_tracking( int enable )
+{
+    if( !__width ) { return; }
+
+    disable_interrupts();
+
+    for( int i = 0; i < __buffers; i++ )
+    {
+        /* Nothing is known about how the buffers differ, start with a full copy */
+        drawn[i].count = 0;
+        stale[i].count = 1;
+        stale[i].rects[0].x0 = 0;
+        stale[i].rects[0].y0 = 0;
+        stale[i].rects[0].x1 = __width;
+        stale[i].rects[0].y1 = __height;
+    }
+
+    __dirty_tracking = enable ? 1 : 0;
+
     enable_interrupts();
 }
 
+/**
+ * @brief Mark an area of a display buffer as drawn
+ *
+ * @param[in] disp
+ *            A display context retrieved using #display_lock
+ * @param[in] x
+ *            Left edge of the area in pixels
+ * @param[in] y
+ *            Top edge of the area in pixels
+ * @param[in] width
+ *            Width of the area in pixels
+ * @param[in] height
+ *            Height of the area in pixels
+ */
+void display_mark_dirty( display_context_t disp, int x, int y, int width, int height )
+{
+    if( disp == 0 || !__dirty_tracking ) { return; }
+
+    dirty_rect_t rect = { x, y, x + width, y + height };
+
+    /* Clip to the display */
+    if( rect.x0 < 0 ) { rect.x0 = 0; }
+    if( rect.y0 < 0 ) { rect.y0 = 0; }
+    if( rect.x1 > (int)__width ) { rect.x1 = __width; }
+    if( rect.y1 > (int)__height ) { rect.y1 = __height; }
+    if( rect.x0 >= rect.x1 || rect.y0 >= rect.y1 ) { return; }
+
+    __dirty_add( &drawn[disp - 1], &rect );
+}
+
+/**
+ * @brief Bring a locked display buffer up to date with the most recently shown one
+ *
+ * Copies only the areas drawn to other buffers since this buffer was last shown.  Call
+ * right after #display_lock, before drawing what changed in this frame.  Does nothing
+ * unless #display_set_dirty_tracking is enabled.
+ *
+ * @param[in] disp
+ *            A display context retrieved using #display_lock
+ */
+void display_sync_dirty( display_context_t disp )
+{
+    if( disp == 0 || !__dirty_tracking ) { return; }
+
+    int i = disp - 1;
+
+    disable_interrupts();
+
+    int src = newest;
+    dirty_list_t list = stale[i];
+    stale[i].count = 0;
+
+    enable_interrupts();
+
+    if( src < 0 || src == i ) { return; }
+
+    /* Read through the uncached alias, the cache may hold stale lines of a buffer the RDP drew */
+    for( int r = 0; r < list.count; r++ )
+    {
+        dirty_rect_t *rect = &list.rects[r];
+        uint32_t offset = (rect->y0 * __width + rect->x0) * __bitdepth;
+        uint32_t bytes = (rect->x1 - rect->x0) * __bitdepth;
+
+        if( __cached_writes ) { __display_mark_rows( disp, rect->y0, rect->y1 - 1 ); }
+
+        for( int y = rect->y0; y < rect->y1; y++, offset += __width * __bitdepth )
+        {
+            memcpy( (uint8_t *)__draw_buffer[i] + offset, (uint8_t *)__safe_buffer[src] + offset, bytes );
+        }
+    }
+}
+
 /**
  * @brief Lock a display buffer for rendering
  *
  * Grab a display context that is safe for drawing.  If none is available
- * then this will return 0.  Do not check out more than one display
- * context at a time.
+ * then this will return 0.  Only check out more than one display context
+ * at a time when the previous one is waiting on the RDP, as with
+ * #rdp_detach_show.
  *
  * @return A valid display context to render to or 0 if none is available.
  */
@@ -428,10 +868,10 @@ display_context_t display_lock()
 
     for( int i = 0; i < __buffers; i++ )
     {
-        if( i != now_showing && i != now_drawing && i != show_next )
+        if( i != now_showing && !(now_drawing & (1 << i)) && i != show_next )
         {
             /* This screen should be returned */
-            now_drawing = i;
+            now_drawing |= 1 << i;
             retval = i + 1;
 
             break;
@@ -450,6 +890,8 @@ display_context_t display_lock()
  * Display a valid display context to the screen on the next vblank.  Display
  * contexts should be locked via #display_lock.
  *
+ * This function is safe to call from an interrupt handler.
+ *
  * @param[in] disp
  *            A display context retrieved using #display_lock
  */
@@ -458,6 +900,9 @@ void display_show( display_context_t disp )
     /* They tried drawing on a bad context */
     if( disp == 0 ) { return; }
 
+    /* Software drawing has to reach memory before the VI scans it out */
+    display_flush( disp );
+
     /* Can't have the video interrupt screwing this up */
     disable_interrupts();
 
@@ -465,11 +910,25 @@ void display_show( display_context_t disp )
     int i = disp - 1;
 
     /* This should match, or something went awry */
-    if( i == now_drawing )
+    if( now_drawing & (1 << i) )
     {
         /* Ensure we display this next time */
-        now_drawing = -1;
+        now_drawing &= ~(1 << i);
         show_next = i;
+
+        /* Everything drawn this frame is now out of date in the other buffers */
+        if( __dirty_tracking )
+        {
+            for( int j = 0; j < __buffers; j++ )
+            {
+                if( j == i ) { continue; }
+
+                for( int r = 0; r < drawn[i].count; r++ ) { __dirty_add( &stale[j], &drawn[i].rects[r] ); }
+            }
+
+            drawn[i].count = 0;
+            newest = i;
+        }
     }
 
     enable_interrupts();
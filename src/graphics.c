@@ -9,6 +9,8 @@
 #include "display.h"
 #include "graphics.h"
 #include "font.h"
+#include "dragonfs.h"
+#include "n64sys.h"
 
 /**
  * @defgroup graphics 2D Graphics
@@ -87,12 +89,21 @@
  *
  * @return A pointer to the current drawing surface for the display context
  */
-#define __get_buffer( x ) __safe_buffer[(x)-1]
+#define __get_buffer( x ) __draw_buffer[(x)-1]
 
 extern uint32_t __bitdepth;
 extern uint32_t __width;
 extern uint32_t __height;
-extern void *__safe_buffer[];
+extern void *__draw_buffer[];
+extern int __cached_writes;
+extern int __dirty_tracking;
+extern void __display_mark_rows( display_context_t disp, int top, int bottom );
+
+extern int __rdp_fills_pending;
+extern int __rdp_attached( display_context_t disp );
+extern void __rdp_wait_fills( display_context_t disp );
+extern void __rdp_fill_rectangle( int tx, int ty, int bx, int by, uint32_t color );
+extern void __rdp_fill_polygon( const int *points, int count, uint32_t color );
 
 /**
  * @brief Generic foreground color
@@ -107,6 +118,100 @@ static uint32_t f_color = 0xFFFFFFFF;
  */
 static uint32_t b_color = 0x00000000;
 
+/**
+ * @brief Record an area about to be drawn by the RDP or the CPU
+ *
+ * The rows are written back by #display_flush when drawing through the cache, and the
+ * area is tracked for #display_sync_dirty when dirty tracking is enabled.
+ *
+ * @param[in] disp
+ *            The currently active display context
+ * @param[in] x
+ *            Left edge of the area
+ * @param[in] y
+ *            Top edge of the area
+ * @param[in] width
+ *            Width of the area in pixels
+ * @param[in] height
+ *            Height of the area in pixels
+ */
+static inline void __track_rect( display_context_t disp, int x, int y, int width, int height )
+{
+    if( __cached_writes ) { __display_mark_rows( disp, y, y + height - 1 ); }
+    if( __dirty_tracking ) { display_mark_dirty( disp, x, y, width, height ); }
+}
+
+/**
+ * @brief Record an area about to be drawn by the CPU
+ *
+ * Fills that were handed to the RDP are waited for first, so that software drawing
+ * always ends up on top of them.
+ *
+ * @param[in] disp
+ *            The currently active display context
+ * @param[in] x
+ *            Left edge of the area
+ * @param[in] y
+ *            Top edge of the area
+ * @param[in] width
+ *            Width of the area in pixels
+ * @param[in] height
+ *            Height of the area in pixels
+ */
+static inline void __mark_rect( display_context_t disp, int x, int y, int width, int height )
+{
+    if( __rdp_fills_pending ) { __rdp_wait_fills( disp ); }
+
+    __track_rect( disp, x, y, width, height );
+}
+
+/** @brief Maximum number of sprites with span tables at once */
+#define MAX_SPAN_SPRITES    16
+
+/** @brief Span of fully transparent pixels */
+#define SPAN_TRANSPARENT    0x0000
+/** @brief Span of fully opaque pixels */
+#define SPAN_OPAQUE         0x4000
+/** @brief Span of pixels that need blending */
+#define SPAN_TRANSLUCENT    0x8000
+/** @brief Mask of the span type in a span entry */
+#define SPAN_TYPE_MASK      0xC000
+/** @brief Longest span a single entry can hold */
+#define SPAN_MAX_LENGTH     0x3FFF
+
+/**
+ * @brief Precomputed transparency spans of a sprite
+ *
+ * Each row is a list of entries holding a span type and a length in pixels, see
+ * #graphics_sprite_enable_spans.
+ */
+typedef struct
+{
+    /** @brief Sprite the spans were computed for, or 0 if the slot is free */
+    sprite_t *sprite;
+    /** @brief Index of the first entry of each row, plus one past the last row */
+    uint32_t *rows;
+    /** @brief Span entries of all rows */
+    uint16_t *spans;
+} sprite_spans_t;
+
+/** @brief Span tables of sprites registered with #graphics_sprite_enable_spans */
+static sprite_spans_t sprite_spans[MAX_SPAN_SPRITES];
+
+/** @brief Glyphs of the built-in font expanded to framebuffer pixels, 0 until first used */
+static void *glyph_cache = 0;
+/** @brief Bit depth the glyph cache was allocated for */
+static uint32_t glyph_depth = 0;
+/** @brief Foreground color the cached glyphs were expanded with */
+static uint32_t glyph_fg = 0;
+/** @brief Background color the cached glyphs were expanded with */
+static uint32_t glyph_bg = 0;
+/** @brief Bitmask of characters already expanded into the glyph cache */
+static uint32_t glyph_valid[256 / 32];
+
+/** @brief Font used for text, or 0 for the built-in 8x8 font */
+static font_t *cur_font = 0;
+
 /**
  * @brief Return a 32-bit representation of an RGBA color
  *
@@ -184,6 +289,125 @@ void graphics_set_color( uint32_t forecolor, uint32_t backcolor )
     b_color = backcolor;
 }
 
+/**
+ * @brief Get the current forecolor and backcolor for text operations
+ *
+ * Used by the console to notice color changes made with #graphics_set_color.
+ *
+ * @param[out] forecolor
+ *             Current text color
+ * @param[out] backcolor
+ *             Current background color
+ */
+void __graphics_get_color( uint32_t *forecolor, uint32_t *backcolor )
+{
+    *forecolor = f_color;
+    *backcolor = b_color;
+}
+
+/**
+ * @brief Generate a row copy for one pixel type
+ *
+ * The generated function copies a run of pixels with doubleword loads and stores
+ * when source and destination share their alignment within a doubleword, handling
+ * the unaligned head and tail one pixel at a time.  Otherwise it copies pixel by
+ * pixel.
+ *
+ * @param[in] name
+ *            Name of the function to generate
+ * @param[in] type
+ *            Pixel type
+ */
+#define __DEFINE_BLIT_ROW( name, type ) \
+    static inline void name( type *dst, const type *src, int count ) \
+    { \
+        if( (((uint32_t)dst ^ (uint32_t)src) & 7) == 0 ) \
+        { \
+            /* Head up to the first doubleword boundary */ \
+            while( count > 0 && ((uint32_t)dst & 7) ) { *dst++ = *src++; count--; } \
+\
+            uint64_t *dst64 = (uint64_t *)dst; \
+            const uint64_t *src64 = (const uint64_t *)src; \
+            const int per64 = sizeof(uint64_t) / sizeof(type); \
+\
+            for( ; count >= 2 * per64; count -= 2 * per64 ) \
+            { \
+                uint64_t a = src64[0]; \
+                uint64_t b = src64[1]; \
+                dst64[0] = a; \
+                dst64[1] = b; \
+                dst64 += 2; \
+                src64 += 2; \
+            } \
+\
+            if( count >= per64 ) { *dst64++ = *src64++; count -= per64; } \
+\
+            dst = (type *)dst64; \
+            src = (const type *)src64; \
+        } \
+\
+        /* Tail, or everything when alignment differs */ \
+        while( count-- > 0 ) { *dst++ = *src++; } \
+    }
+
+/** @brief Copy a run of 16-bit pixels */
+__DEFINE_BLIT_ROW( __blit_row16, uint16_t )
+/** @brief Copy a run of 32-bit pixels */
+__DEFINE_BLIT_ROW( __blit_row32, uint32_t )
+
+/**
+ * @brief Fill a run of 16-bit pixels using doubleword stores where possible
+ *
+ * @param[out] dst
+ *             First pixel of the run
+ * @param[in]  count
+ *             Number of pixels to fill
+ * @param[in]  color
+ *             16-bit color in the lower half
+ */
+static inline void __fill_span16( uint16_t *dst, int count, uint32_t color )
+{
+    uint16_t c = color & 0xFFFF;
+    uint32_t c32 = c | (c << 16);
+    uint64_t pattern = ((uint64_t)c32 << 32) | c32;
+
+    /* Head up to the first doubleword boundary */
+    while( count > 0 && ((uint32_t)dst & 7) ) { *dst++ = c; count--; }
+
+    uint64_t *dst64 = (uint64_t *)dst;
+
+    for( ; count >= 4; count -= 4 ) { *dst64++ = pattern; }
+
+    /* Tail */
+    dst = (uint16_t *)dst64;
+    while( count-- > 0 ) { *dst++ = c; }
+}
+
+/**
+ * @brief Fill a run of 32-bit pixels using doubleword stores where possible
+ *
+ * @param[out] dst
+ *             First pixel of the run
+ * @param[in]  count
+ *             Number of pixels to fill
+ * @param[in]  color
+ *             32-bit color
+ */
+static inline void __fill_span32( uint32_t *dst, int count, uint32_t color )
+{
+    uint64_t pattern = ((uint64_t)color << 32) | color;
+
+    /* Head up to the first doubleword boundary */
+    if( count > 0 && ((uint32_t)dst & 7) ) { *dst++ = color; count--; }
+
+    uint64_t *dst64 = (uint64_t *)dst;
+
+    for( ; count >= 2; count -= 2 ) { *dst64++ = pattern; }
+
+    /* Tail */
+    if( count > 0 ) { *(uint32_t *)dst64 = color; }
+}
+
 /**
  * @brief Return whether a color is fully transparent at a particular bit depth
  *
@@ -211,6 +435,259 @@ static int __is_transparent( int bitdepth, uint32_t color )
     return 0;
 }
 
+/**
+ * @brief Blend two 32-bit colors with a given weight
+ *
+ * Red and blue, then green and alpha, are blended as pairs of 16-bit lanes in one
+ * register each, so a pixel takes four multiplies instead of six.
+ *
+ * @param[in] cur_color
+ *            Color currently in the framebuffer
+ * @param[in] color
+ *            32-bit RGBA color to blend over it
+ * @param[in] weight
+ *            Weight of color from 0 to 256
+ *
+ * @return The opaque blended color
+ */
+static inline uint32_t __blend32_weight( uint32_t cur_color, uint32_t color, uint32_t weight )
+{
+    uint32_t inv = 256 - weight;
+    uint32_t rb = ((((color >> 8) & 0x00FF00FF) * weight) + (((cur_color >> 8) & 0x00FF00FF) * inv)) & 0xFF00FF00;
+    uint32_t ga = ((((color & 0x00FF00FF) * weight) + ((cur_color & 0x00FF00FF) * inv)) >> 8) & 0x00FF0000;
+
+    /* Since we are doing mixing anyway */
+    return rb | ga | 0xFF;
+}
+
+/**
+ * @brief Blend a 32-bit color over a framebuffer pixel using its alpha
+ *
+ * @param[in] cur_color
+ *            Color currently in the framebuffer
+ * @param[in] color
+ *            32-bit RGBA color to blend over it
+ *
+ * @return The opaque blended color
+ */
+static inline uint32_t __blend32( uint32_t cur_color, uint32_t color )
+{
+    uint32_t st = color & 0xFF;
+
+    /* Map 0-255 onto 0-256 so full alpha gives exactly the new color */
+    return __blend32_weight( cur_color, color, st + (st >> 7) );
+}
+
+/**
+ * @brief Blend results of every pair of 5-bit channel values, indexed by new then current value
+ *
+ * See #__blend16_setup.
+ */
+static uint8_t blend_table[32][32];
+/** @brief 5-bit alpha the blend table was computed for, or -1 if none */
+static int blend_alpha = -1;
+
+/**
+ * @brief Prepare the 16-bit blend table for an alpha value
+ *
+ * The table is only recomputed when the alpha, reduced to 5 bits, changes.
+ *
+ * @param[in] alpha
+ *            Opacity of the new color from 0 to 255
+ */
+static void __blend16_setup( int alpha )
+{
+    int a = (alpha * 31 + 127) / 255;
+
+    if( a == blend_alpha ) { return; }
+
+    for( int s = 0; s < 32; s++ )
+    {
+        for( int d = 0; d < 32; d++ )
+        {
+            blend_table[s][d] = (s * a + d * (31 - a) + 15) / 31;
+        }
+    }
+
+    blend_alpha = a;
+}
+
+/**
+ * @brief Blend a 16-bit color over a framebuffer pixel using the blend table
+ *
+ * @param[in] cur_color
+ *            Color currently in the framebuffer
+ * @param[in] color
+ *            16-bit color to blend over it
+ *
+ * @return The opaque blended color
+ */
+static inline uint16_t __blend16( uint16_t cur_color, uint16_t color )
+{
+    return (blend_table[color >> 11][cur_color >> 11] << 11) |
+           (blend_table[(color >> 6) & 0x1F][(cur_color >> 6) & 0x1F] << 6) |
+           (blend_table[(color >> 1) & 0x1F][(cur_color >> 1) & 0x1F] << 1) | 1;
+}
+
+/**
+ * @brief Classify a sprite pixel for span tables
+ *
+ * @param[in] bitdepth
+ *            Bit depth of the sprite in bytes
+ * @param[in] color
+ *            Pixel color
+ *
+ * @return #SPAN_TRANSPARENT, #SPAN_OPAQUE or #SPAN_TRANSLUCENT
+ */
+static uint16_t __span_type( int bitdepth, uint32_t color )
+{
+    if( __is_transparent( bitdepth, color ) ) { return SPAN_TRANSPARENT; }
+
+    /* 16-bit pixels have a single bit of alpha */
+    if( bitdepth == 2 || (color & 0xFF) == 0xFF ) { return SPAN_OPAQUE; }
+
+    return SPAN_TRANSLUCENT;
+}
+
+/**
+ * @brief Walk a sprite and store its spans
+ *
+ * @param[in]  sprite
+ *             Sprite to classify
+ * @param[out] rows
+ *             Receives the index of the first entry of each row, or 0 to only count
+ * @param[out] spans
+ *             Receives the span entries, or 0 to only count
+ *
+ * @return The number of span entries
+ */
+static uint32_t __build_spans( sprite_t *sprite, uint32_t *rows, uint16_t *spans )
+{
+    uint32_t count = 0;
+
+    for( int y = 0; y < sprite->height; y++ )
+    {
+        if( rows ) { rows[y] = count; }
+
+        int x = 0;
+
+        while( x < sprite->width )
+        {
+            uint32_t first = (sprite->bitdepth == 2) ? ((uint16_t *)sprite->data)[y * sprite->width + x]
+                                                     : sprite->data[y * sprite->width + x];
+            uint16_t type = __span_type( sprite->bitdepth, first );
+            int length = 1;
+
+            while( x + length < sprite->width && length < SPAN_MAX_LENGTH )
+            {
+                uint32_t color = (sprite->bitdepth == 2) ? ((uint16_t *)sprite->data)[y * sprite->width + x + length]
+                                                         : sprite->data[y * sprite->width + x + length];
+
+                if( __span_type( sprite->bitdepth, color ) != type ) { break; }
+
+                length++;
+            }
+
+            if( spans ) { spans[count] = type | length; }
+
+            count++;
+            x += length;
+        }
+    }
+
+    if( rows ) { rows[sprite->height] = count; }
+
+    return count;
+}
+
+/**
+ * @brief Find the span table of a sprite
+ *
+ * @param[in] sprite
+ *            Sprite to look up
+ *
+ * @return The span table, or 0 if spans are not enabled for this sprite
+ */
+static sprite_spans_t *__find_spans( sprite_t *sprite )
+{
+    for( int i = 0; i < MAX_SPAN_SPRITES; i++ )
+    {
+        if( sprite_spans[i].sprite == sprite ) { return &sprite_spans[i]; }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Precompute transparency spans of a sprite
+ *
+ * Each row of the sprite is split into runs of transparent, opaque and, for 32-bit
+ * sprites, translucent pixels.  #graphics_draw_sprite_trans and
+ * #graphics_draw_sprite_trans_stride then skip transparent runs, copy opaque runs
+ * as a whole and only blend translucent pixels, which is much faster for typical
+ * sprites with large transparent or opaque areas.
+ *
+ * The sprite must not be modified or freed while spans are enabled.  Call
+ * #graphics_sprite_disable_spans first.
+ *
+ * @param[in] sprite
+ *            Sprite to precompute spans for
+ *
+ * @retval 0 if the spans were computed or already present
+ * @retval -1 if the sprite is invalid or out of memory or span slots
+ */
+int graphics_sprite_enable_spans( sprite_t *sprite )
+{
+    if( sprite == 0 ) { return -1; }
+    if( sprite->bitdepth != 2 && sprite->bitdepth != 4 ) { return -1; }
+    if( sprite->width == 0 || sprite->height == 0 ) { return -1; }
+    if( __find_spans( sprite ) ) { return 0; }
+
+    sprite_spans_t *slot = __find_spans( 0 );
+    if( !slot ) { return -1; }
+
+    uint32_t count = __build_spans( sprite, 0, 0 );
+    uint32_t *rows = malloc( (sprite->height + 1) * sizeof(uint32_t) );
+    uint16_t *spans = malloc( count * sizeof(uint16_t) );
+
+    if( !rows || !spans )
+    {
+        if( rows ) { free( rows ); }
+        if( spans ) { free( spans ); }
+
+        return -1;
+    }
+
+    __build_spans( sprite, rows, spans );
+
+    slot->rows = rows;
+    slot->spans = spans;
+    slot->sprite = sprite;
+
+    return 0;
+}
+
+/**
+ * @brief Free the transparency spans of a sprite
+ *
+ * @param[in] sprite
+ *            Sprite passed to #graphics_sprite_enable_spans
+ */
+void graphics_sprite_disable_spans( sprite_t *sprite )
+{
+    if( sprite == 0 ) { return; }
+
+    sprite_spans_t *slot = __find_spans( sprite );
+    if( !slot ) { return; }
+
+    free( slot->rows );
+    free( slot->spans );
+
+    slot->sprite = 0;
+    slot->rows = 0;
+    slot->spans = 0;
+}
+
 /**
  * @brief Draw a pixel to a given display context
  *
@@ -231,6 +708,8 @@ void graphics_draw_pixel( display_context_t disp, int x, int y, uint32_t color )
 {
     if( disp == 0 ) { return; }
 
+    __mark_rect( disp, x, y, 1, 1 );
+
     if( __bitdepth == 2 )
     {
         __set_pixel( (uint16_t *)__get_buffer( disp ), x, y, color );
@@ -261,6 +740,8 @@ void graphics_draw_pixel_trans( display_context_t disp, int x, int y, uint32_t c
 {
     if( disp == 0 ) { return; }
 
+    __mark_rect( disp, x, y, 1, 1 );
+
     if( __bitdepth == 2 )
     {
         /* Only display the pixel if alpha bit is set */
@@ -271,244 +752,371 @@ void graphics_draw_pixel_trans( display_context_t disp, int x, int y, uint32_t c
     }
     else
     {
-        /* Get 32bit representations */
-        uint32_t cur_color = __get_pixel( (uint32_t *)__get_buffer( disp ), x, y );
+        uint32_t *buffer32 = (uint32_t *)__get_buffer( disp );
+
+        __set_pixel( buffer32, x, y, __blend32( __get_pixel( buffer32, x, y ), color ) );
+    }
+}
 
-        /* Get current color */
-        uint32_t cr = (cur_color >> 24) & 0xFF;
-        uint32_t cg = (cur_color >> 16) & 0xFF;
-        uint32_t cb = (cur_color >> 8) & 0xFF;
+/**
+ * @brief Clip a Bresenham line to the display along its major axis
+ *
+ * Step k of the line is at major coordinate a0 + sa * k and minor coordinate
+ * b0 + sb * floor((2 * k * m + n) / (2 * n)), the same pixels the Bresenham loop visits.
+ * Since both only ever move one way, the steps on the display form one range, found
+ * here without walking the line.
+ *
+ * @param[in]  a0
+ *             Major coordinate of the start
+ * @param[in]  sa
+ *             Direction along the major axis, 1 or -1
+ * @param[in]  amax
+ *             Size of the display along the major axis
+ * @param[in]  b0
+ *             Minor coordinate of the start
+ * @param[in]  sb
+ *             Direction along the minor axis, 1 or -1
+ * @param[in]  bmax
+ *             Size of the display along the minor axis
+ * @param[in]  n
+ *             Length of the line along the major axis
+ * @param[in]  m
+ *             Length of the line along the minor axis, at most n
+ * @param[out] kmin
+ *             First step on the display
+ * @param[out] kmax
+ *             Last step on the display
+ *
+ * @return Nonzero if any part of the line is on the display
+ */
+static int __line_clip( int a0, int sa, int amax, int b0, int sb, int bmax, int n, int m, int *kmin, int *kmax )
+{
+    int64_t lo = 0;
+    int64_t hi = n;
 
-        /* Get new color */
-        uint32_t sr = (color >> 24) & 0xFF;
-        uint32_t sg = (color >> 16) & 0xFF;
-        uint32_t sb = (color >> 8) & 0xFF;
+    /* Major axis */
+    int64_t alo = (sa > 0) ? -a0 : a0 - (amax - 1);
+    int64_t ahi = (sa > 0) ? (amax - 1) - a0 : a0;
 
-        /* Transparencies */
-        uint32_t st = color & 0xFF;
-        uint32_t ct = 255 - st;
+    if( alo > lo ) { lo = alo; }
+    if( ahi < hi ) { hi = ahi; }
 
-        /* Mixed color */
-        uint32_t mixed_color;
-        uint8_t *final_color = (uint8_t *)(&mixed_color);
+    /* Minor axis, as a range of minor steps */
+    int64_t mlo = (sb > 0) ? -b0 : b0 - (bmax - 1);
+    int64_t mhi = (sb > 0) ? (bmax - 1) - b0 : b0;
 
-        final_color[0] = ((cr * ct) + (sr * st)) >> 8;
-        final_color[1] = ((cg * ct) + (sg * st)) >> 8;
-        final_color[2] = ((cb * ct) + (sb * st)) >> 8;
+    if( mhi < 0 ) { return 0; }
 
-        /* Since we are doing mixing anyway */
-        final_color[3] = 255;
+    if( m == 0 )
+    {
+        if( mlo > 0 ) { return 0; }
+    }
+    else
+    {
+        /* First step with at least mlo minor steps */
+        if( mlo > 0 )
+        {
+            int64_t k = (2 * (int64_t)n * mlo - n + 2 * m - 1) / (2 * m);
+            if( k > lo ) { lo = k; }
+        }
 
-        __set_pixel( (uint32_t *)__get_buffer( disp ), x, y, mixed_color );
+        /* Last step with at most mhi minor steps */
+        int64_t k = (2 * (int64_t)n * (mhi + 1) - n + 2 * m - 1) / (2 * m) - 1;
+        if( k < hi ) { hi = k; }
     }
+
+    if( lo > hi ) { return 0; }
+
+    *kmin = lo;
+    *kmax = hi;
+
+    return 1;
 }
 
 /**
- * @brief Draw a line to a given display context
- * 
- * @note This function does not support transparency for speed purposes.  To draw
- * a transparent or translucent line, use #graphics_draw_line_trans.
+ * @brief Bresenham inner loop stepping a framebuffer pointer
  *
- * @param[in] disp
- *            The currently active display context.
- * @param[in] x0
- *            The x coordinate of the start of the line.
- * @param[in] y0
- *            The y coordinate of the start of the line. 
- * @param[in] x1
- *            The x coordinate of the end of the line.
- * @param[in] y1
- *            The y coordinate of the end of the line. 
- * @param[in] color
- *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
- *            or #graphics_make_color to generate this value.
+ * @param[in] type
+ *            Pixel type
+ * @param[in] plot
+ *            Statement drawing the pixel at pixel pointer p
  */
-void graphics_draw_line( display_context_t disp, int x0, int y0, int x1, int y1, uint32_t color )
-{
-	int dy = y1 - y0;
-	int dx = x1 - x0;
-	int sx, sy;
-
-	if(dy < 0)
-	{
-		dy = -dy;
-		sy = -1;
-	}
-	else
-		sy = 1;
-
-	if(dx < 0)
-	{
-		dx = -dx;
-		sx = -1;
-	}
-	else
-		sx = 1;
-
-	dy <<= 1;
-	dx <<= 1;
-
-	graphics_draw_pixel(disp, x0, y0, color);
-	if(dx > dy)
-	{
-		int frac = dy - (dx >> 1);
-		while(x0 != x1)
-		{
-			if(frac >= 0)
-			{
-				y0 += sy;
-				frac -= dx;
-			}
-			x0 += sx;
-			frac += dy;
-			graphics_draw_pixel(disp, x0, y0 , color);
-		}
-	}
-	else
-	{
-		int frac = dx - (dy >> 1);
-		while(y0 != y1)
-		{
-			if(frac >= 0)
-			{
-				x0 += sx;
-				frac -= dy;
-			}
-			y0 += sy;
-			frac += dx;
-			graphics_draw_pixel(disp, x0, y0 , color);
-		}
-	}
-}
+#define __LINE_LOOP( type, plot ) \
+    { \
+        type *p = (type *)__get_buffer( disp ) + (y * __width + x); \
+\
+        for( int k = kmin; k <= kmax; k++ ) \
+        { \
+            plot; \
+\
+            if( frac >= 0 ) \
+            { \
+                p += minor_step; \
+                frac -= n2; \
+            } \
+\
+            p += major_step; \
+            frac += m2; \
+        } \
+    }
 
 /**
- * @brief Draw a line to a given display context with alpha support
- *
- * @note This function is much slower than #graphics_draw_line for 32-bit
- * buffers due to the need to sample the current pixel to do software alpha-blending.
+ * @brief Draw a clipped line, shared by #graphics_draw_line and #graphics_draw_line_trans
  *
  * @param[in] disp
  *            The currently active display context.
  * @param[in] x0
  *            The x coordinate of the start of the line.
  * @param[in] y0
- *            The y coordinate of the start of the line. 
+ *            The y coordinate of the start of the line.
  * @param[in] x1
  *            The x coordinate of the end of the line.
  * @param[in] y1
- *            The y coordinate of the end of the line. 
+ *            The y coordinate of the end of the line.
  * @param[in] color
- *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
- *            or #graphics_make_color to generate this value.
+ *            The 32-bit RGBA color to draw
+ * @param[in] trans
+ *            Nonzero to blend 32-bit colors using their alpha and skip transparent
+ *            16-bit colors
  */
-void graphics_draw_line_trans( display_context_t disp, int x0, int y0, int x1, int y1, uint32_t color )
+static void __draw_line( display_context_t disp, int x0, int y0, int x1, int y1, uint32_t color, int trans )
 {
-	int dy = y1 - y0;
-	int dx = x1 - x0;
-	int sx, sy;
-
-	if(dy < 0)
-	{
-		dy = -dy;
-		sy = -1;
-	}
-	else
-		sy = 1;
-
-	if(dx < 0)
-	{
-		dx = -dx;
-		sx = -1;
-	}
-	else
-		sx = 1;
-
-	dy <<= 1;
-	dx <<= 1;
-
-	graphics_draw_pixel_trans(disp, x0, y0, color);
-	if(dx > dy)
-	{
-		int frac = dy - (dx >> 1);
-		while(x0 != x1)
-		{
-			if(frac >= 0)
-			{
-				y0 += sy;
-				frac -= dx;
-			}
-			x0 += sx;
-			frac += dy;
-			graphics_draw_pixel_trans(disp, x0, y0 , color);
-		}
-	}
-	else
-	{
-		int frac = dx - (dy >> 1);
-		while(y0 != y1)
-		{
-			if(frac >= 0)
-			{
-				x0 += sx;
-				frac -= dy;
-			}
-			y0 += sy;
-			frac += dx;
-			graphics_draw_pixel_trans(disp, x0, y0 , color);
-		}
-	}
-}
+    if( disp == 0 ) { return; }
+    if( trans && __bitdepth == 2 && __is_transparent( 2, color ) ) { return; }
 
-/**
- * @brief Draw a filled rectangle to a display context
- *
- * @note This function does not support transparency for speed purposes.  To draw
- * a transparent or translucent box, use #graphics_draw_box_trans.
- *
- * @param[in] disp
- *            The currently active display context.
- * @param[in] x
- *            The x coordinate of the top left of the box.
- * @param[in] y
- *            The y coordinate of the top left of the box.
- * @param[in] width
- *            The width of the box in pixels.
- * @param[in] height
- *            The height of the box in pixels.
+    /* Cohen-Sutherland style trivial reject when both ends are off the same side */
+    if( (x0 < 0 && x1 < 0) || (y0 < 0 && y1 < 0) ) { return; }
+    if( (x0 >= (int)__width && x1 >= (int)__width) || (y0 >= (int)__height && y1 >= (int)__height) ) { return; }
+
+    int blend = trans && __bitdepth == 4;
+
+    /* Horizontal and vertical lines are spans and columns */
+    if( y0 == y1 && !blend )
+    {
+        int left = (x0 < x1) ? x0 : x1;
+        int right = (x0 < x1) ? x1 : x0;
+
+        if( left < 0 ) { left = 0; }
+        if( right >= (int)__width ) { right = __width - 1; }
+
+        __mark_rect( disp, left, y0, right - left + 1, 1 );
+
+        if( __bitdepth == 2 )
+        {
+            __fill_span16( (uint16_t *)__get_buffer( disp ) + y0 * __width + left, right - left + 1, color );
+        }
+        else
+        {
+            __fill_span32( (uint32_t *)__get_buffer( disp ) + y0 * __width + left, right - left + 1, color );
+        }
+
+        return;
+    }
+
+    if( x0 == x1 && !blend )
+    {
+        int top = (y0 < y1) ? y0 : y1;
+        int bottom = (y0 < y1) ? y1 : y0;
+
+        if( top < 0 ) { top = 0; }
+        if( bottom >= (int)__height ) { bottom = __height - 1; }
+
+        __mark_rect( disp, x0, top, 1, bottom - top + 1 );
+
+        if( __bitdepth == 2 )
+        {
+            uint16_t *p = (uint16_t *)__get_buffer( disp ) + top * __width + x0;
+
+            for( int y = top; y <= bottom; y++, p += __width ) { *p = color; }
+        }
+        else
+        {
+            uint32_t *p = (uint32_t *)__get_buffer( disp ) + top * __width + x0;
+
+            for( int y = top; y <= bottom; y++, p += __width ) { *p = color; }
+        }
+
+        return;
+    }
+
+    int dx = (x1 > x0) ? x1 - x0 : x0 - x1;
+    int dy = (y1 > y0) ? y1 - y0 : y0 - y1;
+    int sx = (x1 < x0) ? -1 : 1;
+    int sy = (y1 < y0) ? -1 : 1;
+    int x_major = dx > dy;
+
+    /* Work along the major axis */
+    int n = x_major ? dx : dy;
+    int m = x_major ? dy : dx;
+    int kmin, kmax;
+
+    if( x_major )
+    {
+        if( !__line_clip( x0, sx, __width, y0, sy, __height, n, m, &kmin, &kmax ) ) { return; }
+    }
+    else
+    {
+        if( !__line_clip( y0, sy, __height, x0, sx, __width, n, m, &kmin, &kmax ) ) { return; }
+    }
+
+    /* Jump straight to the first visible step */
+    int minor = (int)((2 * (int64_t)kmin * m + n) / (2 * n));
+    int x = x0 + sx * (x_major ? kmin : minor);
+    int y = y0 + sy * (x_major ? minor : kmin);
+    int last_minor = (int)((2 * (int64_t)kmax * m + n) / (2 * n));
+    int ex = x0 + sx * (x_major ? kmax : last_minor);
+    int ey = y0 + sy * (x_major ? last_minor : kmax);
+    int n2 = n << 1;
+    int m2 = m << 1;
+    int frac = m2 - n + kmin * m2 - minor * n2;
+    int major_step = x_major ? sx : sy * (int)__width;
+    int minor_step = x_major ? sy * (int)__width : sx;
+
+    __mark_rect( disp, (x < ex) ? x : ex, (y < ey) ? y : ey, ((x < ex) ? ex - x : x - ex) + 1, ((y < ey) ? ey - y : y - ey) + 1 );
+
+    if( blend ) { __LINE_LOOP( uint32_t, *p = __blend32( *p, color ) ) }
+    else if( __bitdepth == 2 ) { __LINE_LOOP( uint16_t, *p = color ) }
+    else { __LINE_LOOP( uint32_t, *p = color ) }
+}
+
+/**
+ * @brief Draw a line to a given display context
+ * 
+ * @note This function does not support transparency for speed purposes.  To draw
+ * a transparent or translucent line, use #graphics_draw_line_trans.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] x0
+ *            The x coordinate of the start of the line.
+ * @param[in] y0
+ *            The y coordinate of the start of the line. 
+ * @param[in] x1
+ *            The x coordinate of the end of the line.
+ * @param[in] y1
+ *            The y coordinate of the end of the line. 
  * @param[in] color
  *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
  *            or #graphics_make_color to generate this value.
  */
-void graphics_draw_box( display_context_t disp, int x, int y, int width, int height, uint32_t color )
+void graphics_draw_line( display_context_t disp, int x0, int y0, int x1, int y1, uint32_t color )
 {
-    if( disp == 0 ) { return; }
+    __draw_line( disp, x0, y0, x1, y1, color, 0 );
+}
+
+/**
+ * @brief Draw a line to a given display context with alpha support
+ *
+ * @note This function is much slower than #graphics_draw_line for 32-bit
+ * buffers due to the need to sample the current pixel to do software alpha-blending.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] x0
+ *            The x coordinate of the start of the line.
+ * @param[in] y0
+ *            The y coordinate of the start of the line. 
+ * @param[in] x1
+ *            The x coordinate of the end of the line.
+ * @param[in] y1
+ *            The y coordinate of the end of the line. 
+ * @param[in] color
+ *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
+ *            or #graphics_make_color to generate this value.
+ */
+void graphics_draw_line_trans( display_context_t disp, int x0, int y0, int x1, int y1, uint32_t color )
+{
+    __draw_line( disp, x0, y0, x1, y1, color, 1 );
+}
 
+/**
+ * @brief Fill an already clipped rectangle with the CPU
+ *
+ * @param[in] disp
+ *            The currently active display context
+ * @param[in] x
+ *            The x coordinate of the top left of the box
+ * @param[in] y
+ *            The y coordinate of the top left of the box
+ * @param[in] width
+ *            The width of the box in pixels
+ * @param[in] height
+ *            The height of the box in pixels
+ * @param[in] color
+ *            The 32-bit RGBA color to fill with
+ */
+static void __fill_box( display_context_t disp, int x, int y, int width, int height, uint32_t color )
+{
     if( __bitdepth == 2 )
     {
-        uint16_t *buffer16 = (uint16_t *)__get_buffer( disp );
+        uint16_t *buffer16 = (uint16_t *)__get_buffer( disp ) + y * __width + x;
 
-        for(int j = y; j < y + height; j++)
+        for( int j = 0; j < height; j++, buffer16 += __width )
         {
-            for(int i = x; i < x + width; i++)
-            {
-                __set_pixel( buffer16, i, j, color );
-            }
+            __fill_span16( buffer16, width, color );
         }
     }
     else
     {
-        uint32_t *buffer32 = (uint32_t *)__get_buffer( disp );
+        uint32_t *buffer32 = (uint32_t *)__get_buffer( disp ) + y * __width + x;
 
-        for(int j = y; j < y + height; j++)
+        for( int j = 0; j < height; j++, buffer32 += __width )
         {
-            for(int i = x; i < x + width; i++)
-            {
-                __set_pixel( buffer32, i, j, color );
-            }
+            __fill_span32( buffer32, width, color );
         }
     }
 }
 
+/**
+ * @brief Draw a filled rectangle to a display context
+ *
+ * @note This function does not support transparency for speed purposes.  To draw
+ * a transparent or translucent box, use #graphics_draw_box_trans.
+ *
+ * If the RDP is attached to the display context, the box is drawn by the RDP in fill
+ * mode and queued behind any pending hardware drawing.  Otherwise it is drawn by the
+ * CPU.  The box is clipped to the display, whatever clipping rectangle the RDP uses.
+ *
+ * Other software drawing to the display context waits for the RDP to finish the fill
+ * first, so text or sprites drawn afterwards end up on top of the box.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] x
+ *            The x coordinate of the top left of the box.
+ * @param[in] y
+ *            The y coordinate of the top left of the box.
+ * @param[in] width
+ *            The width of the box in pixels.
+ * @param[in] height
+ *            The height of the box in pixels.
+ * @param[in] color
+ *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
+ *            or #graphics_make_color to generate this value.
+ */
+void graphics_draw_box( display_context_t disp, int x, int y, int width, int height, uint32_t color )
+{
+    if( disp == 0 ) { return; }
+
+    /* Clip to the display */
+    if( x < 0 ) { width += x; x = 0; }
+    if( y < 0 ) { height += y; y = 0; }
+    if( x + width > (int)__width ) { width = __width - x; }
+    if( y + height > (int)__height ) { height = __height - y; }
+    if( width <= 0 || height <= 0 ) { return; }
+
+    /* Let the RDP do it if it is already rendering to this context */
+    if( __rdp_attached( disp ) )
+    {
+        __track_rect( disp, x, y, width, height );
+        __rdp_fill_rectangle( x, y, x + width - 1, y + height - 1, color );
+        return;
+    }
+
+    __mark_rect( disp, x, y, width, height );
+    __fill_box( disp, x, y, width, height, color );
+}
+
 /**
  * @brief Draw a filled rectangle to a display context
  *
@@ -533,6 +1141,8 @@ void graphics_draw_box_trans( display_context_t disp, int x, int y, int width, i
 {
     if( disp == 0 ) { return; }
 
+    __mark_rect( disp, x, y, width, height );
+
     if( __bitdepth == 2 )
     {
         uint16_t *buffer16 = (uint16_t *)__get_buffer( disp );
@@ -551,165 +1161,711 @@ void graphics_draw_box_trans( display_context_t disp, int x, int y, int width, i
     }
     else
     {
-        uint32_t *buffer32 = (uint32_t *)__get_buffer( disp );
+        uint32_t *buffer32 = (uint32_t *)__get_buffer( disp );
+
+        for(int j = y; j < y + height; j++)
+        {
+            for(int i = x; i < x + width; i++)
+            {
+                __set_pixel( buffer32, i, j, __blend32( __get_pixel( buffer32, i, j ), color ) );
+            }
+        }
+    }
+}
+
+/**
+ * @brief Fill the entire screen with a particular color
+ *
+ * @note Since this function is designed for blanking the screen, alpha values for
+ * colors are ignored.
+ *
+ * If the RDP is attached to the display context, the screen is filled by the RDP in
+ * fill mode, ignoring its clipping rectangle.  Otherwise it is filled by the CPU.  As
+ * with #graphics_draw_box, later software drawing waits for the fill to complete.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] c
+ *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
+ *            or #graphics_make_color to generate this value.
+ */
+void graphics_fill_screen( display_context_t disp, uint32_t c )
+{
+    if( disp == 0 ) { return; }
+
+    /* Let the RDP do it if it is already rendering to this context */
+    if( __rdp_attached( disp ) )
+    {
+        __track_rect( disp, 0, 0, __width, __height );
+        __rdp_fill_rectangle( 0, 0, __width - 1, __height - 1, c );
+        return;
+    }
+
+    __mark_rect( disp, 0, 0, __width, __height );
+
+    if( __bitdepth == 2 )
+    {
+        __fill_span16( (uint16_t *)__get_buffer( disp ), __width * __height, c );
+    }
+    else
+    {
+        __fill_span32( (uint32_t *)__get_buffer( disp ), __width * __height, c );
+    }
+}
+
+/**
+ * @brief Edge of a polygon being walked down one row at a time
+ */
+typedef struct
+{
+    /** @brief Index of the corner the edge ends at */
+    int end;
+    /** @brief Last row the edge covers, exclusive */
+    int end_y;
+    /** @brief X location where the edge crosses the center of the current row, 16.16 */
+    int32_t x;
+    /** @brief Change of x per row, 16.16 */
+    int32_t slope;
+} poly_edge_t;
+
+/**
+ * @brief Start walking a chain of polygon edges at a given row
+ *
+ * Horizontal edges and edges that end above the row are skipped.
+ *
+ * @param[out] edge
+ *             Edge state to set up
+ * @param[in]  points
+ *             Corners of the polygon, X and Y interleaved
+ * @param[in]  count
+ *             Number of corners
+ * @param[in]  start
+ *             Corner the chain continues from
+ * @param[in]  step
+ *             1 to walk the corners forward, count - 1 to walk them backward
+ * @param[in]  row
+ *             Row to start at
+ *
+ * @return Nonzero if an edge covering the row was found
+ */
+static int __poly_edge_setup( poly_edge_t *edge, const int *points, int count, int start, int step, int row )
+{
+    for( int i = 0; i < count; i++ )
+    {
+        int end = (start + step) % count;
+        int y0 = points[start * 2 + 1];
+        int y1 = points[end * 2 + 1];
+
+        if( y1 > row && y1 > y0 )
+        {
+            int x0 = points[start * 2];
+
+            edge->end = end;
+            edge->end_y = y1;
+            edge->slope = (int32_t)(((int64_t)(points[end * 2] - x0) << 16) / (y1 - y0));
+
+            /* Sample at the center of the row */
+            edge->x = (x0 << 16) + (int32_t)(((int64_t)edge->slope * (((row - y0) << 1) + 1)) >> 1);
+
+            return 1;
+        }
+
+        /* A convex polygon only goes down on either chain until the bottom */
+        if( y1 < y0 ) { return 0; }
+
+        start = end;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Draw a filled convex polygon to a display context
+ *
+ * The polygon is rasterized a row at a time by walking its left and right edges in fixed
+ * point, and every row is filled as a single span.  Pixels whose center lies inside the
+ * polygon are drawn, so polygons sharing an edge neither overlap nor leave gaps.  If the
+ * RDP is attached to the display context, it draws the polygon instead, and later
+ * software drawing waits for it as with #graphics_draw_box.
+ *
+ * @note Concave or self-intersecting polygons are not drawn correctly.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] points
+ *            Pixel X and Y locations of each corner, interleaved
+ * @param[in] count
+ *            Number of corners, at least 3
+ * @param[in] color
+ *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
+ *            or #graphics_make_color to generate this value.
+ */
+void graphics_draw_polygon( display_context_t disp, const int *points, int count, uint32_t color )
+{
+    if( disp == 0 || points == 0 || count < 3 ) { return; }
+
+    /* Bounding box, to find the top corner and for tracking */
+    int top = 0;
+    int min_x = points[0], max_x = points[0];
+    int min_y = points[1], max_y = points[1];
+
+    for( int i = 1; i < count; i++ )
+    {
+        if( points[i * 2] < min_x ) { min_x = points[i * 2]; }
+        if( points[i * 2] > max_x ) { max_x = points[i * 2]; }
+        if( points[i * 2 + 1] < min_y ) { min_y = points[i * 2 + 1]; top = i; }
+        if( points[i * 2 + 1] > max_y ) { max_y = points[i * 2 + 1]; }
+    }
+
+    /* Clip rows to the display */
+    int row = (min_y < 0) ? 0 : min_y;
+    int end_row = (max_y > (int)__height) ? (int)__height : max_y;
+
+    if( row >= end_row || max_x <= 0 || min_x >= (int)__width ) { return; }
+
+    /* Let the RDP do it if it is already rendering to this context */
+    if( __rdp_attached( disp ) )
+    {
+        __track_rect( disp, min_x, row, max_x - min_x, end_row - row );
+        __rdp_fill_polygon( points, count, color );
+        return;
+    }
+
+    __mark_rect( disp, min_x, row, max_x - min_x, end_row - row );
+
+    poly_edge_t left, right;
+
+    if( !__poly_edge_setup( &left, points, count, top, 1, row ) ) { return; }
+    if( !__poly_edge_setup( &right, points, count, top, count - 1, row ) ) { return; }
+
+    uint8_t *line = (uint8_t *)__get_buffer( disp ) + row * __width * __bitdepth;
+
+    for( ; row < end_row; row++, line += __width * __bitdepth )
+    {
+        /* Move on to the next edge of a chain once past its end */
+        if( row >= left.end_y && !__poly_edge_setup( &left, points, count, left.end, 1, row ) ) { break; }
+        if( row >= right.end_y && !__poly_edge_setup( &right, points, count, right.end, count - 1, row ) ) { break; }
+
+        int32_t xl = (left.x < right.x) ? left.x : right.x;
+        int32_t xr = (left.x < right.x) ? right.x : left.x;
+
+        /* First and one past the last pixel with their center inside */
+        int first = (xl + 0x7FFF) >> 16;
+        int end = (xr + 0x7FFF) >> 16;
+
+        if( first < 0 ) { first = 0; }
+        if( end > (int)__width ) { end = __width; }
+
+        if( first < end )
+        {
+            if( __bitdepth == 2 ) { __fill_span16( (uint16_t *)line + first, end - first, color ); }
+            else { __fill_span32( (uint32_t *)line + first, end - first, color ); }
+        }
+
+        left.x += left.slope;
+        right.x += right.slope;
+    }
+}
+
+/**
+ * @brief Draw a filled triangle to a display context
+ *
+ * See #graphics_draw_polygon.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] x1
+ *            Pixel X location of the first corner
+ * @param[in] y1
+ *            Pixel Y location of the first corner
+ * @param[in] x2
+ *            Pixel X location of the second corner
+ * @param[in] y2
+ *            Pixel Y location of the second corner
+ * @param[in] x3
+ *            Pixel X location of the third corner
+ * @param[in] y3
+ *            Pixel Y location of the third corner
+ * @param[in] color
+ *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
+ *            or #graphics_make_color to generate this value.
+ */
+void graphics_draw_triangle( display_context_t disp, int x1, int y1, int x2, int y2, int x3, int y3, uint32_t color )
+{
+    int points[6] = { x1, y1, x2, y2, x3, y3 };
+
+    graphics_draw_polygon( disp, points, 3, color );
+}
+
+/**
+ * @brief Get the expanded glyph of a character for the current colors
+ *
+ * Glyphs are expanded on first use and kept until the colors or the bit depth change.
+ *
+ * @param[in] ch
+ *            Character to look up
+ *
+ * @return Pointer to 8x8 pixels in framebuffer format, or 0 if out of memory
+ */
+static void *__get_glyph( unsigned char ch )
+{
+    if( !glyph_cache || glyph_depth != __bitdepth )
+    {
+        if( glyph_cache ) { free( glyph_cache ); }
+
+        glyph_cache = malloc( 256 * 64 * __bitdepth );
+        glyph_depth = __bitdepth;
+        memset( glyph_valid, 0, sizeof(glyph_valid) );
+
+        if( !glyph_cache ) { return 0; }
+    }
+
+    if( glyph_fg != f_color || glyph_bg != b_color )
+    {
+        glyph_fg = f_color;
+        glyph_bg = b_color;
+        memset( glyph_valid, 0, sizeof(glyph_valid) );
+    }
+
+    if( !(glyph_valid[ch >> 5] & (1 << (ch & 31))) )
+    {
+        for( int i = 0; i < 64; i++ )
+        {
+            uint32_t color = (__font_data[(ch * 8) + (i >> 3)] & (0x80 >> (i & 7))) ? f_color : b_color;
+
+            if( glyph_depth == 2 ) { ((uint16_t *)glyph_cache)[(ch * 64) + i] = color; }
+            else { ((uint32_t *)glyph_cache)[(ch * 64) + i] = color; }
+        }
+
+        glyph_valid[ch >> 5] |= 1 << (ch & 31);
+    }
+
+    return (uint8_t *)glyph_cache + (ch * 64 * glyph_depth);
+}
+
+/**
+ * @brief Draw a character to the screen using the built-in font
+ *
+ * @todo Need a set font mechanism.
+ * @todo Need to look up the width and height from the font instead of assuming it is 8x8.
+ *
+ * Draw a character from the built-in font to the screen.  This function does not support alpha blending, 
+ * only binary transparency.  If the background color is fully transparent, the font is drawn with no
+ * background.  Otherwise, the font is drawn on a fully colored background.  The foreground and background
+ * can be set using #graphics_set_color.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] x
+ *            The X coordinate to place the top left pixel of the character drawn.
+ * @param[in] y
+ *            The Y coordinate to place the top left pixel of the character drawn.
+ * @param[in] ch
+ *            The ASCII character to draw to the screen.
+ */
+void graphics_draw_character( display_context_t disp, int x, int y, char ch )
+{
+    if( disp == 0 ) { return; }
+
+    __mark_rect( disp, x, y, 8, 8 );
+
+    int depth = __bitdepth;
+
+    /* Figure out if they want the background to be transparent */
+    int trans = __is_transparent( depth, b_color );
+
+    /* Opaque glyphs entirely on screen are copied a row at a time from the cache */
+    if( !trans && x >= 0 && y >= 0 && x + 8 <= (int)__width && y + 8 <= (int)__height )
+    {
+        void *glyph = __get_glyph( (unsigned char)ch );
+
+        if( glyph && depth == 2 )
+        {
+            uint16_t *buffer = (uint16_t *)__get_buffer( disp ) + y * __width + x;
+
+            for( int row = 0; row < 8; row++, buffer += __width )
+            {
+                __blit_row16( buffer, (uint16_t *)glyph + row * 8, 8 );
+            }
+
+            return;
+        }
+        else if( glyph )
+        {
+            uint32_t *buffer = (uint32_t *)__get_buffer( disp ) + y * __width + x;
+
+            for( int row = 0; row < 8; row++, buffer += __width )
+            {
+                __blit_row32( buffer, (uint32_t *)glyph + row * 8, 8 );
+            }
+
+            return;
+        }
+    }
+
+    if( depth == 2 )
+    {
+        uint16_t *buffer = (uint16_t *)__get_buffer( disp );
+
+        for( int row = 0; row < 8; row++ )
+        {
+            unsigned char c = __font_data[(ch * 8) + row];
+
+            for( int col = 0; col < 8; col++ )
+            {
+                if( trans )
+                {
+                    if( c & 0x80 )
+                    {
+                        /* Only draw it if it is active */
+                        __set_pixel( buffer, x + col, y + row, f_color );
+                    }
+                }
+                else
+                {
+                    /* Display foreground or background depending on font data */
+                    __set_pixel( buffer, x + col, y + row, (c & 0x80) ? f_color : b_color );
+                }
+
+                c <<= 1;
+            }
+        }
+    }
+    else
+    {
+        uint32_t *buffer = (uint32_t *)__get_buffer( disp );
+
+        for( int row = 0; row < 8; row++ )
+        {
+            unsigned char c = __font_data[(ch * 8) + row];
+
+            for( int col = 0; col < 8; col++ )
+            {
+                if( trans )
+                {
+                    if( c & 0x80 )
+                    {
+                        /* Only draw it if it is active */
+                        __set_pixel( buffer, x + col, y + row, f_color );
+                    }
+                }
+                else
+                {
+                    /* Display foreground or background depending on font data */
+                    __set_pixel( buffer, x + col, y + row, (c & 0x80) ? f_color : b_color );
+                }
+
+                c <<= 1;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Check that a font file read into memory is safe to draw from
+ *
+ * Every table must lie inside the file and every glyph inside the atlas.  Offsets are
+ * compared by subtracting from the file size, so that huge values cannot wrap around.
+ *
+ * @param[in] font
+ *            Font file contents
+ * @param[in] size
+ *            Size of the file in bytes, at least the size of #font_t
+ *
+ * @return Nonzero if the font is valid
+ */
+static int __font_valid( font_t *font, uint32_t size )
+{
+    uint32_t glyphs_end = sizeof(font_t) + font->num_glyphs * sizeof(font_glyph_t);
+
+    if( font->magic != FONT_MAGIC ) { return 0; }
+    if( glyphs_end > size || font->kerning_offset < glyphs_end || font->kerning_offset > size ) { return 0; }
+    if( font->atlas_offset < font->kerning_offset || font->atlas_offset > size || (font->atlas_offset & 7) ) { return 0; }
+    if( font->num_kerning * sizeof(font_kerning_t) > font->atlas_offset - font->kerning_offset ) { return 0; }
+    if( size - font->atlas_offset < sizeof(sprite_t) ) { return 0; }
+
+    sprite_t *atlas = graphics_get_font_atlas( font );
+
+    /* Two pixels per byte, so rows must not share a byte */
+    if( atlas->width & 1 ) { return 0; }
+    if( ((uint32_t)atlas->width * atlas->height) >> 1 > size - font->atlas_offset - sizeof(sprite_t) ) { return 0; }
+
+    for( int i = 0; i < font->num_glyphs; i++ )
+    {
+        const font_glyph_t *glyph = &font->glyphs[i];
+
+        if( !glyph->width || !glyph->height ) { continue; }
+        if( glyph->x + glyph->width > atlas->width || glyph->y + glyph->height > atlas->height ) { return 0; }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Load a font created with mkfont from the filesystem
+ *
+ * @param[in] path
+ *            Path of the font file in DragonFS
+ *
+ * @return The font, or 0 if it could not be read or is not a valid font.  Free it with
+ *         #graphics_free_font.
+ */
+font_t *graphics_load_font( const char * const path )
+{
+    if( path == 0 ) { return 0; }
+
+    int fp = dfs_open( path );
+    if( fp < 0 ) { return 0; }
+
+    int size = dfs_size( fp );
+    font_t *font = (size >= (int)sizeof(font_t)) ? malloc( size ) : 0;
+
+    if( font == 0 )
+    {
+        dfs_close( fp );
+        return 0;
+    }
+
+    int read = dfs_read( font, 1, size, fp );
+    dfs_close( fp );
+
+    if( read != size || !__font_valid( font, size ) )
+    {
+        free( font );
+        return 0;
+    }
+
+    /* The RDP reads the atlas straight from memory */
+    data_cache_hit_writeback( font, size );
+
+    return font;
+}
+
+/**
+ * @brief Free a font loaded with #graphics_load_font
+ *
+ * If the font is the current font, text reverts to the built-in font.
+ *
+ * @param[in] font
+ *            Font to free
+ */
+void graphics_free_font( font_t *font )
+{
+    if( font == 0 ) { return; }
+    if( font == cur_font ) { cur_font = 0; }
+
+    free( font );
+}
+
+/**
+ * @brief Set the font used by #graphics_draw_text
+ *
+ * @param[in] font
+ *            Font to use, or 0 to use the built-in 8x8 font
+ */
+void graphics_set_font( font_t *font )
+{
+    cur_font = font;
+}
+
+/**
+ * @brief Look up the glyph of a character in a font
+ *
+ * @param[in] font
+ *            Font to search
+ * @param[in] ch
+ *            Character to look up
+ *
+ * @return The glyph, or 0 if the font has no glyph for this character
+ */
+const font_glyph_t *graphics_get_glyph( const font_t *font, char ch )
+{
+    int index = (unsigned char)ch - font->first_char;
+
+    if( index < 0 || index >= font->num_glyphs ) { return 0; }
+
+    return &font->glyphs[index];
+}
+
+/**
+ * @brief Get the kerning adjustment between two characters
+ *
+ * @param[in] font
+ *            Font to search
+ * @param[in] first
+ *            Character drawn first
+ * @param[in] second
+ *            Character drawn after it
+ *
+ * @return Pixels to add to the advance of the first character
+ */
+int graphics_get_kerning( const font_t *font, char first, char second )
+{
+    const font_kerning_t *pairs = (const font_kerning_t *)((const uint8_t *)font + font->kerning_offset);
+    int key = ((unsigned char)first << 8) | (unsigned char)second;
+    int low = 0;
+    int high = font->num_kerning - 1;
+
+    /* Pairs are sorted, binary search */
+    while( low <= high )
+    {
+        int mid = (low + high) >> 1;
+        int cur = (pairs[mid].first << 8) | pairs[mid].second;
 
-        for(int j = y; j < y + height; j++)
-        {
-            for(int i = x; i < x + width; i++)
-            {
-                /* Get 32bit representations */
-                uint32_t cur_color = __get_pixel( buffer32, i, j );
+        if( cur == key ) { return pairs[mid].amount; }
+        if( cur < key ) { low = mid + 1; }
+        else { high = mid - 1; }
+    }
+
+    return 0;
+}
 
-                /* Get current color */
-                uint32_t cr = (cur_color >> 24) & 0xFF;
-                uint32_t cg = (cur_color >> 16) & 0xFF;
-                uint32_t cb = (cur_color >> 8) & 0xFF;
+/**
+ * @brief Get the atlas holding every glyph of a font
+ *
+ * The atlas is a 4-bit color index sprite that can be loaded with #rdp_load_texture.
+ *
+ * @param[in] font
+ *            Font to get the atlas of
+ *
+ * @return The atlas sprite
+ */
+sprite_t *graphics_get_font_atlas( font_t *font )
+{
+    return (sprite_t *)((uint8_t *)font + font->atlas_offset);
+}
 
-                /* Get new color */
-                uint32_t sr = (color >> 24) & 0xFF;
-                uint32_t sg = (color >> 16) & 0xFF;
-                uint32_t sb = (color >> 8) & 0xFF;
+/**
+ * @brief Get the advance of a character in the current font
+ *
+ * @param[in] ch
+ *            Character to measure
+ * @param[in] next
+ *            Character drawn after it, for kerning
+ *
+ * @return Pixels to move the pen after drawing the character
+ */
+static int __font_advance( char ch, char next )
+{
+    const font_glyph_t *glyph = graphics_get_glyph( cur_font, ch );
+    int advance = glyph ? glyph->advance : 0;
 
-                /* Transparencies */
-                uint32_t st = color & 0xFF;
-                uint32_t ct = 255 - st;
+    if( next && cur_font->num_kerning ) { advance += graphics_get_kerning( cur_font, ch, next ); }
 
-                /* Mixed color */
-                uint32_t mixed_color;
-                uint8_t *final_color = (uint8_t *)(&mixed_color);
+    return advance;
+}
 
-                final_color[0] = ((cr * ct) + (sr * st)) >> 8;
-                final_color[1] = ((cg * ct) + (sg * st)) >> 8;
-                final_color[2] = ((cb * ct) + (sb * st)) >> 8;
+/**
+ * @brief Measure the width of a line of text in the current font
+ *
+ * Measuring stops at the end of the string or the first line break.
+ *
+ * @param[in] msg
+ *            Text to measure
+ *
+ * @return Width in pixels
+ */
+int graphics_get_text_width( const char * const msg )
+{
+    if( msg == 0 ) { return 0; }
 
-                /* Since we are doing mixing anyway */
-                final_color[3] = 255;
+    int width = 0;
 
-                __set_pixel( buffer32, i, j, mixed_color );
-            }
-        }
+    for( const char *text = msg; *text && *text != '\n' && *text != '\r'; text++ )
+    {
+        if( cur_font == 0 ) { width += (*text == '\t') ? 8 * 5 : 8; }
+        else if( *text == '\t' ) { width += __font_advance( ' ', 0 ) * 5; }
+        else { width += __font_advance( text[0], text[1] ); }
     }
+
+    return width;
 }
 
 /**
- * @brief Fill the entire screen with a particular color
+ * @brief Fill the background behind a line of text in the current font
  *
- * @note Since this function is designed for blanking the screen, alpha values for
- * colors are ignored.
+ * The whole line is filled before any glyph is drawn, so that glyphs overhanging their
+ * neighbours because of kerning or offsets are not painted over.
  *
  * @param[in] disp
- *            The currently active display context.
- * @param[in] c
- *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
- *            or #graphics_make_color to generate this value.
+ *            The currently active display context
+ * @param[in] x
+ *            Pen X position at the start of the line
+ * @param[in] y
+ *            Y position of the top of the line
+ * @param[in] text
+ *            Text of the line, up to the end of the string or the next line break
  */
-void graphics_fill_screen( display_context_t disp, uint32_t c )
+static void __fill_text_background( display_context_t disp, int x, int y, const char *text )
 {
-    if( disp == 0 ) { return; }
+    int width = graphics_get_text_width( text );
+    int bx = (x < 0) ? 0 : x;
+    int by = (y < 0) ? 0 : y;
+    int bw = ((x + width > (int)__width) ? (int)__width : x + width) - bx;
+    int bh = ((y + cur_font->line_height > (int)__height) ? (int)__height : y + cur_font->line_height) - by;
 
-    if( __bitdepth == 2 )
-    {
-        uint16_t *buffer = (uint16_t *)__get_buffer( disp );
-
-        for( int i = 0; i < __width * __height; i++ )
-        {
-            buffer[i] = c;
-        }
-    }
-    else
-    {
-        uint32_t *buffer = (uint32_t *)__get_buffer( disp );
+    if( bw <= 0 || bh <= 0 ) { return; }
 
-        for( int i = 0; i < __width * __height; i++ )
-        {
-            buffer[i] = c;
-        }
-    }
+    __mark_rect( disp, bx, by, bw, bh );
+    __fill_box( disp, bx, by, bw, bh, b_color );
 }
 
 /**
- * @brief Draw a character to the screen using the built-in font
- *
- * @todo Need a set font mechanism.
- * @todo Need to look up the width and height from the font instead of assuming it is 8x8.
+ * @brief Draw a glyph of the current font
  *
- * Draw a character from the built-in font to the screen.  This function does not support alpha blending, 
- * only binary transparency.  If the background color is fully transparent, the font is drawn with no
- * background.  Otherwise, the font is drawn on a fully colored background.  The foreground and background
- * can be set using #graphics_set_color.
+ * Set atlas pixels are drawn in the foreground color, a run of them at a time.
  *
  * @param[in] disp
- *            The currently active display context.
+ *            The currently active display context
  * @param[in] x
- *            The X coordinate to place the top left pixel of the character drawn.
+ *            Pen X position
  * @param[in] y
- *            The Y coordinate to place the top left pixel of the character drawn.
- * @param[in] ch
- *            The ASCII character to draw to the screen.
+ *            Y position of the top of the line
+ * @param[in] glyph
+ *            Glyph to draw
  */
-void graphics_draw_character( display_context_t disp, int x, int y, char ch )
+static void __draw_glyph( display_context_t disp, int x, int y, const font_glyph_t *glyph )
 {
-    if( disp == 0 ) { return; }
+    sprite_t *atlas = graphics_get_font_atlas( cur_font );
+    int gx = x + glyph->x_offset;
+    int gy = y + glyph->y_offset;
 
-    int depth = __bitdepth;
-
-    /* Figure out if they want the background to be transparent */
-    int trans = __is_transparent( depth, b_color );
+    /* Clip to the display */
+    int sx = (gx < 0) ? -gx : 0;
+    int sy = (gy < 0) ? -gy : 0;
+    int ex = glyph->width;
+    int ey = glyph->height;
 
-    if( depth == 2 )
-    {
-        uint16_t *buffer = (uint16_t *)__get_buffer( disp );
+    if( gx + ex > (int)__width ) { ex = __width - gx; }
+    if( gy + ey > (int)__height ) { ey = __height - gy; }
+    if( sx >= ex || sy >= ey ) { return; }
 
-        for( int row = 0; row < 8; row++ )
-        {
-            unsigned char c = __font_data[(ch * 8) + row];
+    __mark_rect( disp, gx + sx, gy + sy, ex - sx, ey - sy );
 
-            for( int col = 0; col < 8; col++ )
-            {
-                if( trans )
-                {
-                    if( c & 0x80 )
-                    {
-                        /* Only draw it if it is active */
-                        __set_pixel( buffer, x + col, y + row, f_color );
-                    }
-                }
-                else
-                {
-                    /* Display foreground or background depending on font data */
-                    __set_pixel( buffer, x + col, y + row, (c & 0x80) ? f_color : b_color );
-                }
+    const uint8_t *src = (const uint8_t *)atlas->data + (((glyph->y + sy) * atlas->width) >> 1);
+    uint8_t *dst = (uint8_t *)__get_buffer( disp ) + ((gy + sy) * (int)__width + gx) * (int)__bitdepth;
 
-                c <<= 1;
-            }
-        }
-    }
-    else
+    for( int row = sy; row < ey; row++, src += atlas->width >> 1, dst += __width * __bitdepth )
     {
-        uint32_t *buffer = (uint32_t *)__get_buffer( disp );
+        int col = sx;
 
-        for( int row = 0; row < 8; row++ )
+        while( col < ex )
         {
-            unsigned char c = __font_data[(ch * 8) + row];
+            /* Skip clear pixels, then find the end of the run of set ones */
+            int ax = glyph->x + col;
 
-            for( int col = 0; col < 8; col++ )
-            {
-                if( trans )
-                {
-                    if( c & 0x80 )
-                    {
-                        /* Only draw it if it is active */
-                        __set_pixel( buffer, x + col, y + row, f_color );
-                    }
-                }
-                else
-                {
-                    /* Display foreground or background depending on font data */
-                    __set_pixel( buffer, x + col, y + row, (c & 0x80) ? f_color : b_color );
-                }
+            if( !((ax & 1) ? (src[ax >> 1] & 0x0F) : (src[ax >> 1] >> 4)) ) { col++; continue; }
 
-                c <<= 1;
+            int start = col;
+
+            for( col++; col < ex; col++ )
+            {
+                ax = glyph->x + col;
+                if( !((ax & 1) ? (src[ax >> 1] & 0x0F) : (src[ax >> 1] >> 4)) ) { break; }
             }
+
+            if( __bitdepth == 2 ) { __fill_span16( (uint16_t *)dst + start, col - start, f_color ); }
+            else { __fill_span32( (uint32_t *)dst + start, col - start, f_color ); }
         }
     }
 }
@@ -743,6 +1899,43 @@ void graphics_draw_text( display_context_t disp, int x, int y, const char * cons
     int ty = y;
     const char *text = (const char *)msg;
 
+    /* Proportional fonts */
+    if( cur_font )
+    {
+        int space = __font_advance( ' ', 0 );
+        int background = !__is_transparent( __bitdepth, b_color );
+
+        if( background ) { __fill_text_background( disp, tx, ty, text ); }
+
+        for( ; *text; text++ )
+        {
+            switch( *text )
+            {
+                case '\r':
+                case '\n':
+                    tx = x;
+                    ty += cur_font->line_height;
+                    if( background ) { __fill_text_background( disp, tx, ty, text + 1 ); }
+                    break;
+                case '\t':
+                    tx += space * 5;
+                    break;
+                default:
+                {
+                    const font_glyph_t *glyph = graphics_get_glyph( cur_font, *text );
+                    int advance = __font_advance( text[0], text[1] );
+
+                    if( glyph ) { __draw_glyph( disp, tx, ty, glyph ); }
+
+                    tx += advance;
+                    break;
+                }
+            }
+        }
+
+        return;
+    }
+
     while( *text )
     {
         switch( *text )
@@ -902,35 +2095,27 @@ void graphics_draw_sprite_stride( display_context_t disp, int x, int y, sprite_t
         ey = __height - ty;
     }
 
+    __mark_rect( disp, tx + sx, ty + sy, ex - sx, ey - sy );
+
     /* Only display sprite if it matches the bitdepth */
     if( __bitdepth == 2 && sprite->bitdepth == 2 )
     {
-        uint16_t *buffer = (uint16_t *)__get_buffer( disp );
-        uint16_t *sp_data = (uint16_t *)sprite->data;
+        uint16_t *buffer = (uint16_t *)__get_buffer( disp ) + (ty + sy) * __width + tx + sx;
+        uint16_t *sp_data = (uint16_t *)sprite->data + sy * sprite->width + sx;
 
-        for( int yp = sy; yp < ey; yp++ )
+        for( int yp = sy; yp < ey; yp++, buffer += __width, sp_data += sprite->width )
         {
-            const register int run = yp * sprite->width;
-
-            for( int xp = sx; xp < ex; xp++ )
-            {
-                __set_pixel( buffer, tx + xp, ty + yp, sp_data[xp + run] );
-            }
+            __blit_row16( buffer, sp_data, ex - sx );
         }
     }
     else if( __bitdepth == 4 && sprite->bitdepth == 4 )
     {
-        uint32_t *buffer = (uint32_t *)__get_buffer( disp );
-        uint32_t *sp_data = (uint32_t *)sprite->data;
+        uint32_t *buffer = (uint32_t *)__get_buffer( disp ) + (ty + sy) * __width + tx + sx;
+        uint32_t *sp_data = (uint32_t *)sprite->data + sy * sprite->width + sx;
 
-        for( int yp = sy; yp < ey; yp++ )
+        for( int yp = sy; yp < ey; yp++, buffer += __width, sp_data += sprite->width )
         {
-            const register int run = yp * sprite->width;
-
-            for( int xp = sx; xp < ex; xp++ )
-            {
-                __set_pixel( buffer, tx + xp, ty + yp, sp_data[xp + run] );
-            }
+            __blit_row32( buffer, sp_data, ex - sx );
         }
     }
 }
@@ -1070,6 +2255,58 @@ void graphics_draw_sprite_trans_stride( display_context_t disp, int x, int y, sp
         ey = __height - ty;
     }
 
+    __mark_rect( disp, tx + sx, ty + sy, ex - sx, ey - sy );
+
+    /* Draw whole runs when spans were precomputed */
+    sprite_spans_t *spans = __find_spans( sprite );
+
+    if( spans && __bitdepth == sprite->bitdepth )
+    {
+        for( int yp = sy; yp < ey; yp++ )
+        {
+            const int run = yp * sprite->width;
+            const int row = (ty + yp) * __width + tx;
+            int xp = 0;
+
+            for( uint32_t e = spans->rows[yp]; e < spans->rows[yp + 1] && xp < ex; e++ )
+            {
+                uint16_t type = spans->spans[e] & SPAN_TYPE_MASK;
+                int start = xp;
+                int end = xp + (spans->spans[e] & SPAN_MAX_LENGTH);
+
+                xp = end;
+
+                /* Clip the run */
+                if( start < sx ) { start = sx; }
+                if( end > ex ) { end = ex; }
+                if( start >= end || type == SPAN_TRANSPARENT ) { continue; }
+
+                if( __bitdepth == 2 )
+                {
+                    /* 16-bit sprites have no translucent runs */
+                    __blit_row16( (uint16_t *)__get_buffer( disp ) + row + start,
+                                  (uint16_t *)sprite->data + run + start, end - start );
+                }
+                else if( type == SPAN_OPAQUE )
+                {
+                    __blit_row32( (uint32_t *)__get_buffer( disp ) + row + start,
+                                  sprite->data + run + start, end - start );
+                }
+                else
+                {
+                    uint32_t *buffer = (uint32_t *)__get_buffer( disp ) + row;
+
+                    for( int p = start; p < end; p++ )
+                    {
+                        buffer[p] = __blend32( buffer[p], sprite->data[run + p] );
+                    }
+                }
+            }
+        }
+
+        return;
+    }
+
     /* Only display sprite if it matches the bitdepth */
     if( __bitdepth == 2 && sprite->bitdepth == 2 )
     {
@@ -1101,36 +2338,151 @@ void graphics_draw_sprite_trans_stride( display_context_t disp, int x, int y, sp
 
             for( int xp = sx; xp < ex; xp++ )
             {
-                /* Get 32bit representations */
-                uint8_t *new_color = (uint8_t *)(&sp_data[xp + run]);
-                uint32_t cur_color = __get_pixel( buffer, tx + xp, ty + yp );
+                uint32_t *pixel = &buffer[(tx + xp) + ((ty + yp) * __width)];
+
+                *pixel = __blend32( *pixel, sp_data[xp + run] );
+            }
+        }
+    }
+}
+
+/**
+ * @brief Draw a filled rectangle blended over a display context
+ *
+ * Unlike #graphics_draw_box_trans, the opacity is given separately from the color, so
+ * 16-bit display contexts get real 8-bit alpha blending instead of the single alpha bit
+ * of 16-bit colors.  16-bit pixels are blended through a 5-bit lookup table per channel,
+ * 32-bit pixels two channels per multiply.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] x
+ *            The x coordinate of the top left of the box.
+ * @param[in] y
+ *            The y coordinate of the top left of the box.
+ * @param[in] width
+ *            The width of the box in pixels.
+ * @param[in] height
+ *            The height of the box in pixels.
+ * @param[in] color
+ *            The 32-bit RGBA color to draw to the screen.  Use #graphics_convert_color
+ *            or #graphics_make_color to generate this value.  Its alpha is ignored.
+ * @param[in] alpha
+ *            Opacity of the box from 0 to 255
+ */
+void graphics_draw_box_alpha( display_context_t disp, int x, int y, int width, int height, uint32_t color, uint8_t alpha )
+{
+    if( disp == 0 || alpha == 0 ) { return; }
+
+    /* Clip to the display */
+    if( x < 0 ) { width += x; x = 0; }
+    if( y < 0 ) { height += y; y = 0; }
+    if( x + width > (int)__width ) { width = __width - x; }
+    if( y + height > (int)__height ) { height = __height - y; }
+    if( width <= 0 || height <= 0 ) { return; }
+
+    __mark_rect( disp, x, y, width, height );
+
+    if( __bitdepth == 2 )
+    {
+        uint16_t *buffer16 = (uint16_t *)__get_buffer( disp ) + y * __width + x;
+        uint16_t c = color & 0xFFFF;
+
+        __blend16_setup( alpha );
+
+        /* The new color is the same everywhere, so only one row of each table is used */
+        const uint8_t *rt = blend_table[c >> 11];
+        const uint8_t *gt = blend_table[(c >> 6) & 0x1F];
+        const uint8_t *bt = blend_table[(c >> 1) & 0x1F];
+
+        for( int j = 0; j < height; j++, buffer16 += __width )
+        {
+            for( int i = 0; i < width; i++ )
+            {
+                uint16_t cur = buffer16[i];
+
+                buffer16[i] = (rt[cur >> 11] << 11) | (gt[(cur >> 6) & 0x1F] << 6) | (bt[(cur >> 1) & 0x1F] << 1) | 1;
+            }
+        }
+    }
+    else
+    {
+        uint32_t *buffer32 = (uint32_t *)__get_buffer( disp ) + y * __width + x;
+        uint32_t weight = alpha + (alpha >> 7);
+
+        for( int j = 0; j < height; j++, buffer32 += __width )
+        {
+            for( int i = 0; i < width; i++ )
+            {
+                buffer32[i] = __blend32_weight( buffer32[i], color, weight );
+            }
+        }
+    }
+}
+
+/**
+ * @brief Draw a sprite blended over a display context
+ *
+ * Transparent sprite pixels are skipped.  The rest are blended with the given opacity,
+ * combined with their own alpha for 32-bit sprites.  See #graphics_draw_box_alpha.
+ *
+ * @param[in] disp
+ *            The currently active display context.
+ * @param[in] x
+ *            The x coordinate to place the top left pixel of the sprite.
+ * @param[in] y
+ *            The y coordinate to place the top left pixel of the sprite.
+ * @param[in] sprite
+ *            Pointer to a sprite structure matching the bit depth of the display.
+ * @param[in] alpha
+ *            Opacity of the sprite from 0 to 255
+ */
+void graphics_draw_sprite_alpha( display_context_t disp, int x, int y, sprite_t *sprite, uint8_t alpha )
+{
+    if( disp == 0 || sprite == 0 || alpha == 0 ) { return; }
+    if( sprite->bitdepth != __bitdepth ) { return; }
 
-                /* Get current color */
-                uint32_t cr = (cur_color >> 24) & 0xFF;
-                uint32_t cg = (cur_color >> 16) & 0xFF;
-                uint32_t cb = (cur_color >> 8) & 0xFF;
+    /* Clip to the display */
+    int sx = (x < 0) ? -x : 0;
+    int sy = (y < 0) ? -y : 0;
+    int ex = sprite->width;
+    int ey = sprite->height;
 
-                /* Get new color */
-                uint32_t sr = new_color[0];
-                uint32_t sg = new_color[1];
-                uint32_t sb = new_color[2];
+    if( x + ex > (int)__width ) { ex = __width - x; }
+    if( y + ey > (int)__height ) { ey = __height - y; }
+    if( sx >= ex || sy >= ey ) { return; }
 
-                /* Transparencies */
-                uint32_t st = new_color[3];
-                uint32_t ct = 255 - st;
+    __mark_rect( disp, x + sx, y + sy, ex - sx, ey - sy );
+
+    if( __bitdepth == 2 )
+    {
+        uint16_t *buffer = (uint16_t *)__get_buffer( disp ) + (y + sy) * __width + x;
+        uint16_t *sp_data = (uint16_t *)sprite->data + sy * sprite->width;
 
-                /* Mixed color */
-                uint32_t mixed_color;
-                uint8_t *final_color = (uint8_t *)(&mixed_color);
+        __blend16_setup( alpha );
 
-                final_color[0] = ((cr * ct) + (sr * st)) >> 8;
-                final_color[1] = ((cg * ct) + (sg * st)) >> 8;
-                final_color[2] = ((cb * ct) + (sb * st)) >> 8;
+        for( int yp = sy; yp < ey; yp++, buffer += __width, sp_data += sprite->width )
+        {
+            for( int xp = sx; xp < ex; xp++ )
+            {
+                /* Only blend the pixel if alpha bit is set */
+                if( sp_data[xp] & 1 ) { buffer[xp] = __blend16( buffer[xp], sp_data[xp] ); }
+            }
+        }
+    }
+    else
+    {
+        uint32_t *buffer = (uint32_t *)__get_buffer( disp ) + (y + sy) * __width + x;
+        uint32_t *sp_data = sprite->data + sy * sprite->width;
+        uint32_t scale = alpha + (alpha >> 7);
 
-                /* Since we are doing mixing anyway */
-                final_color[3] = 255;
+        for( int yp = sy; yp < ey; yp++, buffer += __width, sp_data += sprite->width )
+        {
+            for( int xp = sx; xp < ex; xp++ )
+            {
+                uint32_t st = sp_data[xp] & 0xFF;
 
-                __set_pixel( buffer, tx + xp, ty + yp, mixed_color );
+                if( st ) { buffer[xp] = __blend32_weight( buffer[xp], sp_data[xp], ((st + (st >> 7)) * scale) >> 8 ); }
             }
         }
     }
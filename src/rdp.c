@@ -5,6 +5,7 @@
  */
 #include <stdint.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 #include "libdragon.h"
 
@@ -48,6 +49,11 @@
  * signals the main thread that it is safe to detach.  Consequently, interrupts must be
  * enabled for proper operation.  This also means that code should under normal circumstances
  * never use #SYNC_FULL.
+ *
+ * To overlap CPU and RDP work across frames, #rdp_detach_show can be used in place of
+ * #rdp_detach_display and #display_show.  More generally, #rdp_emit_fence queues a
+ * #SYNC_FULL that can later be tested with #rdp_fence_done, waited on with
+ * #rdp_fence_wait or given a callback with #rdp_fence_callback.
  * @{
  */
 
@@ -92,11 +98,14 @@ typedef struct
 
 /** @brief Array of cached textures in RDP TMEM indexed by the RDP texture slot */
 static sprite_cache cache;
+/** @brief Number of mipmap levels of the loaded texture, one tile per level */
+static uint8_t mip_levels = 1;
 
 extern uint32_t __bitdepth;
 extern uint32_t __width;
 extern uint32_t __height;
 extern void *__safe_buffer[];
+extern void *__safe_zbuffer;
 
 /** @brief Ringbuffer where partially assembled commands will be placed before sending to the RDP */
 static uint32_t rdp_ringbuffer[RINGBUFFER_SIZE / 4];
@@ -105,8 +114,38 @@ static uint32_t rdp_start = 0;
 /** @brief End of the command in the ringbuffer */
 static uint32_t rdp_end = 0;
 
-/** @brief Interrupt wait flag */
-static volatile uint32_t wait_intr = 0;
+/** @brief Buffer receiving a copy of every command sent, or 0 if not capturing */
+static uint32_t *capture_buffer = 0;
+/** @brief Capacity of #capture_buffer in 32-bit words */
+static int capture_max = 0;
+/** @brief Number of words captured so far */
+static int capture_count = 0;
+/** @brief A send did not fit in #capture_buffer, so the capture was cut short */
+static int capture_truncated = 0;
+
+/** @brief Maximum number of pending fence callbacks */
+#define MAX_FENCE_CALLBACKS 8
+
+/** @brief Number of fences queued to the RDP */
+static rdp_fence_t fence_emitted = 0;
+/** @brief Number of fences the RDP has reached, advanced by the DP interrupt */
+static volatile rdp_fence_t fence_completed = 0;
+/** @brief Words left of the command being passed in through #rdp_command */
+static int command_words_left = 0;
+
+/** @brief Callback to run once the RDP reaches a fence */
+typedef struct
+{
+    /** @brief Fence to wait for */
+    rdp_fence_t fence;
+    /** @brief Function to call, or 0 if the slot is free */
+    void (*callback)( void *arg );
+    /** @brief Argument passed to the callback */
+    void *arg;
+} fence_callback_t;
+
+/** @brief Pending fence callbacks */
+static fence_callback_t fence_callbacks[MAX_FENCE_CALLBACKS];
 
 // NEW variables
 static int16_t pixel_mode = 4096; // Automatic Sprite concatenate
@@ -115,6 +154,139 @@ static uint16_t extra_line = 0;
 static uint8_t use_palette = 0; // num palette for 4bit tlut
 int tri_set = 0x0A000000; // textured by default
 
+/** @brief Number of palette entries in upper TMEM */
+#define TLUT_ENTRIES 256
+/** @brief Bytes of TMEM below the palette area */
+#define TMEM_TLUT_OFFSET 2048
+
+/** @brief Palette entries currently resident in TMEM */
+static uint16_t tlut_shadow[TLUT_ENTRIES];
+/** @brief Bitmask of entries in #tlut_shadow that match TMEM */
+static uint32_t tlut_valid[TLUT_ENTRIES / 32];
+
+/** @brief Last SET_OTHER_MODES command words sent to the RDP */
+static uint32_t other_modes[2] = { 0, 0 };
+/** @brief Last SET_COMBINE_MODE command words sent to the RDP */
+static uint32_t combine_mode[2] = { 0, 0 };
+/** @brief Display context the RDP is currently rendering to, or 0 if detached */
+static display_context_t attached_disp = 0;
+/** @brief The @ref graphics queued fills to #attached_disp that the RDP may not have drawn yet */
+int __rdp_fills_pending = 0;
+/** @brief Last packed fill color sent to the RDP */
+static uint32_t fill_color = 0;
+/** @brief Last packed primitive color sent to the RDP */
+static uint32_t prim_color = 0xFFFFFFFF;
+/** @brief Last packed blend color sent to the RDP */
+static uint32_t blend_color = 0;
+/** @brief Last SET_SCISSOR command words sent to the RDP */
+static uint32_t scissor[2] = { 0, 0 };
+
+/** @brief #other_modes matches the RDP */
+#define SHADOW_MODES    0x01
+/** @brief #combine_mode matches the RDP */
+#define SHADOW_COMBINE  0x02
+/** @brief #fill_color matches the RDP */
+#define SHADOW_FILL     0x04
+/** @brief #prim_color matches the RDP */
+#define SHADOW_PRIM     0x08
+/** @brief #blend_color matches the RDP */
+#define SHADOW_BLEND    0x10
+/** @brief #scissor matches the RDP */
+#define SHADOW_SCISSOR  0x20
+
+/** @brief Which shadow values are known to match the RDP */
+static uint32_t shadow_valid = 0;
+
+/** @brief A primitive was queued since the last pipe sync */
+static int pipe_busy = 0;
+/** @brief A textured primitive was queued since the last load sync */
+static int load_busy = 0;
+/** @brief Mask of tiles used by primitives since the last tile sync */
+static uint32_t tile_busy = 0;
+
+/** @brief Commands dropped or added by the state tracker */
+static rdp_state_stats_t state_stats;
+
+/** @brief Bytes of commands sent since #rdp_profile_begin */
+static uint32_t profile_bytes = 0;
+/** @brief Command submissions since #rdp_profile_begin */
+static uint32_t profile_kicks = 0;
+/** @brief CPU ticks at #rdp_profile_begin */
+static uint32_t profile_start = 0;
+
+/** @brief Offscreen surface the RDP is currently rendering to, or 0 if none */
+static surface_t *attached_surface = 0;
+/** @brief Width of the current render target in pixels */
+static uint32_t target_width = 0;
+/** @brief Height of the current render target in pixels */
+static uint32_t target_height = 0;
+
+/**
+ * @brief Number of entries in the triangle setup reciprocal table
+ *
+ * Covers edge heights of up to 512 lines in 11.2 fixed point, which is enough for
+ * every supported resolution.  Taller edges fall back to a division.
+ */
+#define RECIP_TABLE_SIZE 2048
+
+/** @brief Reciprocals of 11.2 edge heights, scaled by 2^31 */
+static uint32_t recip_table[RECIP_TABLE_SIZE];
+
+/**
+ * @brief Edge data of a triangle shared by all attribute coefficient calculations
+ */
+typedef struct
+{
+    float hx;
+    float hy;
+    float mx;
+    float my;
+    float ish;
+    float fy;
+    float attr_factor;
+} triangle_edges;
+
+/** @brief Maximum number of sprites queued in a batch before it is flushed automatically */
+#define BATCH_SIZE       512
+
+/** @brief Maximum number of distinct render modes referenced by a single batch */
+#define BATCH_MODES      16
+
+/**
+ * @brief Render mode captured when a sprite is queued in a batch
+ */
+typedef struct
+{
+    uint32_t other_modes[2];
+    uint32_t combine_mode[2];
+    int16_t pixel_mode;
+    uint8_t palette;
+} batch_mode;
+
+/**
+ * @brief Queued sprite draw
+ */
+typedef struct
+{
+    sprite_t *sprite;
+    uint32_t prim_color;
+    int16_t x;
+    int16_t y;
+    uint16_t order;
+    int16_t layer;
+    uint8_t flags;
+    uint8_t mode;
+} batch_entry;
+
+/** @brief Sprites waiting for #rdp_batch_flush */
+static batch_entry batch[BATCH_SIZE];
+/** @brief Render modes referenced by the queued sprites */
+static batch_mode batch_modes[BATCH_MODES];
+/** @brief Number of queued sprites */
+static uint32_t batch_count = 0;
+/** @brief Number of render modes in use by the queued sprites */
+static uint32_t batch_mode_count = 0;
+
 /**
  * @brief RDP interrupt handler
  *
@@ -123,8 +295,21 @@ int tri_set = 0x0A000000; // textured by default
  */
 static void __rdp_interrupt()
 {
-    /* Flag that the interrupt happened */
-    wait_intr++;
+    /* Every SYNC_FULL is a fence, and they complete in order */
+    fence_completed++;
+
+    for( int i = 0; i < MAX_FENCE_CALLBACKS; i++ )
+    {
+        fence_callback_t *cb = &fence_callbacks[i];
+
+        if( cb->callback && (int32_t)(fence_completed - cb->fence) >= 0 )
+        {
+            void (*callback)( void *arg ) = cb->callback;
+
+            cb->callback = 0;
+            callback( cb->arg );
+        }
+    }
 }
 
 /**
@@ -205,9 +390,55 @@ static void __rdp_ringbuffer_queue( uint32_t data )
     rdp_end += 4;
 }
 
-// Build commands from a program
+/**
+ * @brief Return the length in 32-bit words of the RDP command starting with a word
+ *
+ * @param[in] data
+ *            First word of the command
+ */
+static int __rdp_command_words( uint32_t data )
+{
+    uint32_t op = (data >> 24) & 0x3F;
+
+    /* Triangles carry optional shade, texture and Z blocks */
+    if( op >= 0x08 && op <= 0x0F )
+    {
+        return 8 + ((op & 4) ? 16 : 0) + ((op & 2) ? 16 : 0) + ((op & 1) ? 4 : 0);
+    }
+
+    /* Texture rectangles are 128-bit, everything else is 64-bit */
+    return (op == 0x24 || op == 0x25) ? 4 : 2;
+}
+
+/**
+ * @brief Queue one word of a raw RDP command
+ *
+ * Commands are passed in a word at a time and sent with #rdp_send.  Since anything could
+ * be changed this way, the state tracker forgets what it knows about the RDP.  A
+ * #SYNC_FULL passed in this way counts as a fence, just like one from #rdp_emit_fence,
+ * so that the fence counter stays in step with the DP interrupt.
+ *
+ * @param[in] data
+ *            Next 32 bits of the command stream
+ */
 void rdp_command( uint32_t data )
 {
+    /* Anything could have changed, assume the worst */
+    shadow_valid = 0;
+    pipe_busy = 1;
+    load_busy = 1;
+    tile_busy = 0xFF;
+
+    /* Every SYNC_FULL raises the DP interrupt, which completes a fence */
+    if( command_words_left == 0 )
+    {
+        command_words_left = __rdp_command_words( data );
+
+        if( ((data >> 24) & 0x3F) == 0x29 ) { fence_emitted++; }
+    }
+
+    command_words_left--;
+
     /* Simple wrapper */
     __rdp_ringbuffer_queue( data );
 }
@@ -225,6 +456,27 @@ static void __rdp_ringbuffer_send( void )
     /* Don't send nothingness */
     if( __rdp_ringbuffer_size() == 0 ) { return; }
 
+    /* Keep a copy for offline inspection, whole commands only */
+    if( capture_buffer )
+    {
+        int words = __rdp_ringbuffer_size() >> 2;
+
+        if( capture_count + words <= capture_max )
+        {
+            memcpy( &capture_buffer[capture_count], &rdp_ringbuffer[rdp_start >> 2], words << 2 );
+            capture_count += words;
+        }
+        else
+        {
+            /* Stop here rather than leave a hole for a later, smaller send to skip over */
+            capture_buffer = 0;
+            capture_truncated = 1;
+        }
+    }
+
+    profile_bytes += __rdp_ringbuffer_size();
+    profile_kicks++;
+
     /* Ensure the cache is fixed up */
     data_cache_hit_writeback(&rdp_ringbuffer[rdp_start >> 2], __rdp_ringbuffer_size());
     
@@ -274,6 +526,167 @@ void rdp_send( void )
     __rdp_ringbuffer_send();
 }
 
+/**
+ * @brief Queue a sync command and update the hazard tracking
+ *
+ * @param[in] sync
+ *            The sync operation to perform on the RDP
+ */
+static void __rdp_emit_sync( sync_t sync )
+{
+    switch( sync )
+    {
+        case SYNC_FULL:
+            __rdp_ringbuffer_queue( 0xE9000000 );
+            fence_emitted++;
+            pipe_busy = 0;
+            load_busy = 0;
+            tile_busy = 0;
+            break;
+        case SYNC_PIPE:
+            /* The pipeline is drained, so nothing uses TMEM or tiles either */
+            __rdp_ringbuffer_queue( 0xE7000000 );
+            pipe_busy = 0;
+            load_busy = 0;
+            tile_busy = 0;
+            break;
+        case SYNC_TILE:
+            __rdp_ringbuffer_queue( 0xE8000000 );
+            tile_busy = 0;
+            break;
+        case SYNC_LOAD:
+            __rdp_ringbuffer_queue( 0xE6000000 );
+            load_busy = 0;
+            break;
+    }
+    __rdp_ringbuffer_queue( 0x00000000 );
+    __rdp_ringbuffer_send();
+}
+
+/**
+ * @brief Make sure no queued primitive is still in the pipeline before a mode change
+ */
+static void __rdp_pipe_hazard( void )
+{
+    if( pipe_busy )
+    {
+        __rdp_emit_sync( SYNC_PIPE );
+        state_stats.syncs_inserted++;
+    }
+}
+
+/**
+ * @brief Make sure no queued primitive still uses TMEM or a tile about to be reloaded
+ *
+ * @param[in] tile
+ *            Tile descriptor that will be changed
+ */
+static void __rdp_tmem_hazard( int tile )
+{
+    if( load_busy )
+    {
+        __rdp_emit_sync( SYNC_LOAD );
+        state_stats.syncs_inserted++;
+    }
+
+    if( tile_busy & (1 << tile) )
+    {
+        __rdp_emit_sync( SYNC_TILE );
+        state_stats.syncs_inserted++;
+    }
+}
+
+/**
+ * @brief Record that a primitive was queued
+ *
+ * @param[in] tiles
+ *            Mask of tiles the primitive samples, 0 if untextured
+ */
+static inline void __rdp_drawn( uint32_t tiles )
+{
+    pipe_busy = 1;
+    tile_busy |= tiles;
+    if( tiles ) { load_busy = 1; }
+}
+
+/**
+ * @brief Send a SET_OTHER_MODES command and remember it
+ *
+ * @param[in] hi
+ *            Upper command word, including the command byte
+ * @param[in] lo
+ *            Lower command word
+ */
+static void __rdp_set_other_modes( uint32_t hi, uint32_t lo )
+{
+    if( (shadow_valid & SHADOW_MODES) && other_modes[0] == hi && other_modes[1] == lo )
+    {
+        state_stats.modes_elided++;
+        return;
+    }
+
+    __rdp_pipe_hazard();
+
+    __rdp_ringbuffer_queue( hi );
+    __rdp_ringbuffer_queue( lo );
+    __rdp_ringbuffer_send();
+
+    other_modes[0] = hi;
+    other_modes[1] = lo;
+    shadow_valid |= SHADOW_MODES;
+}
+
+/**
+ * @brief Send a SET_COMBINE_MODE command and remember it
+ *
+ * @param[in] hi
+ *            Upper command word, including the command byte
+ * @param[in] lo
+ *            Lower command word
+ */
+static void __rdp_set_combine( uint32_t hi, uint32_t lo )
+{
+    if( (shadow_valid & SHADOW_COMBINE) && combine_mode[0] == hi && combine_mode[1] == lo )
+    {
+        state_stats.modes_elided++;
+        return;
+    }
+
+    __rdp_pipe_hazard();
+
+    __rdp_ringbuffer_queue( hi );
+    __rdp_ringbuffer_queue( lo );
+    __rdp_ringbuffer_send();
+
+    combine_mode[0] = hi;
+    combine_mode[1] = lo;
+    shadow_valid |= SHADOW_COMBINE;
+}
+
+/**
+ * @brief Send a SET_FILL_COLOR command unless the color is already set
+ *
+ * @param[in] color
+ *            Packed fill color
+ */
+static void __rdp_set_fill_color( uint32_t color )
+{
+    if( (shadow_valid & SHADOW_FILL) && fill_color == color )
+    {
+        state_stats.colors_elided++;
+        return;
+    }
+
+    __rdp_pipe_hazard();
+
+    __rdp_ringbuffer_queue( 0x37000000 );
+    __rdp_ringbuffer_queue( color );
+    __rdp_ringbuffer_send();
+
+    fill_color = color;
+    shadow_valid |= SHADOW_FILL;
+}
+
 /**
  * @brief Initialize the RDP system
  */
@@ -283,14 +696,40 @@ void rdp_init( void )
     rdp_start = 0;
     rdp_end = 0;
 
+    /* Reciprocals used by the fixed point triangle setup */
+    recip_table[0] = 0;
+    for( int i = 1; i < RECIP_TABLE_SIZE; i++ )
+    {
+        recip_table[i] = 0x80000000 / i;
+    }
+
+    /* Nothing is known about TMEM yet */
+    rdp_invalidate_palettes();
+
+    /* No fences outstanding */
+    fence_emitted = 0;
+    fence_completed = 0;
+    command_words_left = 0;
+    memset( fence_callbacks, 0, sizeof(fence_callbacks) );
+
     /* Set up interrupt for SYNC_FULL */
     register_DP_handler( __rdp_interrupt );
     set_DP_interrupt( 1 );
 	
+    /* Nothing is known about the RDP state yet */
+    shadow_valid = 0;
+    pipe_busy = 0;
+    load_busy = 0;
+    tile_busy = 0;
+    rdp_reset_state_stats();
+
     // NEW, fixes default prim colors
     __rdp_ringbuffer_queue( 0x3A000000 );
     __rdp_ringbuffer_queue( 0xFFFFFFFF );
     __rdp_ringbuffer_send();	
+
+    prim_color = 0xFFFFFFFF;
+    shadow_valid |= SHADOW_PRIM;
 }
 
 /**
@@ -319,10 +758,35 @@ void rdp_attach_display( display_context_t disp )
 {
     if( disp == 0 ) { return; }
 
+    /* Software drawing has to reach memory before the RDP draws over it */
+    display_flush( disp );
+
+    /* Finish drawing to the previous target before switching */
+    if( attached_surface )
+    {
+        rdp_sync( SYNC_PIPE );
+        attached_surface = 0;
+    }
+
+    __rdp_pipe_hazard();
+
     /* Set the rasterization buffer */
     __rdp_ringbuffer_queue( 0xFF000000 | ((__bitdepth == 2) ? 0x00100000 : 0x00180000) | (__width - 1) );
     __rdp_ringbuffer_queue( (uint32_t)__get_buffer( disp ) );
+
+    /* Depth buffer shared by all display contexts */
+    if( __safe_zbuffer )
+    {
+        __rdp_ringbuffer_queue( 0xFE000000 );
+        __rdp_ringbuffer_queue( (uint32_t)__safe_zbuffer );
+    }
+
     __rdp_ringbuffer_send();
+
+    attached_disp = disp;
+    __rdp_fills_pending = 0;
+    target_width = __width;
+    target_height = __height;
 }
 
 /**
@@ -336,106 +800,260 @@ void rdp_attach_display( display_context_t disp )
  */
 void rdp_detach_display( void )
 {
-    /* Wait for SYNC_FULL to finish */
-    wait_intr = 0;
-
     /* Force the RDP to rasterize everything and then interrupt us */
-    rdp_sync( SYNC_FULL );
+    rdp_fence_wait( rdp_emit_fence() );
 
-    if( INTERRUPTS_ENABLED == get_interrupts_state() )
-    {
-        /* Only wait if interrupts are enabled */
-        while( !wait_intr ) { ; }
-    }
+    /* Write back and invalidate the lines software drew through the cache, so the
+       RDP output around them is read from memory from now on */
+    display_flush( attached_disp );
 
-    /* Set back to zero for next detach */
-    wait_intr = 0;
+    attached_disp = 0;
+    __rdp_fills_pending = 0;
 }
 
 /**
- * @brief Perform a sync operation
+ * @brief Display callback used by #rdp_detach_show
  *
- * Do not use excessive sync operations between commands as this can
- * cause the RDP to stall.  If the RDP stalls due to too many sync
- * operations, graphics may not be displayed until the next render
- * cycle, causing bizarre artifacts.  The rule of thumb is to only add
- * a sync operation if the data you need is not yet available in the
- * pipeline.
+ * @param[in] arg
+ *            Display context to show
+ */
+static void __rdp_show_callback( void *arg )
+{
+    display_show( (display_context_t)(uint32_t)arg );
+}
+
+/**
+ * @brief Detach the RDP from a display context and show it once rendering completes
  *
- * @param[in] sync
- *            The sync operation to perform on the RDP
+ * Unlike #rdp_detach_display, this does not wait for the RDP.  The display context is
+ * passed to #display_show from the DP interrupt once everything queued so far has been
+ * rasterized, so the CPU can go on to #display_lock the next buffer and build its
+ * commands while the RDP is still busy.  This needs at least three display buffers to
+ * be useful, since the shown buffer and the one being rasterized are both unavailable.
+ *
+ * @note Software drawing with the @ref graphics must not touch the display context after
+ * this call.
+ *
+ * @param[in] disp
+ *            The display context the RDP is attached to
  */
-void rdp_sync( sync_t sync )
+void rdp_detach_show( display_context_t disp )
 {
-    switch( sync )
+    rdp_fence_t fence = rdp_emit_fence();
+
+    attached_disp = 0;
+    __rdp_fills_pending = 0;
+
+    if( rdp_fence_callback( fence, __rdp_show_callback, (void *)(uint32_t)disp ) )
     {
-        case SYNC_FULL:
-            __rdp_ringbuffer_queue( 0xE9000000 );
-            break;
-        case SYNC_PIPE:
-            __rdp_ringbuffer_queue( 0xE7000000 );
-            break;
-        case SYNC_TILE:
-            __rdp_ringbuffer_queue( 0xE8000000 );
-            break;
-        case SYNC_LOAD:
-            __rdp_ringbuffer_queue( 0xE6000000 );
-            break;
+        /* No free callback slot, fall back to waiting */
+        rdp_fence_wait( fence );
+        display_show( disp );
     }
-    __rdp_ringbuffer_queue( 0x00000000 );
-    __rdp_ringbuffer_send();
 }
 
 /**
- * @brief Set the hardware clipping boundary
+ * @brief Queue a fence to the RDP
  *
- * @param[in] tx
- *            Top left X coordinate in pixels
- * @param[in] ty
- *            Top left Y coordinate in pixels
- * @param[in] bx
- *            Bottom right X coordinate in pixels
- * @param[in] by
- *            Bottom right Y coordinate in pixels
+ * A fence is a #SYNC_FULL whose completion can be tested or waited on later, allowing
+ * the CPU to keep working while the RDP rasterizes.
+ *
+ * @return A fence that completes once the RDP has finished every command queued before it.
  */
-void rdp_set_clipping( uint32_t tx, uint32_t ty, uint32_t bx, uint32_t by )
+rdp_fence_t rdp_emit_fence( void )
 {
-    /* Convert pixel space to screen space in command */
-    __rdp_ringbuffer_queue( 0x2D000000 | (tx << 14) | (ty << 2) );
-    __rdp_ringbuffer_queue( (bx << 14) | (by << 2) );
-    __rdp_ringbuffer_send();
+    rdp_sync( SYNC_FULL );
+
+    return fence_emitted;
 }
 
 /**
- * @brief Set the hardware clipping boundary to the entire screen
+ * @brief Check whether the RDP has reached a fence
+ *
+ * @param[in] fence
+ *            A fence returned by #rdp_emit_fence
+ *
+ * @return Nonzero if all commands before the fence have completed.
  */
-void rdp_set_default_clipping( void )
+int rdp_fence_done( rdp_fence_t fence )
 {
-    /* Clip box is the whole screen */
-    rdp_set_clipping( 0, 0, __width, __height );
+    return (int32_t)(fence_completed - fence) >= 0;
 }
 
 /**
- * @brief Enable display of 2D filled (untextured) rectangles
+ * @brief Wait until the RDP has reached a fence
  *
- * This must be called before using #rdp_draw_filled_rectangle.
+ * @note This function requires interrupts to be enabled to operate properly.  If they
+ * are disabled, it returns immediately.
+ *
+ * @param[in] fence
+ *            A fence returned by #rdp_emit_fence
  */
-void rdp_enable_primitive_fill( void )
-{	
-    // Set other modes to fill and other defaults
-    __rdp_ringbuffer_queue( 0x2FB000FF );
-    __rdp_ringbuffer_queue( 0x00004000 );
-    __rdp_ringbuffer_send();	
+void rdp_fence_wait( rdp_fence_t fence )
+{
+    if( INTERRUPTS_ENABLED == get_interrupts_state() )
+    {
+        /* Only wait if interrupts are enabled */
+        while( !rdp_fence_done( fence ) ) { ; }
+    }
 }
 
-// Set Fill Color (R,G,B,A)
-void rdp_set_fill_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a )
+/**
+ * @brief Call a function once the RDP has reached a fence
+ *
+ * The callback runs from the DP interrupt, or immediately if the fence has already
+ * completed.
+ *
+ * @param[in] fence
+ *            A fence returned by #rdp_emit_fence
+ * @param[in] callback
+ *            Function to call
+ * @param[in] arg
+ *            Argument passed to the callback
+ *
+ * @return 0 on success or -1 if too many callbacks are pending.
+ */
+int rdp_fence_callback( rdp_fence_t fence, void (*callback)( void *arg ), void *arg )
 {
-    uint32_t color;
-	
-    if( __bitdepth == 2 )
+    int ret = -1;
+
+    disable_interrupts();
+
+    if( rdp_fence_done( fence ) )
     {
-        // 8 to 5 bit (RGB555)
+        enable_interrupts();
+        callback( arg );
+        return 0;
+    }
+
+    for( int i = 0; i < MAX_FENCE_CALLBACKS; i++ )
+    {
+        if( !fence_callbacks[i].callback )
+        {
+            fence_callbacks[i].fence = fence;
+            fence_callbacks[i].arg = arg;
+            fence_callbacks[i].callback = callback;
+            ret = 0;
+            break;
+        }
+    }
+
+    enable_interrupts();
+
+    return ret;
+}
+
+/**
+ * @brief Perform a sync operation
+ *
+ * Do not use excessive sync operations between commands as this can
+ * cause the RDP to stall.  If the RDP stalls due to too many sync
+ * operations, graphics may not be displayed until the next render
+ * cycle, causing bizarre artifacts.  The rule of thumb is to only add
+ * a sync operation if the data you need is not yet available in the
+ * pipeline.
+ *
+ * The RDP state tracker drops pipe, load and tile syncs when nothing was drawn since
+ * the last one, and inserts them itself before mode changes and texture loads that
+ * need them.  #SYNC_FULL is always sent.
+ *
+ * @param[in] sync
+ *            The sync operation to perform on the RDP
+ */
+void rdp_sync( sync_t sync )
+{
+    /* Drop syncs with nothing to wait for */
+    if( (sync == SYNC_PIPE && !pipe_busy) ||
+        (sync == SYNC_LOAD && !load_busy) ||
+        (sync == SYNC_TILE && !tile_busy) )
+    {
+        state_stats.syncs_elided++;
+        return;
+    }
+
+    __rdp_emit_sync( sync );
+}
+
+/**
+ * @brief Send a SET_SCISSOR command and remember it
+ *
+ * @param[in] hi
+ *            Upper command word, including the command byte
+ * @param[in] lo
+ *            Lower command word
+ */
+static void __rdp_set_scissor( uint32_t hi, uint32_t lo )
+{
+    if( (shadow_valid & SHADOW_SCISSOR) && scissor[0] == hi && scissor[1] == lo )
+    {
+        state_stats.scissors_elided++;
+        return;
+    }
+
+    __rdp_pipe_hazard();
+
+    __rdp_ringbuffer_queue( hi );
+    __rdp_ringbuffer_queue( lo );
+    __rdp_ringbuffer_send();
+
+    scissor[0] = hi;
+    scissor[1] = lo;
+    shadow_valid |= SHADOW_SCISSOR;
+}
+
+/**
+ * @brief Set the hardware clipping boundary
+ *
+ * @param[in] tx
+ *            Top left X coordinate in pixels
+ * @param[in] ty
+ *            Top left Y coordinate in pixels
+ * @param[in] bx
+ *            Bottom right X coordinate in pixels
+ * @param[in] by
+ *            Bottom right Y coordinate in pixels
+ */
+void rdp_set_clipping( uint32_t tx, uint32_t ty, uint32_t bx, uint32_t by )
+{
+    /* Convert pixel space to screen space in command */
+    __rdp_set_scissor( 0x2D000000 | (tx << 14) | (ty << 2), (bx << 14) | (by << 2) );
+}
+
+/**
+ * @brief Set the hardware clipping boundary to the entire screen
+ */
+void rdp_set_default_clipping( void )
+{
+    /* Clip box is the whole render target */
+    if( attached_surface )
+    {
+        rdp_set_clipping( 0, 0, target_width, target_height );
+    }
+    else
+    {
+        rdp_set_clipping( 0, 0, __width, __height );
+    }
+}
+
+/**
+ * @brief Enable display of 2D filled (untextured) rectangles
+ *
+ * This must be called before using #rdp_draw_filled_rectangle.
+ */
+void rdp_enable_primitive_fill( void )
+{	
+    // Set other modes to fill and other defaults
+    __rdp_set_other_modes( 0x2FB000FF, 0x00004000 );
+}
+
+// Set Fill Color (R,G,B,A)
+void rdp_set_fill_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a )
+{
+    uint32_t color;
+	
+    if( __bitdepth == 2 )
+    {
+        // 8 to 5 bit (RGB555)
         r = r >> 3;
         g = g >> 3;
         b = b >> 3;
@@ -449,9 +1067,181 @@ void rdp_set_fill_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a )
         color = r << 24 | g << 16 | b << 8 | a;
 	
     // Set Fill Color
-    __rdp_ringbuffer_queue( 0x37000000 );
-    __rdp_ringbuffer_queue( color );
+    __rdp_set_fill_color( color );
+}
+
+/**
+ * @brief Check whether the RDP is rendering to a display context
+ *
+ * Used by the @ref graphics to route fills through the RDP.
+ *
+ * @param[in] disp
+ *            A display context as returned by #display_lock
+ *
+ * @return Nonzero if the RDP is attached to the display context.
+ */
+int __rdp_attached( display_context_t disp )
+{
+    return disp != 0 && disp == attached_disp;
+}
+
+/**
+ * @brief Wait for fills queued by the software graphics routines
+ *
+ * Called by the @ref graphics before drawing to a display context with the CPU, so that
+ * boxes handed to the RDP earlier end up underneath, not on top.
+ *
+ * @param[in] disp
+ *            Display context about to be drawn to
+ */
+void __rdp_wait_fills( display_context_t disp )
+{
+    if( !__rdp_attached( disp ) ) { return; }
+
+    rdp_fence_wait( rdp_emit_fence() );
+    __rdp_fills_pending = 0;
+}
+
+/**
+ * @brief RDP state replaced by #__rdp_begin_solid
+ */
+typedef struct
+{
+    uint32_t other_modes[2];
+    uint32_t fill_color;
+    uint32_t scissor[2];
+    int scissor_valid;
+} solid_state;
+
+/**
+ * @brief Switch to solid fills of a color for the software graphics routines
+ *
+ * The software routines clip to the display themselves, so the clipping rectangle is
+ * opened up to the whole display as well.
+ *
+ * @param[in]  color
+ *             Color in framebuffer format as returned by #graphics_make_color
+ * @param[out] saved
+ *             Render mode, fill color and clipping to restore with #__rdp_end_solid
+ */
+static void __rdp_begin_solid( uint32_t color, solid_state *saved )
+{
+    saved->other_modes[0] = other_modes[0];
+    saved->other_modes[1] = other_modes[1];
+    saved->fill_color = fill_color;
+    saved->scissor[0] = scissor[0];
+    saved->scissor[1] = scissor[1];
+    saved->scissor_valid = shadow_valid & SHADOW_SCISSOR;
+
+    /* 16-bit fill colors are two packed pixels */
+    if( __bitdepth == 2 ) { color = (color & 0xFFFF) | (color << 16); }
+
+    if( (other_modes[0] & 0x00300000) != 0x00300000 )
+    {
+        rdp_sync( SYNC_PIPE );
+        rdp_enable_primitive_fill();
+    }
+
+    __rdp_set_fill_color( color );
+    rdp_set_clipping( 0, 0, __width, __height );
+
+    __rdp_fills_pending = 1;
+}
+
+/**
+ * @brief Restore the state saved by #__rdp_begin_solid
+ *
+ * A clipping rectangle sent with #rdp_command cannot be restored, so the display stays
+ * unclipped in that case.
+ *
+ * @param[in] saved
+ *            Render mode, fill color and clipping to restore
+ */
+static void __rdp_end_solid( const solid_state *saved )
+{
+    int fill_mode = ( (saved->other_modes[0] & 0x00300000) == 0x00300000 );
+
+    if( !fill_mode && saved->other_modes[0] )
+    {
+        rdp_sync( SYNC_PIPE );
+        __rdp_set_other_modes( saved->other_modes[0], saved->other_modes[1] );
+    }
+
+    __rdp_set_fill_color( saved->fill_color );
+
+    if( saved->scissor_valid ) { __rdp_set_scissor( saved->scissor[0], saved->scissor[1] ); }
+}
+
+/**
+ * @brief Fill a rectangle with a framebuffer color regardless of the current mode
+ *
+ * Used by the @ref graphics to hand solid fills to the RDP.  The RDP is switched to fill
+ * mode only if needed, and the render mode and fill color are restored afterwards so
+ * that hardware drawing can continue as if nothing happened.
+ *
+ * @param[in] tx
+ *            Pixel X location of the top left of the rectangle
+ * @param[in] ty
+ *            Pixel Y location of the top left of the rectangle
+ * @param[in] bx
+ *            Pixel X location of the bottom right of the rectangle, inclusive
+ * @param[in] by
+ *            Pixel Y location of the bottom right of the rectangle, inclusive
+ * @param[in] color
+ *            Color in framebuffer format as returned by #graphics_make_color
+ */
+void __rdp_fill_rectangle( int tx, int ty, int bx, int by, uint32_t color )
+{
+    solid_state saved;
+
+    __rdp_begin_solid( color, &saved );
+    rdp_draw_filled_rectangle( tx, ty, bx, by );
+    __rdp_end_solid( &saved );
+}
+
+/**
+ * @brief Clear the Z-buffer to the farthest depth
+ *
+ * Uses a fill rectangle over the Z-buffer allocated with #display_enable_zbuffer, which
+ * is much faster than clearing it with the CPU.  Call this once per frame after
+ * #rdp_attach_display and before drawing Z-buffered triangles.  The render mode and fill
+ * color in effect before the call are restored afterwards.
+ *
+ * Z-buffered primitives also need the Z compare and Z update bits enabled in the render
+ * mode passed to #rdp_texture_cycle.
+ */
+void rdp_clear_zbuffer( void )
+{
+    if( !__safe_zbuffer || !attached_disp ) { return; }
+
+    uint32_t saved_modes[2] = { other_modes[0], other_modes[1] };
+    uint32_t saved_fill = fill_color;
+
+    __rdp_pipe_hazard();
+
+    /* Render into the Z-buffer as if it was a 16-bit color image */
+    __rdp_ringbuffer_queue( 0xFF100000 | (__width - 1) );
+    __rdp_ringbuffer_queue( (uint32_t)__safe_zbuffer );
+    __rdp_ringbuffer_send();
+
+    /* Maximum depth with no slope, packed twice */
+    rdp_enable_primitive_fill();
+    __rdp_set_fill_color( 0xFFFCFFFC );
+
+    rdp_draw_filled_rectangle( 0, 0, __width - 1, __height - 1 );
+    __rdp_pipe_hazard();
+
+    /* Back to the display context */
+    __rdp_ringbuffer_queue( 0xFF000000 | ((__bitdepth == 2) ? 0x00100000 : 0x00180000) | (__width - 1) );
+    __rdp_ringbuffer_queue( (uint32_t)__get_buffer( attached_disp ) );
     __rdp_ringbuffer_send();
+
+    __rdp_set_fill_color( saved_fill );
+
+    if( saved_modes[0] )
+    {
+        __rdp_set_other_modes( saved_modes[0], saved_modes[1] );
+    }
 }
 
 /**
@@ -461,17 +1251,28 @@ void rdp_set_fill_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a )
  */
 void rdp_enable_blend_fill( void )
 {
-    __rdp_ringbuffer_queue( 0x2F0000FF );
-    __rdp_ringbuffer_queue( 0x80000000 );
-    __rdp_ringbuffer_send();	
+    __rdp_set_other_modes( 0x2F0000FF, 0x80000000 );
 }
 
 // Set Blend Color (R,G,B,A)
 void rdp_set_blend_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a )
 {
+    uint32_t color = r << 24 | g << 16 | b << 8 | a;
+
+    if( (shadow_valid & SHADOW_BLEND) && blend_color == color )
+    {
+        state_stats.colors_elided++;
+        return;
+    }
+
+    __rdp_pipe_hazard();
+
     __rdp_ringbuffer_queue( 0x39000000 );
-    __rdp_ringbuffer_queue( r << 24 | g << 16 | b << 8 | a );
+    __rdp_ringbuffer_queue( color );
     __rdp_ringbuffer_send();	
+
+    blend_color = color;
+    shadow_valid |= SHADOW_BLEND;
 }
 
 // Set texture in copy mode
@@ -481,21 +1282,28 @@ void rdp_texture_copy( uint64_t mode )
     uint32_t mode_lo = mode & 0xFFFFFFFF;
 	
     // Set other modes	
-    __rdp_ringbuffer_queue( 0x2F2000FF | mode_hi );
-    __rdp_ringbuffer_queue( 0x00004001 | mode_lo );
-    __rdp_ringbuffer_send();
+    __rdp_set_other_modes( 0x2F2000FF | mode_hi, 0x00004001 | mode_lo );
 	
     // 4 pixels cycle
     pixel_mode = 4096;	
 }
 
 /* Set cycle (Point sampled default)
+   0: 1 cycle, 1: 2 cycle, 2: 2 cycle bilinear, 3: 2 cycle bilinear mipmapped (trilinear)
    Compatible with: X/Y Scale, Prim color, Alpha blending */
 void rdp_texture_cycle( uint8_t cycle, uint8_t enable_alpha, uint64_t mode )
 {
     uint32_t mode_hi = mode >> 32;
     uint32_t mode_lo = mode & 0xFFFFFFFF;
+    uint32_t filter = 0;
 	
+    // Filtering
+    if ( cycle >= 2 )
+        filter |= 0x2000; // bilinear (SAMPLE_TYPE)
+
+    if ( cycle >= 3 )
+        filter |= 0x10000; // level of detail (TEX_LOD_EN)
+
     // Draw cycle
     if ( cycle > 0 )
     {
@@ -509,23 +1317,23 @@ void rdp_texture_cycle( uint8_t cycle, uint8_t enable_alpha, uint64_t mode )
     }
 
     // Set Other Modes	
-    __rdp_ringbuffer_queue( 0x2F000800 | cycle << 20 | mode_hi );
-    __rdp_ringbuffer_queue( 0x00404040 | mode_lo );
-    __rdp_ringbuffer_send();
+    __rdp_set_other_modes( 0x2F000800 | cycle << 20 | filter | mode_hi, 0x00404040 | mode_lo );
 	
     // Set Combine Mode
-    __rdp_ringbuffer_queue( 0x3C000061 );
-    __rdp_ringbuffer_queue( !enable_alpha ? 0x082C01C0 : 0x082C01FF );
-    __rdp_ringbuffer_send();
+    if ( filter & 0x10000 )
+    {
+        // Cycle 1: lerp between the two mipmap levels, cycle 2: multiply by prim color
+        __rdp_set_combine( 0x3C26A060, !enable_alpha ? 0x18FC93FE : 0x180C93FF );
+    }
+    else
+        __rdp_set_combine( 0x3C000061, !enable_alpha ? 0x082C01C0 : 0x082C01FF );
 }	
 
 // Additive Blending
 void rdp_additive( void )
 {	
     // Set Combine Mode
-    __rdp_ringbuffer_queue( 0x3C000061 );
-    __rdp_ringbuffer_queue( 0x082C017F );
-    __rdp_ringbuffer_send();			
+    __rdp_set_combine( 0x3C000061, 0x082C017F );
 }
 
 /* Intensify
@@ -533,39 +1341,79 @@ void rdp_additive( void )
 void rdp_intensify( uint8_t enable_alpha )
 {	
     // Set Combine Mode
-    __rdp_ringbuffer_queue( 0x3C0000C1 );
-    __rdp_ringbuffer_queue( !enable_alpha ? 0x032C00C0 : 0x032C00FF );	
-    __rdp_ringbuffer_send();	
+    __rdp_set_combine( 0x3C0000C1, !enable_alpha ? 0x032C00C0 : 0x032C00FF );
 }
 
 // Unique Color (sprite silouette)
 void rdp_color( uint8_t enable_alpha )
 {	
     // Set Combine Mode
-    __rdp_ringbuffer_queue( 0x3C000063 );
-    __rdp_ringbuffer_queue( !enable_alpha ? 0x082C01C0 : 0x082C01FF );		
-    __rdp_ringbuffer_send();	
+    __rdp_set_combine( 0x3C000063, !enable_alpha ? 0x082C01C0 : 0x082C01FF );
 }
 
 // TV noise effects (0 disable, 1 partial, 2 complete)
 void rdp_noise( uint8_t type, uint8_t enable_alpha )
 {	
     // Set Combine Mode
-    if (type>0)
-        __rdp_ringbuffer_queue( (type == 1) ? 0x3C0000E1 : 0x3C0000E3 );
-    else
-        __rdp_ringbuffer_queue( 0x3C000061 );
-	
-    __rdp_ringbuffer_queue( !enable_alpha ? 0x082C01C0 : 0x082C01FF );	
-    __rdp_ringbuffer_send();	
+    __rdp_set_combine( (type > 0) ? ((type == 1) ? 0x3C0000E1 : 0x3C0000E3) : 0x3C000061,
+                       !enable_alpha ? 0x082C01C0 : 0x082C01FF );
 }
 
 // Set Primitive Color (R,G,B,A)
 void rdp_set_prim_color( uint8_t r, uint8_t g, uint8_t b, uint8_t a )
 {
+    uint32_t color = r << 24 | g << 16 | b << 8 | a;
+
+    // Latched per primitive, no sync needed
+    if( (shadow_valid & SHADOW_PRIM) && prim_color == color )
+    {
+        state_stats.colors_elided++;
+        return;
+    }
+
+    prim_color = color;
+
     __rdp_ringbuffer_queue( 0x3A000000 );
-    __rdp_ringbuffer_queue( r << 24 | g << 16 | b << 8 | a );
+    __rdp_ringbuffer_queue( prim_color );
     __rdp_ringbuffer_send();	
+
+    shadow_valid |= SHADOW_PRIM;
+}
+
+/**
+ * @brief Forget about palette entries overwritten by a texture load
+ *
+ * @param[in] upper_bytes
+ *            Number of bytes written to the palette area of TMEM, starting at its beginning
+ */
+static void __rdp_tlut_clobber( int upper_bytes )
+{
+    if( upper_bytes <= 0 ) { return; }
+
+    /* Each palette entry occupies a 64-bit word */
+    int entries = (upper_bytes + 7) >> 3;
+
+    if( entries >= TLUT_ENTRIES )
+    {
+        rdp_invalidate_palettes();
+        return;
+    }
+
+    for( int i = 0; i < entries; i++ )
+    {
+        tlut_valid[i >> 5] &= ~(1 << (i & 31));
+    }
+}
+
+/**
+ * @brief Forget which palette entries are loaded in TMEM
+ *
+ * The next #rdp_load_palette will upload every entry it is given.  Call this after
+ * loading anything into upper TMEM with #rdp_command.
+ */
+void rdp_invalidate_palettes( void )
+{
+    memset( tlut_valid, 0, sizeof(tlut_valid) );
 }
 
 // Select palette for 4bit textures
@@ -574,25 +1422,62 @@ void rdp_select_palette( uint8_t pal )
     use_palette = pal & 15;	
 }
 
-// Load invidivual palette into TMEM
+// Load invidivual palette into TMEM, only the entries that changed since the last upload
 void rdp_load_palette( uint8_t pal, uint8_t col_num, uint16_t *palette )
 {	
+    int base = (pal & 15) << 4;
+    int count = col_num + 1;
+    int first = -1;
+    int last = -1;
+
+    if( base + count > TLUT_ENTRIES ) { count = TLUT_ENTRIES - base; }
+
+    // Find the dirty range
+    for( int i = 0; i < count; i++ )
+    {
+        int entry = base + i;
+        uint32_t bit = 1 << (entry & 31);
+
+        if( !(tlut_valid[entry >> 5] & bit) || tlut_shadow[entry] != palette[i] )
+        {
+            if( first < 0 ) { first = i; }
+            last = i;
+
+            tlut_shadow[entry] = palette[i];
+            tlut_valid[entry >> 5] |= bit;
+        }
+    }
+
+    // Already resident
+    if( first < 0 ) { return; }
+
+    // Keep the source address 64-bit aligned
+    first &= ~3;
+
+    data_cache_hit_writeback( &palette[first], (last - first + 1) << 1 );
+
+    __rdp_tmem_hazard( 7 );
+
     // Set Texture Image (Palette)
     __rdp_ringbuffer_queue( 0x3D100000 ); // format RGBA / size 16bit
-    __rdp_ringbuffer_queue( (uint32_t)palette );		
-    __rdp_ringbuffer_send();
+    __rdp_ringbuffer_queue( (uint32_t)&palette[first] );
 	
     // Set Tile (TLUT)
-    __rdp_ringbuffer_queue( 0x35000100 | ((pal & 15) << 4) ); // TMEM position
+    __rdp_ringbuffer_queue( 0x35000100 | (base + first) ); // TMEM position
     __rdp_ringbuffer_queue( 0x07000000 ); // tile 7 to avoid SYNC TILE		
-    __rdp_ringbuffer_send();
 	
     // Load TLUT
     __rdp_ringbuffer_queue( 0x30000000 );
-    __rdp_ringbuffer_queue( 0x07000000 | (col_num << 2) << 12 ); // tile 7
+    __rdp_ringbuffer_queue( 0x07000000 | ((last - first) << 2) << 12 ); // tile 7
     __rdp_ringbuffer_send();
 }
 
+// Load all 16 palettes (or one 256 color palette) into TMEM with a single upload
+void rdp_load_palettes( uint16_t *palettes )
+{
+    rdp_load_palette( 0, TLUT_ENTRIES - 1, palettes );
+}
+
 // Load texture on TMEM depending on sprite bitdepth
 void rdp_load_texture( sprite_t *sprite )
 {
@@ -600,6 +1485,7 @@ void rdp_load_texture( sprite_t *sprite )
 	
     // Save cache for managed sprite commands
     cache.width = sprite->width - 1;
+    mip_levels = 1;
     cache.height = sprite->height - 1;	
     cache.cp_x = sprite->hslices;
     cache.cp_y = sprite->vslices;
@@ -613,6 +1499,8 @@ void rdp_load_texture( sprite_t *sprite )
 
     // Because we are dividing by 8, we want to round up if we have a remainder
     uint16_t round_amount = (cache.real_width  % 8) ? 1 : 0;		
+
+    __rdp_tmem_hazard( 0 );
 	
     if ( sprite->bitdepth > 1 ) // 16/32bit textures
     {	
@@ -629,7 +1517,11 @@ void rdp_load_texture( sprite_t *sprite )
         // Copying out only a chunk this time
         __rdp_ringbuffer_queue( 0x34000000 );
         __rdp_ringbuffer_queue( ((cache.width << 2) & 0xFFF) << 12 | ((cache.height << 2) & 0xFFF) );
-        __rdp_ringbuffer_send();							
+        __rdp_ringbuffer_send();
+
+        // 32bit textures keep half of each texel in upper TMEM
+        int tmem_bytes = ((((cache.real_width >> 3) + round_amount) << 1) << 3) * sprite->height;
+        __rdp_tlut_clobber( (sprite->bitdepth == 4) ? tmem_bytes : tmem_bytes - TMEM_TLUT_OFFSET );
     }	
     else // 4/8bit textures
     {	
@@ -653,6 +1545,8 @@ void rdp_load_texture( sprite_t *sprite )
         __rdp_ringbuffer_queue( ((cache.width << 2) & 0xFFF) << 12 | ((cache.height << 2) & 0xFFF) );
         __rdp_ringbuffer_send();	
 
+        __rdp_tlut_clobber( ((math_line << 3) * sprite->height) - TMEM_TLUT_OFFSET );
+
         // set tile (2/2), texture: set color index and texture bitdepth
         __rdp_ringbuffer_queue( 0x35400000 | sprite->bitdepth << 19 | math_line << 9 ); 
         __rdp_ringbuffer_queue( 0x40100 | use_palette << 20 | hbits << 14 | wbits << 4 );
@@ -661,18 +1555,335 @@ void rdp_load_texture( sprite_t *sprite )
 }
 
 /**
- * @brief Draw a textured rectangle with a scaled texture
+ * @brief Load a mipmapped sprite into TMEM
  *
- * Given an already loaded texture, this function will draw a rectangle textured with the loaded texture
- * at a scale other than 1.  This allows rectangles to be drawn with stretched or squashed textures.
- * If the rectangle is larger than the texture after scaling, it will be tiled or mirrored based on the
- * mirror setting given in the load texture command.
+ * The sprite must have been converted with mksprite -m, which stores each mipmap level
+ * after the previous one at half its size.  All levels are loaded in a single submission,
+ * level N going to tile N, so they can be used by the RDP level of detail hardware with
+ * #rdp_texture_cycle mode 3, or picked per draw by #rdp_draw_sprite_scaled when drawing
+ * minified sprites in the other modes.
  *
- * Before using this command to draw a textured rectangle, use #rdp_enable_texture_copy to set the RDP
- * up in texture mode.
+ * Only 16bit sprites are supported.  Levels that do not fit in TMEM are dropped.
  *
- * @param[in] tx
- *            The pixel X location of the top left of the rectangle
+ * @param[in] sprite
+ *            Sprite with mipmaps
+ * @param[in] levels
+ *            Number of levels stored in the sprite, including the full size image
+ */
+void rdp_load_texture_mipmap( sprite_t *sprite, int levels )
+{
+    if ( !sprite || sprite->bitdepth != 2 ) { return; }
+
+    if ( levels > 8 ) { levels = 8; }
+    if ( levels <= 1 )
+    {
+        rdp_load_texture( sprite );
+        return;
+    }
+
+    // Save cache for managed sprite commands, level 0 is what gets drawn
+    cache.width = sprite->width - 1;
+    cache.height = sprite->height - 1;
+    cache.cp_x = 0;
+    cache.cp_y = 0;
+    cache.cp_start = 0;
+    cache.real_width  = __rdp_round_to_power( sprite->width );
+    cache.real_height = __rdp_round_to_power( sprite->height );
+
+    uint8_t *data = (uint8_t *)sprite->data;
+    int width = sprite->width;
+    int height = sprite->height;
+    uint32_t tmem = 0;
+    int level;
+
+    for ( level = 0; level < levels; level++ ) { __rdp_tmem_hazard( level ); }
+
+    for ( level = 0; level < levels; level++ )
+    {
+        uint32_t real_width = __rdp_round_to_power( width );
+        uint32_t wbits = __rdp_log2( real_width );
+        uint32_t hbits = __rdp_log2( __rdp_round_to_power( height ) );
+        uint16_t round_amount = (real_width % 8) ? 1 : 0;
+        uint32_t line = (((real_width >> 3) + round_amount) << 1) & 0x1FF;
+
+        // Out of TMEM
+        if ( tmem + line * height > 512 ) { break; }
+
+        // Point the RDP at this level
+        __rdp_ringbuffer_queue( 0x3D100000 | (width - 1) );
+        __rdp_ringbuffer_queue( (uint32_t)data );
+
+        // One tile per level, packed one after the other in TMEM, shifting S and T down
+        // so that level 0 coordinates land on the right texels of the smaller level
+        __rdp_ringbuffer_queue( 0x35100000 | line << 9 | tmem );
+        __rdp_ringbuffer_queue( level << 24 | 0x40100 | hbits << 14 | level << 10 | wbits << 4 | level );
+
+        __rdp_ringbuffer_queue( 0x34000000 );
+        __rdp_ringbuffer_queue( level << 24 | (((width - 1) << 2) & 0xFFF) << 12 | (((height - 1) << 2) & 0xFFF) );
+
+        tmem += line * height;
+
+        // Levels are padded to 8 bytes by mksprite
+        data += ((width * height * 2) + 7) & ~7;
+        width = (width > 1) ? width >> 1 : 1;
+        height = (height > 1) ? height >> 1 : 1;
+    }
+
+    __rdp_ringbuffer_send();
+
+    __rdp_tlut_clobber( (tmem << 3) - TMEM_TLUT_OFFSET );
+
+    mip_levels = level ? level : 1;
+}
+
+/**
+ * @brief Load a rectangular region of an image in RDRAM into TMEM
+ *
+ * The tile is set up so that drawing starts at the top left of the region, and the
+ * managed sprite cache is updated so that #rdp_draw_sprite and friends work as usual.
+ *
+ * @param[in] image
+ *            Pointer to the image, 8 byte aligned
+ * @param[in] image_width
+ *            Width of the whole image in pixels
+ * @param[in] bitdepth
+ *            Bytes per pixel, 2 or 4
+ * @param[in] sx
+ *            X coordinate of the region in pixels
+ * @param[in] sy
+ *            Y coordinate of the region in pixels
+ * @param[in] width
+ *            Width of the region in pixels
+ * @param[in] height
+ *            Height of the region in pixels
+ */
+static void __rdp_load_tile_region( void *image, int image_width, int bitdepth, int sx, int sy, int width, int height )
+{
+    uint32_t size = (bitdepth == 2) ? 0x00100000 : 0x00180000;
+
+    cache.width = width - 1;
+    mip_levels = 1;
+    cache.height = height - 1;
+    cache.cp_x = 0;
+    cache.cp_y = 0;
+    cache.cp_start = 0;
+
+    /* Figure out the power of two this region fits into */
+    cache.real_width  = __rdp_round_to_power( width );
+    cache.real_height = __rdp_round_to_power( height );
+    uint32_t wbits = __rdp_log2( cache.real_width  );
+    uint32_t hbits = __rdp_log2( cache.real_height );
+
+    /* Because we are dividing by 8, we want to round up if we have a remainder */
+    uint16_t round_amount = (cache.real_width  % 8) ? 1 : 0;
+    uint32_t line = (((cache.real_width >> 3) + round_amount) << 1) & 0x1FF;
+
+    __rdp_tmem_hazard( 0 );
+
+    /* Point the RDP at the whole image */
+    __rdp_ringbuffer_queue( 0x3D000000 | size | (image_width - 1) );
+    __rdp_ringbuffer_queue( (uint32_t)image );
+
+    __rdp_ringbuffer_queue( 0x35000000 | size | line << 9 );
+    __rdp_ringbuffer_queue( 0x40100 | hbits << 14 | wbits << 4 );
+
+    /* Copy out only the region */
+    __rdp_ringbuffer_queue( 0x34000000 | (((sx << 2) & 0xFFF) << 12) | ((sy << 2) & 0xFFF) );
+    __rdp_ringbuffer_queue( ((((sx + width - 1) << 2) & 0xFFF) << 12) | (((sy + height - 1) << 2) & 0xFFF) );
+
+    /* Texture coordinates start at the region origin */
+    if( sx || sy )
+    {
+        __rdp_ringbuffer_queue( 0x32000000 );
+        __rdp_ringbuffer_queue( ((cache.width << 2) & 0xFFF) << 12 | ((cache.height << 2) & 0xFFF) );
+    }
+
+    __rdp_ringbuffer_send();
+
+    /* 32bit textures keep half of each texel in upper TMEM */
+    int tmem_bytes = (line << 3) * height;
+    __rdp_tlut_clobber( (bitdepth == 4) ? tmem_bytes : tmem_bytes - TMEM_TLUT_OFFSET );
+}
+
+/**
+ * @brief Load a rectangular part of a sprite into TMEM
+ *
+ * Only the requested part of the sprite is transferred, using LOAD_TILE bounds, so many
+ * frames or tiles can live in a single atlas sprite.  After loading, the region is drawn
+ * like a whole sprite with #rdp_draw_sprite and friends, starting at its top left.
+ *
+ * For 8bit sprites the X coordinate and width must be multiples of 2, and for 4bit
+ * sprites multiples of 4, since those formats are transferred as 16bit data.  Other
+ * values are rounded to the enclosing boundary.  The region must fit in TMEM.
+ *
+ * @param[in] sprite
+ *            Sprite to load from
+ * @param[in] sx
+ *            X coordinate of the region in pixels
+ * @param[in] sy
+ *            Y coordinate of the region in pixels
+ * @param[in] width
+ *            Width of the region in pixels
+ * @param[in] height
+ *            Height of the region in pixels
+ */
+void rdp_load_texture_rect( sprite_t *sprite, int sx, int sy, int width, int height )
+{
+    if ( !sprite || sx < 0 || sy < 0 || width <= 0 || height <= 0 ) { return; }
+    if ( sx + width > sprite->width || sy + height > sprite->height ) { return; }
+
+    if ( sprite->bitdepth > 1 ) // 16/32bit textures
+    {
+        __rdp_load_tile_region( sprite->data, sprite->width, sprite->bitdepth, sx, sy, width, height );
+        return;
+    }
+
+    // 4/8bit textures are moved as 16bit data, so align the region to whole 16bit words
+    uint32_t bit_div = (sprite->bitdepth == 0) ? 1 : 0;
+    uint32_t shift = 1 + bit_div;
+    uint32_t align = (1 << shift) - 1;
+
+    width = ((sx + width + align) & ~align) - (sx & ~align);
+    sx &= ~align;
+
+    cache.width = width - 1;
+    mip_levels = 1;
+    cache.height = height - 1;
+    cache.cp_x = 0;
+    cache.cp_y = 0;
+    cache.cp_start = 0;
+
+    // Figure out the power of two this region fits into
+    cache.real_width  = __rdp_round_to_power( width );
+    cache.real_height = __rdp_round_to_power( height );
+    uint32_t wbits = __rdp_log2( cache.real_width  );
+    uint32_t hbits = __rdp_log2( cache.real_height );
+
+    // Because we are dividing by 8, we want to round up if we have a remainder
+    uint16_t round_amount = (cache.real_width  % 8) ? 1 : 0;
+    uint32_t math_line = (((cache.real_width  >> 3) + round_amount) & 0x1FF) >> bit_div;
+
+    // Region bounds in 16bit units
+    uint32_t sl = sx >> shift;
+    uint32_t sh = ((sx + width) >> shift) - 1;
+    uint32_t th = sy + height - 1;
+
+    __rdp_tmem_hazard( 0 );
+
+    // set texture image, RGBA, 16bit, whole sprite
+    __rdp_ringbuffer_queue( 0x3D100000 | ((sprite->width >> shift) - 1) );
+    __rdp_ringbuffer_queue( (uint32_t)sprite->data );
+
+    // set tile (1/2), palette = 16bit
+    __rdp_ringbuffer_queue( 0x35100000 | math_line << 9 );
+    __rdp_ringbuffer_queue( 0x00000000 );
+
+    // load tile, only the region
+    __rdp_ringbuffer_queue( 0x34000000 | ((sl << 2) & 0xFFF) << 12 | ((sy << 2) & 0xFFF) );
+    __rdp_ringbuffer_queue( ((sh << 2) & 0xFFF) << 12 | ((th << 2) & 0xFFF) );
+
+    // set tile (2/2), texture: set color index and texture bitdepth
+    __rdp_ringbuffer_queue( 0x35400000 | sprite->bitdepth << 19 | math_line << 9 );
+    __rdp_ringbuffer_queue( 0x40100 | use_palette << 20 | hbits << 14 | wbits << 4 );
+
+    // texture coordinates start at the region origin
+    if ( sl || sy )
+    {
+        __rdp_ringbuffer_queue( 0x32000000 );
+        __rdp_ringbuffer_queue( ((cache.width << 2) & 0xFFF) << 12 | ((cache.height << 2) & 0xFFF) );
+    }
+
+    __rdp_ringbuffer_send();
+
+    __rdp_tlut_clobber( ((math_line << 3) * height) - TMEM_TLUT_OFFSET );
+}
+
+/**
+ * @brief Load one frame of a spritemap into TMEM
+ *
+ * The RDP counterpart of #graphics_draw_sprite_stride: the sprite is treated as a grid of
+ * hslices by vslices frames, and only the frame at the given offset is loaded.  Frames
+ * are numbered left to right, then top to bottom.  A negative offset loads the whole
+ * sprite.
+ *
+ * @note Spritemaps use the hslices and vslices fields as the grid size, so the embedded
+ * center point used by #rdp_cp_sprite is not available for them.
+ *
+ * @param[in] sprite
+ *            Spritemap to load from
+ * @param[in] offset
+ *            Frame to load
+ */
+void rdp_load_texture_stride( sprite_t *sprite, int offset )
+{
+    if ( !sprite ) { return; }
+
+    int hslices = sprite->hslices ? sprite->hslices : 1;
+    int vslices = sprite->vslices ? sprite->vslices : 1;
+
+    if ( offset < 0 || offset >= hslices * vslices )
+    {
+        rdp_load_texture_rect( sprite, 0, 0, sprite->width, sprite->height );
+        return;
+    }
+
+    int twidth = sprite->width / hslices;
+    int theight = sprite->height / vslices;
+
+    rdp_load_texture_rect( sprite, (offset % hslices) * twidth, (offset / hslices) * theight, twidth, theight );
+}
+
+/**
+ * @brief Convert a scale factor to 16.16 fixed point
+ *
+ * @param[in] scale
+ *            Scale factor
+ *
+ * @return The scale factor in 16.16 fixed point, rounded to nearest.
+ */
+static inline int32_t __rdp_scale_to_fx( float scale )
+{
+    return (int32_t)(scale * 65536.0f + ((scale < 0.0f) ? -0.5f : 0.5f));
+}
+
+/**
+ * @brief Return the 16.16 reciprocal of a 16.16 scale factor
+ *
+ * Sprites are usually drawn at a handful of scales, so the last result for each axis
+ * is remembered to skip the division.
+ *
+ * @param[in] axis
+ *            0 for horizontal, 1 for vertical
+ * @param[in] scale
+ *            Scale factor in 16.16 fixed point, greater than zero
+ *
+ * @return The reciprocal in 16.16 fixed point.
+ */
+static inline uint32_t __rdp_scale_recip( int axis, int32_t scale )
+{
+    static int32_t last_scale[2] = { 0x10000, 0x10000 };
+    static uint32_t last_recip[2] = { 0x10000, 0x10000 };
+
+    if( scale != last_scale[axis] )
+    {
+        last_scale[axis] = scale;
+        last_recip[axis] = (uint32_t)((1ULL << 32) / (uint32_t)scale);
+    }
+
+    return last_recip[axis];
+}
+
+/**
+ * @brief Draw a textured rectangle with a scaled texture using fixed point scale factors
+ *
+ * Identical to #rdp_draw_textured_rectangle_scaled, but the scale factors are given in
+ * 16.16 fixed point (0x10000 is 1.0) so that no floating point math is needed.
+ *
+ * A negative scale factor steps through the texture backwards from the starting texel,
+ * as the floating point version always has.  A scale factor of zero draws nothing.
+ *
+ * @param[in] tx
+ *            The pixel X location of the top left of the rectangle
  * @param[in] ty
  *            The pixel Y location of the top left of the rectangle
  * @param[in] bx
@@ -680,27 +1891,56 @@ void rdp_load_texture( sprite_t *sprite )
  * @param[in] by
  *            The pixel Y location of the bottom right of the rectangle
  * @param[in] x_scale
- *            Horizontal scaling factor
+ *            Horizontal scaling factor in 16.16 fixed point
  * @param[in] y_scale
- *            Vertical scaling factor
+ *            Vertical scaling factor in 16.16 fixed point
+ * @param[in] flags
+ *            Mirror flags, bit 0 horizontal and bit 1 vertical
  */
-void rdp_draw_textured_rectangle_scaled( int tx, int ty, int bx, int by, double x_scale, double y_scale, int flags )
+void rdp_draw_textured_rectangle_scaled_fx( int tx, int ty, int bx, int by, int32_t x_scale, int32_t y_scale, int flags )
 {
     uint16_t s = 0;
     uint16_t t = 0;
 
+    if( x_scale == 0 || y_scale == 0 ) { return; }
+
+    /* Negative scales walk the texture backwards, the size works out the same */
+    int x_back = ( x_scale < 0 );
+    int y_back = ( y_scale < 0 );
+
+    if( x_back ) { x_scale = -x_scale; }
+    if( y_back ) { y_scale = -y_scale; }
+
+    uint32_t x_recip = __rdp_scale_recip( 0, x_scale );
+    uint32_t y_recip = __rdp_scale_recip( 1, y_scale );
+    uint32_t level = 0;
+
+    /* Minified mipmapped texture, use the closest level unless the RDP picks it itself */
+    if( mip_levels > 1 && !(other_modes[0] & 0x10000) )
+    {
+        int32_t scale = (x_scale > y_scale) ? x_scale : y_scale;
+
+        while( level + 1 < mip_levels && scale <= 0x8000 )
+        {
+            scale <<= 1;
+            level++;
+        }
+    }
+
     /* Cant display < 0, so must clip size and move S,T coord accordingly */
     if ( tx < 0 )
     {
-        if ( tx < -cache.width * x_scale) { return; } // prevent N64 crash
-        s += (int)(((double)((-tx) << 5)) * (1.0 / x_scale));
+        if ( ((int64_t)(-tx) << 16) > (int64_t)cache.width * x_scale ) { return; } // prevent N64 crash
+        uint16_t skip = (int)(((uint64_t)((-tx) << 5) * x_recip) >> 16);
+        s += x_back ? -skip : skip;
         tx = 0;
     }
 
     if ( ty < 0 )
     {
-        if ( ty < -cache.height * y_scale ) { return; }
-        t += (int)(((double)((-ty) << 5)) * (1.0 / y_scale));
+        if ( ((int64_t)(-ty) << 16) > (int64_t)cache.height * y_scale ) { return; }
+        uint16_t skip = (int)(((uint64_t)((-ty) << 5) * y_recip) >> 16);
+        t += y_back ? -skip : skip;
         ty = 0;
     }
 
@@ -723,14 +1963,52 @@ void rdp_draw_textured_rectangle_scaled( int tx, int ty, int bx, int by, double
 
     /* Set up rectangle position in screen space */
     __rdp_ringbuffer_queue( 0x24000000 | bx << 14 | by << 2 );
-    __rdp_ringbuffer_queue( tx << 14 | ty << 2 );
+    __rdp_ringbuffer_queue( level << 24 | tx << 14 | ty << 2 );
+
+    /* Set up texture position and scaling */
+    uint32_t dsdx = (uint32_t)(((uint64_t)pixel_mode * x_recip) >> 16);
+    uint32_t dtdy = (uint32_t)(((uint64_t)1024 * y_recip) >> 16);
+
+    if( x_back ) { dsdx = -dsdx; }
+    if( y_back ) { dtdy = -dtdy; }
 
-    /* Set up texture position and scaling to 1:1 copy */
     __rdp_ringbuffer_queue( s << 16 | t );
-    __rdp_ringbuffer_queue( ((int)(pixel_mode / x_scale) & 0xFFFF) << 16 | ((int)(1024 / y_scale) & 0xFFFF) );	
+    __rdp_ringbuffer_queue( (dsdx & 0xFFFF) << 16 | (dtdy & 0xFFFF) );
 		
     /* Send command */
     __rdp_ringbuffer_send();
+    __rdp_drawn( (other_modes[0] & 0x10000) ? (1 << mip_levels) - 1 : 1 << level );
+}
+
+/**
+ * @brief Draw a textured rectangle with a scaled texture
+ *
+ * Given an already loaded texture, this function will draw a rectangle textured with the loaded texture
+ * at a scale other than 1.  This allows rectangles to be drawn with stretched or squashed textures.
+ * If the rectangle is larger than the texture after scaling, it will be tiled or mirrored based on the
+ * mirror setting given in the load texture command.
+ *
+ * Before using this command to draw a textured rectangle, use #rdp_enable_texture_copy to set the RDP
+ * up in texture mode.
+ *
+ * @note Prefer #rdp_draw_textured_rectangle_scaled_fx in tight loops, it avoids floating point math.
+ *
+ * @param[in] tx
+ *            The pixel X location of the top left of the rectangle
+ * @param[in] ty
+ *            The pixel Y location of the top left of the rectangle
+ * @param[in] bx
+ *            The pixel X location of the bottom right of the rectangle
+ * @param[in] by
+ *            The pixel Y location of the bottom right of the rectangle
+ * @param[in] x_scale
+ *            Horizontal scaling factor
+ * @param[in] y_scale
+ *            Vertical scaling factor
+ */
+void rdp_draw_textured_rectangle_scaled( int tx, int ty, int bx, int by, double x_scale, double y_scale, int flags )
+{
+    rdp_draw_textured_rectangle_scaled_fx( tx, ty, bx, by, __rdp_scale_to_fx( x_scale ), __rdp_scale_to_fx( y_scale ), flags );
 }
 
 /**
@@ -755,7 +2033,107 @@ void rdp_draw_textured_rectangle_scaled( int tx, int ty, int bx, int by, double
 void rdp_draw_textured_rectangle( int tx, int ty, int bx, int by, int flags )
 {
     /* Simple wrapper */
-    rdp_draw_textured_rectangle_scaled( tx, ty, bx, by, 1.0, 1.0, flags );
+    rdp_draw_textured_rectangle_scaled_fx( tx, ty, bx, by, 0x10000, 0x10000, flags );
+}
+
+/**
+ * @brief Load the atlas of a font into TMEM
+ *
+ * The atlas is a 4-bit color index texture in which mkfont stores set pixels as index 1
+ * and clear pixels as index 0.  Before loading the font, load a palette with
+ * #rdp_load_palette whose entry 0 has the alpha bit clear and whose entry 1 is the text
+ * color, and select it with #rdp_select_palette.  The palette is only looked up when
+ * TLUT is enabled in the render mode, which is bit 47 (0x800000000000) of the mode
+ * passed to #rdp_texture_copy or #rdp_texture_cycle.  The whole atlas has to fit in the
+ * 2KB of TMEM left next to the palettes, which mkfont warns about.
+ *
+ * @param[in] font
+ *            Font to draw with #rdp_draw_text
+ */
+void rdp_load_font( font_t *font )
+{
+    if( !font ) { return; }
+
+    rdp_load_texture( graphics_get_font_atlas( font ) );
+}
+
+/**
+ * @brief Draw text with a font loaded by #rdp_load_font
+ *
+ * Every glyph is drawn as a textured rectangle out of the atlas, and all of them are
+ * sent to the RDP at once.  Use #rdp_texture_copy or #rdp_texture_cycle with alpha and
+ * TLUT enabled beforehand, with the palette described in #rdp_load_font, so transparent
+ * atlas pixels are not drawn.
+ *
+ * @param[in] font
+ *            Font currently loaded into TMEM
+ * @param[in] x
+ *            Pixel X location of the start of the text
+ * @param[in] y
+ *            Pixel Y location of the top of the first line
+ * @param[in] msg
+ *            Text to draw
+ */
+void rdp_draw_text( font_t *font, int x, int y, const char * const msg )
+{
+    if( !font || !msg ) { return; }
+
+    int tx = x;
+    int ty = y;
+    const font_glyph_t *space = graphics_get_glyph( font, ' ' );
+
+    for( const char *text = msg; *text; text++ )
+    {
+        if( *text == '\n' || *text == '\r' )
+        {
+            tx = x;
+            ty += font->line_height;
+            continue;
+        }
+
+        if( *text == '\t' )
+        {
+            tx += space ? space->advance * 5 : 0;
+            continue;
+        }
+
+        const font_glyph_t *glyph = graphics_get_glyph( font, *text );
+        if( !glyph ) { continue; }
+
+        int gx = tx + glyph->x_offset;
+        int gy = ty + glyph->y_offset;
+        int gbx = gx + glyph->width - 1;
+        int gby = gy + glyph->height - 1;
+        uint16_t s = glyph->x << 5;
+        uint16_t t = glyph->y << 5;
+
+        tx += glyph->advance;
+        if( text[1] && font->num_kerning ) { tx += graphics_get_kerning( font, text[0], text[1] ); }
+
+        if( !glyph->width || gbx < 0 || gby < 0 ) { continue; }
+
+        /* Cant display < 0, so clip and move S,T coord accordingly */
+        if( gx < 0 ) { s += (-gx) << 5; gx = 0; }
+        if( gy < 0 ) { t += (-gy) << 5; gy = 0; }
+
+        // fixes 1/4 pixel cycle draw
+        if( pixel_mode == 1024 )
+        {
+            gbx++;
+            gby++;
+        }
+
+        /* Kick what we have before the next glyph could run past the slack */
+        if( rdp_end > RINGBUFFER_SIZE - RINGBUFFER_SLACK ) { __rdp_ringbuffer_send(); }
+
+        __rdp_ringbuffer_queue( 0x24000000 | gbx << 14 | gby << 2 );
+        __rdp_ringbuffer_queue( gx << 14 | gy << 2 );
+        __rdp_ringbuffer_queue( s << 16 | t );
+        __rdp_ringbuffer_queue( pixel_mode << 16 | 1024 );
+        __rdp_drawn( 1 );
+    }
+
+    __rdp_ringbuffer_send();
 }
 
 /**
@@ -774,7 +2152,7 @@ void rdp_draw_textured_rectangle( int tx, int ty, int bx, int by, int flags )
 void rdp_draw_sprite( int x, int y, int flags )
 {
     /* Just draw a rectangle the size of the sprite */
-    rdp_draw_textured_rectangle_scaled( x, y, x + cache.width, y + cache.height, 1.0, 1.0, flags );
+    rdp_draw_textured_rectangle_scaled_fx( x, y, x + cache.width, y + cache.height, 0x10000, 0x10000, flags );
 }
 
 
@@ -796,13 +2174,35 @@ void rdp_draw_sprite( int x, int y, int flags )
  *            Vertical scaling factor
  */
 void rdp_draw_sprite_scaled( int x, int y, float x_scale, float y_scale, int flags )
+{
+    rdp_draw_sprite_scaled_fx( x, y, __rdp_scale_to_fx( x_scale ), __rdp_scale_to_fx( y_scale ), flags );
+}
+
+/**
+ * @brief Draw a texture to the screen as a scaled sprite using fixed point scale factors
+ *
+ * Identical to #rdp_draw_sprite_scaled, but the scale factors are given in 16.16 fixed
+ * point (0x10000 is 1.0) so that no floating point math is needed.
+ *
+ * @param[in] x
+ *            The pixel X location of the top left of the sprite
+ * @param[in] y
+ *            The pixel Y location of the top left of the sprite
+ * @param[in] x_scale
+ *            Horizontal scaling factor in 16.16 fixed point
+ * @param[in] y_scale
+ *            Vertical scaling factor in 16.16 fixed point
+ * @param[in] flags
+ *            Mirror flags, bit 0 horizontal and bit 1 vertical
+ */
+void rdp_draw_sprite_scaled_fx( int x, int y, int32_t x_scale, int32_t y_scale, int flags )
 {
     /* Since we want to still view the whole sprite, we must resize the rectangle area too */
-    int new_width = ( cache.width * x_scale ) + 0.5;
-    int new_height = ( cache.height * y_scale ) + 0.5;
+    int new_width = ((int64_t)cache.width * x_scale + 0x8000) >> 16;
+    int new_height = ((int64_t)cache.height * y_scale + 0x8000) >> 16;
 
     /* Draw a rectangle the size of the new sprite */
-    rdp_draw_textured_rectangle_scaled( x, y, x + new_width, y + new_height, x_scale, y_scale, flags );
+    rdp_draw_textured_rectangle_scaled_fx( x, y, x + new_width, y + new_height, x_scale, y_scale, flags );
 }
 
 /**
@@ -834,6 +2234,7 @@ void rdp_draw_filled_rectangle( int tx, int ty, int bx, int by )
     __rdp_ringbuffer_queue( 0xF6000000 | ( bx << 14 ) | ( by << 2 ) ); 
     __rdp_ringbuffer_queue( ( tx << 14 ) | ( ty << 2 ) );
     __rdp_ringbuffer_send();
+    __rdp_drawn( 0 );
 }
 
 // Triangle setup
@@ -869,67 +2270,636 @@ void rdp_triangle_setup( int type )
 }
 
 /**
- * @brief Draw a filled triangle
+ * @brief Return the maximum mipmap level bits for a triangle command
+ *
+ * Only textured triangles use mipmaps, and only when level of detail is enabled.
+ */
+static inline uint32_t __rdp_tri_levels( void )
+{
+    if( !(tri_set & 0x02000000) || !(other_modes[0] & 0x10000) ) { return 0; }
+
+    return (uint32_t)(mip_levels - 1) << 19;
+}
+
+/**
+ * @brief Queue zeroed coefficient blocks for the current triangle type
+ *
+ * Filled triangles carry no per-vertex attributes, but shaded, textured and Z-buffered
+ * triangle commands are longer.  The RDP expects those blocks to follow the edge
+ * coefficients, so send them zeroed instead of leaving the command short.
+ */
+static void __rdp_queue_empty_coeffs( void )
+{
+    int words = 0;
+
+    if( tri_set & 0x04000000 ) { words += 16; } // shade
+    if( tri_set & 0x02000000 ) { words += 16; } // texture
+    if( tri_set & 0x01000000 ) { words += 4; }  // Z-buffer
+
+    for( int i = 0; i < words; i++ )
+    {
+        __rdp_ringbuffer_queue( 0 );
+    }
+}
+
+/**
+ * @brief Draw a filled triangle
+ *
+ * Given a color set with #rdp_set_blend_color, this will draw a filled triangle
+ * to the screen. Vertex order is not important.
+ *
+ * Before calling this function, make sure that the RDP is set to blend mode by
+ * calling #rdp_enable_blend_fill.
+ *
+ * @param[in] x1
+ *            Pixel X1 location of triangle
+ * @param[in] y1
+ *            Pixel Y1 location of triangle
+ * @param[in] x2
+ *            Pixel X2 location of triangle
+ * @param[in] y2
+ *            Pixel Y2 location of triangle
+ * @param[in] x3
+ *            Pixel X3 location of triangle
+ * @param[in] y3
+ *            Pixel Y3 location of triangle
+ */
+void rdp_draw_filled_triangle( float x1, float y1, float x2, float y2, float x3, float y3 )
+{
+    float temp_x, temp_y;
+    const float to_fixed_11_2 = 4.0f;
+    const float to_fixed_16_16 = 65536.0f;
+    
+    /* sort vertices by Y ascending to find the major, mid and low edges */
+    if( y1 > y2 ) { temp_x = x2, temp_y = y2; y2 = y1; y1 = temp_y; x2 = x1; x1 = temp_x; }
+    if( y2 > y3 ) { temp_x = x3, temp_y = y3; y3 = y2; y2 = temp_y; x3 = x2; x2 = temp_x; }
+    if( y1 > y2 ) { temp_x = x2, temp_y = y2; y2 = y1; y1 = temp_y; x2 = x1; x1 = temp_x; }
+
+    /* calculate Y edge coefficients in 11.2 fixed format */
+    int yh = y1 * to_fixed_11_2;
+    int ym = (int)( y2 * to_fixed_11_2 ) << 16; // high word
+    int yl = y3 * to_fixed_11_2;
+    
+    /* calculate X edge coefficients in 16.16 fixed format */
+    int xh = x1 * to_fixed_16_16;
+    int xm = x1 * to_fixed_16_16;
+    int xl = x2 * to_fixed_16_16;
+    
+    /* calculate inverse slopes in 16.16 fixed format */
+    int dxhdy = ( y3 == y1 ) ? 0 : ( ( x3 - x1 ) / ( y3 - y1 ) ) * to_fixed_16_16;
+    int dxmdy = ( y2 == y1 ) ? 0 : ( ( x2 - x1 ) / ( y2 - y1 ) ) * to_fixed_16_16;
+    int dxldy = ( y3 == y2 ) ? 0 : ( ( x3 - x2 ) / ( y3 - y2 ) ) * to_fixed_16_16;
+    
+    /* determine the winding of the triangle */
+    int winding = ( x1 * y2 - x2 * y1 ) + ( x2 * y3 - x3 * y2 ) + ( x3 * y1 - x1 * y3 );
+    int flip = ( winding > 0 ? 1 : 0 ) << 23;
+    
+    // command & edge coefficients
+    __rdp_drawn( (tri_set & 0x02000000) ? (1 << mip_levels) - 1 : 0 );
+    __rdp_ringbuffer_queue( tri_set | flip | __rdp_tri_levels() | yl );
+    __rdp_ringbuffer_queue( ym | yh );
+    __rdp_ringbuffer_queue( xl );
+    __rdp_ringbuffer_queue( dxldy );
+    __rdp_ringbuffer_queue( xh );
+    __rdp_ringbuffer_queue( dxhdy );
+    __rdp_ringbuffer_queue( xm );
+    __rdp_ringbuffer_queue( dxmdy );	
+	
+    /* keep the command well formed for shaded, textured or Z-buffered types */
+    __rdp_queue_empty_coeffs();
+
+    __rdp_ringbuffer_send();
+}
+
+/**
+ * @brief Compute an inverse edge slope in 16.16 fixed point without a division
+ *
+ * @param[in] dx
+ *            Horizontal distance covered by the edge in 16.16 fixed point
+ * @param[in] dy
+ *            Vertical distance covered by the edge in 11.2 fixed point
+ *
+ * @return The inverse slope dx/dy in 16.16 fixed point, or 0 for flat edges.
+ */
+static inline int32_t __rdp_edge_slope( int32_t dx, int32_t dy )
+{
+    if( dy <= 0 ) { return 0; }
+
+    if( dy < RECIP_TABLE_SIZE )
+    {
+        /* dx * 4 / dy, with the reciprocal scaled by 2^31 */
+        return ((int64_t)dx * recip_table[dy]) >> 29;
+    }
+
+    return ((int64_t)dx << 2) / dy;
+}
+
+/**
+ * @brief Queue the edge coefficients of a triangle given in 16.16 fixed point
+ *
+ * This does not kick the RDP, so several triangles can be queued and sent at once.
+ */
+static void __rdp_queue_triangle_fx( int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3 )
+{
+    int32_t temp_x, temp_y;
+
+    /* sort vertices by Y ascending to find the major, mid and low edges */
+    if( y1 > y2 ) { temp_x = x2, temp_y = y2; y2 = y1; y1 = temp_y; x2 = x1; x1 = temp_x; }
+    if( y2 > y3 ) { temp_x = x3, temp_y = y3; y3 = y2; y2 = temp_y; x3 = x2; x2 = temp_x; }
+    if( y1 > y2 ) { temp_x = x2, temp_y = y2; y2 = y1; y1 = temp_y; x2 = x1; x1 = temp_x; }
+
+    /* Y edge coefficients in 11.2 fixed format */
+    int32_t yh = y1 >> 14;
+    int32_t ym = y2 >> 14;
+    int32_t yl = y3 >> 14;
+
+    /* inverse slopes in 16.16 fixed format */
+    int32_t dxhdy = __rdp_edge_slope( x3 - x1, yl - yh );
+    int32_t dxmdy = __rdp_edge_slope( x2 - x1, ym - yh );
+    int32_t dxldy = __rdp_edge_slope( x3 - x2, yl - ym );
+
+    /* determine the winding of the triangle */
+    int64_t winding = (int64_t)(x2 - x1) * (y3 - y1) - (int64_t)(x3 - x1) * (y2 - y1);
+    int flip = ( winding > 0 ? 1 : 0 ) << 23;
+
+    // command & edge coefficients
+    __rdp_drawn( (tri_set & 0x02000000) ? (1 << mip_levels) - 1 : 0 );
+    __rdp_ringbuffer_queue( tri_set | flip | __rdp_tri_levels() | (yl & 0x3FFF) );
+    __rdp_ringbuffer_queue( (ym & 0x3FFF) << 16 | (yh & 0x3FFF) );
+    __rdp_ringbuffer_queue( x2 );
+    __rdp_ringbuffer_queue( dxldy );
+    __rdp_ringbuffer_queue( x1 );
+    __rdp_ringbuffer_queue( dxhdy );
+    __rdp_ringbuffer_queue( x1 );
+    __rdp_ringbuffer_queue( dxmdy );
+
+    /* keep the command well formed for shaded, textured or Z-buffered types */
+    __rdp_queue_empty_coeffs();
+}
+
+/**
+ * @brief Draw a filled triangle given in 16.16 fixed point
+ *
+ * This is the integer counterpart of #rdp_draw_filled_triangle.  Edge slopes are
+ * computed with a reciprocal lookup instead of floating point divisions.
+ *
+ * Before calling this function, make sure that the RDP is set to blend mode by
+ * calling #rdp_enable_blend_fill.
+ *
+ * @param[in] x1
+ *            Pixel X1 location of triangle in 16.16 fixed point
+ * @param[in] y1
+ *            Pixel Y1 location of triangle in 16.16 fixed point
+ * @param[in] x2
+ *            Pixel X2 location of triangle in 16.16 fixed point
+ * @param[in] y2
+ *            Pixel Y2 location of triangle in 16.16 fixed point
+ * @param[in] x3
+ *            Pixel X3 location of triangle in 16.16 fixed point
+ * @param[in] y3
+ *            Pixel Y3 location of triangle in 16.16 fixed point
+ */
+void rdp_draw_filled_triangle_fx( int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3 )
+{
+    __rdp_queue_triangle_fx( x1, y1, x2, y2, x3, y3 );
+    __rdp_ringbuffer_send();
+}
+
+/**
+ * @brief Draw an array of filled triangles given in 16.16 fixed point
+ *
+ * Triangles are queued back to back and sent to the RDP in as few transfers as the
+ * ring buffer allows.
+ *
+ * @param[in] coords
+ *            Six 16.16 fixed point values per triangle: x1, y1, x2, y2, x3, y3
+ * @param[in] count
+ *            Number of triangles in the array
+ */
+void rdp_draw_filled_triangles_fx( const int32_t *coords, int count )
+{
+    if( !coords ) { return; }
+
+    for( int i = 0; i < count; i++, coords += 6 )
+    {
+        /* Kick what we have before the next triangle could run past the slack */
+        if( rdp_end > RINGBUFFER_SIZE - RINGBUFFER_SLACK ) { __rdp_ringbuffer_send(); }
+
+        __rdp_queue_triangle_fx( coords[0], coords[1], coords[2], coords[3], coords[4], coords[5] );
+    }
+
+    __rdp_ringbuffer_send();
+}
+
+/**
+ * @brief Integer square root
+ *
+ * @param[in] value
+ *            Value to take the root of
+ *
+ * @return The square root of value rounded down.
+ */
+static uint32_t __rdp_isqrt( uint64_t value )
+{
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while( bit > value ) { bit >>= 2; }
+
+    while( bit )
+    {
+        if( value >= root + bit )
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+
+        bit >>= 2;
+    }
+
+    return (uint32_t)root;
+}
+
+/**
+ * @brief Queue one line segment without kicking the RDP
+ *
+ * Horizontal and vertical segments become rectangles, others a quad of two flat
+ * triangles.  The segment covers both end pixels.
+ */
+static void __rdp_queue_line( int x0, int y0, int x1, int y1, int width )
+{
+    int half = (width - 1) >> 1;
+
+    if( y0 == y1 || x0 == x1 )
+    {
+        int tx = (x0 < x1) ? x0 : x1;
+        int ty = (y0 < y1) ? y0 : y1;
+        int bx = (x0 < x1) ? x1 : x0;
+        int by = (y0 < y1) ? y1 : y0;
+
+        /* Thickness goes across the line */
+        if( y0 == y1 ) { ty -= half; by += width - 1 - half; }
+        else { tx -= half; bx += width - 1 - half; }
+
+        if( bx < 0 || by < 0 ) { return; }
+        if( tx < 0 ) { tx = 0; }
+        if( ty < 0 ) { ty = 0; }
+
+        /* Rectangles are inclusive only in fill mode */
+        if( (other_modes[0] & 0x00300000) != 0x00300000 ) { bx++; by++; }
+
+        __rdp_ringbuffer_queue( 0xF6000000 | ( bx << 14 ) | ( by << 2 ) );
+        __rdp_ringbuffer_queue( ( tx << 14 ) | ( ty << 2 ) );
+        __rdp_drawn( 0 );
+        return;
+    }
+
+    int32_t dx = x1 - x0;
+    int32_t dy = y1 - y0;
+
+    /* Length in 16.16 */
+    uint32_t length = __rdp_isqrt( ((uint64_t)((int64_t)dx * dx + (int64_t)dy * dy)) << 32 );
+
+    /* Half width along the normal and along the line, in 16.16 */
+    int32_t nx = ((int64_t)(-dy) << 16) * ((int64_t)width << 15) / length;
+    int32_t ny = ((int64_t)dx << 16) * ((int64_t)width << 15) / length;
+    int32_t ex = ((int64_t)dx << 16) * ((int64_t)width << 15) / length;
+    int32_t ey = ((int64_t)dy << 16) * ((int64_t)width << 15) / length;
+
+    /* Run through pixel centers and cover the end pixels */
+    int32_t ax = (x0 << 16) + 0x8000 - ex;
+    int32_t ay = (y0 << 16) + 0x8000 - ey;
+    int32_t bx = (x1 << 16) + 0x8000 + ex;
+    int32_t by = (y1 << 16) + 0x8000 + ey;
+
+    __rdp_queue_triangle_fx( ax + nx, ay + ny, ax - nx, ay - ny, bx + nx, by + ny );
+    __rdp_queue_triangle_fx( ax - nx, ay - ny, bx - nx, by - ny, bx + nx, by + ny );
+}
+
+/**
+ * @brief Draw a line
+ *
+ * The line is drawn with the fill color in fill mode (#rdp_enable_primitive_fill) or the
+ * blend color in blend mode (#rdp_enable_blend_fill).  Horizontal and vertical lines
+ * are drawn as rectangles, other lines as a pair of triangles.
+ *
+ * @param[in] x0
+ *            Pixel X location of the start of the line
+ * @param[in] y0
+ *            Pixel Y location of the start of the line
+ * @param[in] x1
+ *            Pixel X location of the end of the line
+ * @param[in] y1
+ *            Pixel Y location of the end of the line
+ * @param[in] width
+ *            Line thickness in pixels
+ */
+void rdp_draw_line( int x0, int y0, int x1, int y1, int width )
+{
+    int points[4] = { x0, y0, x1, y1 };
+
+    rdp_draw_polyline( points, 2, width );
+}
+
+/**
+ * @brief Draw connected line segments
+ *
+ * Identical to calling #rdp_draw_line for each segment, but all segments are sent to the
+ * RDP at once.
+ *
+ * @param[in] points
+ *            Pixel X and Y locations of each point, interleaved
+ * @param[in] count
+ *            Number of points
+ * @param[in] width
+ *            Line thickness in pixels
+ */
+void rdp_draw_polyline( const int *points, int count, int width )
+{
+    if( !points || count < 2 ) { return; }
+    if( width < 1 ) { width = 1; }
+
+    /* Lines are untextured, unshaded triangles whatever the current triangle type */
+    int saved_tri = tri_set;
+    tri_set = 0x08000000;
+
+    for( int i = 0; i < count - 1; i++, points += 2 )
+    {
+        /* Kick what we have before the next segment could run past the slack */
+        if( rdp_end > RINGBUFFER_SIZE - RINGBUFFER_SLACK ) { __rdp_ringbuffer_send(); }
+
+        __rdp_queue_line( points[0], points[1], points[2], points[3], width );
+    }
+
+    __rdp_ringbuffer_send();
+
+    tri_set = saved_tri;
+}
+
+/**
+ * @brief Fill a convex polygon on behalf of the software graphics routines
+ *
+ * Like #__rdp_fill_rectangle, the polygon is drawn as a fan of flat triangles without
+ * disturbing the current render mode, fill color and triangle type.
+ *
+ * @param[in] points
+ *            Pixel X and Y locations of each corner, interleaved
+ * @param[in] count
+ *            Number of corners
+ * @param[in] color
+ *            Color in framebuffer format as returned by #graphics_make_color
+ */
+void __rdp_fill_polygon( const int *points, int count, uint32_t color )
+{
+    solid_state saved;
+    int saved_tri = tri_set;
+
+    __rdp_begin_solid( color, &saved );
+    tri_set = 0x08000000;
+
+    for( int i = 2; i < count; i++ )
+    {
+        /* Kick what we have before the next triangle could run past the slack */
+        if( rdp_end > RINGBUFFER_SIZE - RINGBUFFER_SLACK ) { __rdp_ringbuffer_send(); }
+
+        __rdp_queue_triangle_fx( points[0] << 16, points[1] << 16,
+                                 points[(i - 1) * 2] << 16, points[(i - 1) * 2 + 1] << 16,
+                                 points[i * 2] << 16, points[i * 2 + 1] << 16 );
+    }
+
+    __rdp_ringbuffer_send();
+
+    tri_set = saved_tri;
+    __rdp_end_solid( &saved );
+}
+
+/**
+ * @brief Convert a float to 16.16 fixed point
+ *
+ * Out of range values wrap like the RDP's own adders.  W and Z start up to a scanline
+ * above the top vertex, where they can exceed the 15-bit integer part; stepping
+ * down to the first pixel wraps them back.
+ */
+static inline int32_t __rdp_to_fixed_16_16( float value )
+{
+    return (int32_t)(int64_t)( value * 65536.0f );
+}
+
+/**
+ * @brief Calculate the gradients of a vertex attribute over a triangle
+ *
+ * @param[in]  e
+ *             Edge data of the triangle, vertices sorted by Y
+ * @param[in]  a1
+ *             Attribute value at the top vertex
+ * @param[in]  a2
+ *             Attribute value at the middle vertex
+ * @param[in]  a3
+ *             Attribute value at the bottom vertex
+ * @param[out] base
+ *             Attribute at the start of the major edge in 16.16 fixed point
+ * @param[out] dx
+ *             Change along X in 16.16 fixed point
+ * @param[out] de
+ *             Change along the major edge in 16.16 fixed point
+ * @param[out] dy
+ *             Change along Y in 16.16 fixed point
+ */
+static void __rdp_attr_coeffs( const triangle_edges *e, float a1, float a2, float a3,
+                               int32_t *base, int32_t *dx, int32_t *de, int32_t *dy )
+{
+    float ma = a2 - a1;
+    float ha = a3 - a1;
+
+    float dadx = ( e->hy * ma - e->my * ha ) * e->attr_factor;
+    float dady = ( e->mx * ha - e->hx * ma ) * e->attr_factor;
+    float dade = dady + dadx * e->ish;
+
+    *base = __rdp_to_fixed_16_16( a1 + e->fy * dade );
+    *dx = __rdp_to_fixed_16_16( dadx );
+    *de = __rdp_to_fixed_16_16( dade );
+    *dy = __rdp_to_fixed_16_16( dady );
+}
+
+/**
+ * @brief Queue a block of four attributes in the RDP shade/texture coefficient layout
+ *
+ * Integer parts of all four values come first, then fractional parts, for the base
+ * value and X gradient, followed by the same for the edge and Y gradients.
+ */
+static void __rdp_queue_attr4( const int32_t base[4], const int32_t dx[4], const int32_t de[4], const int32_t dy[4] )
+{
+    const int32_t * const blocks[2][2] = { { base, dx }, { de, dy } };
+
+    for( int b = 0; b < 2; b++ )
+    {
+        /* integer parts */
+        for( int v = 0; v < 2; v++ )
+        {
+            const int32_t *c = blocks[b][v];
+
+            __rdp_ringbuffer_queue( (c[0] & 0xFFFF0000) | ((c[1] >> 16) & 0xFFFF) );
+            __rdp_ringbuffer_queue( (c[2] & 0xFFFF0000) | ((c[3] >> 16) & 0xFFFF) );
+        }
+
+        /* fractional parts */
+        for( int v = 0; v < 2; v++ )
+        {
+            const int32_t *c = blocks[b][v];
+
+            __rdp_ringbuffer_queue( (c[0] << 16) | (c[1] & 0xFFFF) );
+            __rdp_ringbuffer_queue( (c[2] << 16) | (c[3] & 0xFFFF) );
+        }
+    }
+}
+
+/**
+ * @brief Queue a complete triangle command for the current triangle type
+ *
+ * This does not kick the RDP, so several triangles can be queued and sent at once.
+ */
+static void __rdp_queue_triangle( const rdp_vertex_t *v1, const rdp_vertex_t *v2, const rdp_vertex_t *v3 )
+{
+    const rdp_vertex_t *temp;
+    triangle_edges e;
+
+    /* sort vertices by Y ascending to find the major, mid and low edges */
+    if( v1->y > v2->y ) { temp = v1; v1 = v2; v2 = temp; }
+    if( v2->y > v3->y ) { temp = v2; v2 = v3; v3 = temp; }
+    if( v1->y > v2->y ) { temp = v1; v1 = v2; v2 = temp; }
+
+    e.hx = v3->x - v1->x;
+    e.hy = v3->y - v1->y;
+    e.mx = v2->x - v1->x;
+    e.my = v2->y - v1->y;
+
+    float lx = v3->x - v2->x;
+    float ly = v3->y - v2->y;
+    float nz = ( e.hx * e.my ) - ( e.hy * e.mx );
+
+    /* inverse slopes */
+    e.ish = ( e.hy != 0.0f ) ? e.hx / e.hy : 0.0f;
+    float ism = ( e.my != 0.0f ) ? e.mx / e.my : 0.0f;
+    float isl = ( ly != 0.0f ) ? lx / ly : 0.0f;
+
+    /* the RDP starts walking edges at the scanline containing the top vertex */
+    e.fy = (float)(int)v1->y - v1->y;
+    if( e.fy > 0.0f ) { e.fy -= 1.0f; }
+    e.attr_factor = ( nz != 0.0f ) ? -1.0f / nz : 0.0f;
+
+    /* Y edge coefficients in 11.2 fixed format */
+    int yh = (int)( v1->y * 4.0f ) & 0x3FFF;
+    int ym = (int)( v2->y * 4.0f ) & 0x3FFF;
+    int yl = (int)( v3->y * 4.0f ) & 0x3FFF;
+    int flip = ( nz < 0.0f ? 1 : 0 ) << 23;
+
+    // command & edge coefficients
+    __rdp_drawn( (tri_set & 0x02000000) ? (1 << mip_levels) - 1 : 0 );
+    __rdp_ringbuffer_queue( tri_set | flip | __rdp_tri_levels() | yl );
+    __rdp_ringbuffer_queue( ym << 16 | yh );
+    __rdp_ringbuffer_queue( __rdp_to_fixed_16_16( v2->x ) );
+    __rdp_ringbuffer_queue( __rdp_to_fixed_16_16( isl ) );
+    __rdp_ringbuffer_queue( __rdp_to_fixed_16_16( v1->x + e.fy * e.ish ) );
+    __rdp_ringbuffer_queue( __rdp_to_fixed_16_16( e.ish ) );
+    __rdp_ringbuffer_queue( __rdp_to_fixed_16_16( v1->x + e.fy * ism ) );
+    __rdp_ringbuffer_queue( __rdp_to_fixed_16_16( ism ) );
+
+    int32_t base[4], dx[4], de[4], dy[4];
+
+    // shade coefficients (RGBA)
+    if( tri_set & 0x04000000 )
+    {
+        __rdp_attr_coeffs( &e, v1->r, v2->r, v3->r, &base[0], &dx[0], &de[0], &dy[0] );
+        __rdp_attr_coeffs( &e, v1->g, v2->g, v3->g, &base[1], &dx[1], &de[1], &dy[1] );
+        __rdp_attr_coeffs( &e, v1->b, v2->b, v3->b, &base[2], &dx[2], &de[2], &dy[2] );
+        __rdp_attr_coeffs( &e, v1->a, v2->a, v3->a, &base[3], &dx[3], &de[3], &dy[3] );
+        __rdp_queue_attr4( base, dx, de, dy );
+    }
+
+    // texture coefficients (S, T, W)
+    if( tri_set & 0x02000000 )
+    {
+        /* normalize W so the largest 1/w is one, keeping the most precision */
+        float w1 = v1->inv_w, w2 = v2->inv_w, w3 = v3->inv_w;
+        float maxw = w1;
+
+        if( w2 > maxw ) { maxw = w2; }
+        if( w3 > maxw ) { maxw = w3; }
+        if( maxw <= 0.0f ) { maxw = 1.0f; }
+
+        w1 /= maxw;
+        w2 /= maxw;
+        w3 /= maxw;
+
+        /* S and T in 10.5 texel format, premultiplied for perspective correction */
+        __rdp_attr_coeffs( &e, v1->s * 32.0f * w1, v2->s * 32.0f * w2, v3->s * 32.0f * w3, &base[0], &dx[0], &de[0], &dy[0] );
+        __rdp_attr_coeffs( &e, v1->t * 32.0f * w1, v2->t * 32.0f * w2, v3->t * 32.0f * w3, &base[1], &dx[1], &de[1], &dy[1] );
+        __rdp_attr_coeffs( &e, w1 * 32767.0f, w2 * 32767.0f, w3 * 32767.0f, &base[2], &dx[2], &de[2], &dy[2] );
+        base[3] = dx[3] = de[3] = dy[3] = 0;
+        __rdp_queue_attr4( base, dx, de, dy );
+    }
+
+    // Z-buffer coefficients
+    if( tri_set & 0x01000000 )
+    {
+        __rdp_attr_coeffs( &e, v1->z * 32767.0f, v2->z * 32767.0f, v3->z * 32767.0f, &base[0], &dx[0], &de[0], &dy[0] );
+        __rdp_ringbuffer_queue( base[0] );
+        __rdp_ringbuffer_queue( dx[0] );
+        __rdp_ringbuffer_queue( de[0] );
+        __rdp_ringbuffer_queue( dy[0] );
+    }
+}
+
+/**
+ * @brief Draw a shaded, textured and/or Z-buffered triangle
  *
- * Given a color set with #rdp_set_blend_color, this will draw a filled triangle
- * to the screen. Vertex order is not important.
+ * The triangle type selected with #rdp_triangle_setup decides which coefficients are
+ * generated from the vertices: shade colors for Goraud types, S/T/W for textured types
+ * (sampling the texture loaded in tile 0) and depth for Z-buffered types.  Unused
+ * vertex fields are ignored.  Vertex order is not important.
  *
- * Before calling this function, make sure that the RDP is set to blend mode by
- * calling #rdp_enable_blend_fill.
+ * @param[in] v1
+ *            First vertex
+ * @param[in] v2
+ *            Second vertex
+ * @param[in] v3
+ *            Third vertex
+ */
+void rdp_draw_triangle( const rdp_vertex_t *v1, const rdp_vertex_t *v2, const rdp_vertex_t *v3 )
+{
+    if( !v1 || !v2 || !v3 ) { return; }
+
+    __rdp_queue_triangle( v1, v2, v3 );
+    __rdp_ringbuffer_send();
+}
+
+/**
+ * @brief Draw an array of triangles
  *
- * @param[in] x1
- *            Pixel X1 location of triangle
- * @param[in] y1
- *            Pixel Y1 location of triangle
- * @param[in] x2
- *            Pixel X2 location of triangle
- * @param[in] y2
- *            Pixel Y2 location of triangle
- * @param[in] x3
- *            Pixel X3 location of triangle
- * @param[in] y3
- *            Pixel Y3 location of triangle
+ * Same as calling #rdp_draw_triangle for every three consecutive vertices, but the
+ * triangles are sent to the RDP in as few transfers as the ring buffer allows.
+ *
+ * @param[in] vertices
+ *            Three vertices per triangle
+ * @param[in] count
+ *            Number of triangles in the array
  */
-void rdp_draw_filled_triangle( float x1, float y1, float x2, float y2, float x3, float y3 )
+void rdp_draw_triangles( const rdp_vertex_t *vertices, int count )
 {
-    float temp_x, temp_y;
-    const float to_fixed_11_2 = 4.0f;
-    const float to_fixed_16_16 = 65536.0f;
-    
-    /* sort vertices by Y ascending to find the major, mid and low edges */
-    if( y1 > y2 ) { temp_x = x2, temp_y = y2; y2 = y1; y1 = temp_y; x2 = x1; x1 = temp_x; }
-    if( y2 > y3 ) { temp_x = x3, temp_y = y3; y3 = y2; y2 = temp_y; x3 = x2; x2 = temp_x; }
-    if( y1 > y2 ) { temp_x = x2, temp_y = y2; y2 = y1; y1 = temp_y; x2 = x1; x1 = temp_x; }
+    if( !vertices ) { return; }
+
+    for( int i = 0; i < count; i++, vertices += 3 )
+    {
+        /* Kick what we have before the next triangle could run past the slack */
+        if( rdp_end > RINGBUFFER_SIZE - RINGBUFFER_SLACK ) { __rdp_ringbuffer_send(); }
+
+        __rdp_queue_triangle( &vertices[0], &vertices[1], &vertices[2] );
+    }
 
-    /* calculate Y edge coefficients in 11.2 fixed format */
-    int yh = y1 * to_fixed_11_2;
-    int ym = (int)( y2 * to_fixed_11_2 ) << 16; // high word
-    int yl = y3 * to_fixed_11_2;
-    
-    /* calculate X edge coefficients in 16.16 fixed format */
-    int xh = x1 * to_fixed_16_16;
-    int xm = x1 * to_fixed_16_16;
-    int xl = x2 * to_fixed_16_16;
-    
-    /* calculate inverse slopes in 16.16 fixed format */
-    int dxhdy = ( y3 == y1 ) ? 0 : ( ( x3 - x1 ) / ( y3 - y1 ) ) * to_fixed_16_16;
-    int dxmdy = ( y2 == y1 ) ? 0 : ( ( x2 - x1 ) / ( y2 - y1 ) ) * to_fixed_16_16;
-    int dxldy = ( y3 == y2 ) ? 0 : ( ( x3 - x2 ) / ( y3 - y2 ) ) * to_fixed_16_16;
-    
-    /* determine the winding of the triangle */
-    int winding = ( x1 * y2 - x2 * y1 ) + ( x2 * y3 - x3 * y2 ) + ( x3 * y1 - x1 * y3 );
-    int flip = ( winding > 0 ? 1 : 0 ) << 23;
-    
-    // command & edge coefficients
-    __rdp_ringbuffer_queue( tri_set | flip | yl );
-    __rdp_ringbuffer_queue( ym | yh );
-    __rdp_ringbuffer_queue( xl );
-    __rdp_ringbuffer_queue( dxldy );
-    __rdp_ringbuffer_queue( xh );
-    __rdp_ringbuffer_queue( dxhdy );
-    __rdp_ringbuffer_queue( xm );
-    __rdp_ringbuffer_queue( dxmdy );	
-	
     __rdp_ringbuffer_send();
 }
 
@@ -999,7 +2969,7 @@ void rdp_cp_sprite( int x, int y, int flags, int cp_x, int cp_y, int line )
         next_line = cache.height + 1;	
     }
 	
-    rdp_draw_textured_rectangle_scaled( x, y + cache_line, x + cache.width, y + cache.height + cache_line, 1.0, 1.0, flags );
+    rdp_draw_textured_rectangle_scaled_fx( x, y + cache_line, x + cache.width, y + cache.height + cache_line, 0x10000, 0x10000, flags );
 	
     // Fill when multiple objects are requested
     if ( line > 0 ) 
@@ -1028,15 +2998,15 @@ void rdp_cp_sprite_scaled( int x, int y, float x_scale, float y_scale, int flags
     int next_line;
     int cp_x1 = (cp_x * x_scale);
     int cp_y1 = (cp_y * y_scale) - (y_scale-1);	
-    int new_width = (cache.width * x_scale) + 0.5;
-    int new_height = (cache.height * y_scale) + 0.5;
+    int new_width = (cache.width * x_scale) + 0.5f;
+    int new_height = (cache.height * y_scale) + 0.5f;
     int scaled_line = cache_line * y_scale;
 
     // Improve Y rectangle
-    if ( y_scale > 1.0 )
+    if ( y_scale > 1.0f )
         new_height += y_scale - 1;
 
-    if ( x_scale > 1.0 )
+    if ( x_scale > 1.0f )
         new_width += x_scale - 1;
 
     // Position based on flipping
@@ -1065,7 +3035,8 @@ void rdp_cp_sprite_scaled( int x, int y, float x_scale, float y_scale, int flags
         scaled_line += extra_line;
     }
 
-    rdp_draw_textured_rectangle_scaled( x, y + scaled_line, x + new_width, y + new_height + scaled_line, x_scale, y_scale, flags );
+    rdp_draw_textured_rectangle_scaled_fx( x, y + scaled_line, x + new_width, y + new_height + scaled_line,
+                                           __rdp_scale_to_fx( x_scale ), __rdp_scale_to_fx( y_scale ), flags );
 
     // Fill when multiple objects are requested
     if ( line > 0 ) 
@@ -1080,6 +3051,201 @@ void rdp_cp_sprite_scaled( int x, int y, float x_scale, float y_scale, int flags
     }
 }
 
+/*** RDP SPRITE BATCH ***/
+
+/**
+ * @brief Order queued sprites by layer, then texture, then render mode
+ *
+ * Ties keep submission order so that overlapping sprites sharing a texture and
+ * mode draw in the order they were queued.
+ */
+static int __rdp_batch_compare( const void *a, const void *b )
+{
+    const batch_entry *ea = (const batch_entry *)a;
+    const batch_entry *eb = (const batch_entry *)b;
+
+    if( ea->layer != eb->layer ) { return (ea->layer < eb->layer) ? -1 : 1; }
+    if( ea->sprite != eb->sprite ) { return ((uint32_t)ea->sprite < (uint32_t)eb->sprite) ? -1 : 1; }
+    if( ea->mode != eb->mode ) { return (ea->mode < eb->mode) ? -1 : 1; }
+
+    return (ea->order < eb->order) ? -1 : 1;
+}
+
+/**
+ * @brief Send a captured render mode to the RDP
+ *
+ * @param[in] mode
+ *            Render mode previously captured by #rdp_batch_sprite
+ */
+static void __rdp_batch_apply_mode( const batch_mode *mode )
+{
+    if( mode->other_modes[0] != other_modes[0] || mode->other_modes[1] != other_modes[1] )
+    {
+        __rdp_set_other_modes( mode->other_modes[0], mode->other_modes[1] );
+    }
+
+    if( mode->combine_mode[0] != combine_mode[0] || mode->combine_mode[1] != combine_mode[1] )
+    {
+        __rdp_set_combine( mode->combine_mode[0], mode->combine_mode[1] );
+    }
+
+    pixel_mode = mode->pixel_mode;
+    use_palette = mode->palette;
+}
+
+/**
+ * @brief Queue a sprite to be drawn by the next #rdp_batch_flush
+ *
+ * The render mode set by #rdp_texture_copy, #rdp_texture_cycle or any of the combiner
+ * helpers is captured along with the current primitive color and the palette chosen with
+ * #rdp_select_palette at the time of the call,
+ * so a batch can freely mix modes.  At flush time the sprites are sorted by layer, then
+ * texture, then render mode, so each texture is loaded into TMEM and each mode is sent
+ * only once per run of sprites that share them.
+ *
+ * If the batch is full, it is flushed before queueing the new sprite.
+ *
+ * @param[in] sprite
+ *            Sprite to draw.  It must stay valid until the batch is flushed.
+ * @param[in] x
+ *            The pixel X location of the top left of the sprite
+ * @param[in] y
+ *            The pixel Y location of the top left of the sprite
+ * @param[in] flags
+ *            Mirror flags as passed to #rdp_draw_sprite
+ * @param[in] layer
+ *            Draw order.  Lower layers are drawn first.  Layers are clamped to the range
+ *            -32768 to 32767.
+ */
+void rdp_batch_sprite( sprite_t *sprite, int x, int y, int flags, int layer )
+{
+    if( !sprite ) { return; }
+
+    if( batch_count == BATCH_SIZE ) { rdp_batch_flush(); }
+
+    /* Find the current render mode among the ones this batch already uses */
+    uint32_t mode;
+
+    for( mode = 0; mode < batch_mode_count; mode++ )
+    {
+        batch_mode *bm = &batch_modes[mode];
+
+        if( bm->pixel_mode == pixel_mode && bm->palette == use_palette &&
+            bm->other_modes[0] == other_modes[0] && bm->other_modes[1] == other_modes[1] &&
+            bm->combine_mode[0] == combine_mode[0] && bm->combine_mode[1] == combine_mode[1] )
+        {
+            break;
+        }
+    }
+
+    if( mode == batch_mode_count )
+    {
+        if( batch_mode_count == BATCH_MODES )
+        {
+            rdp_batch_flush();
+            mode = 0;
+        }
+
+        batch_modes[mode].other_modes[0] = other_modes[0];
+        batch_modes[mode].other_modes[1] = other_modes[1];
+        batch_modes[mode].combine_mode[0] = combine_mode[0];
+        batch_modes[mode].combine_mode[1] = combine_mode[1];
+        batch_modes[mode].pixel_mode = pixel_mode;
+        batch_modes[mode].palette = use_palette;
+        batch_mode_count = mode + 1;
+    }
+
+    batch_entry *entry = &batch[batch_count];
+
+    entry->sprite = sprite;
+    entry->prim_color = prim_color;
+    entry->x = x;
+    entry->y = y;
+    entry->order = batch_count;
+    entry->flags = flags;
+    entry->layer = (layer < INT16_MIN) ? INT16_MIN : (layer > INT16_MAX) ? INT16_MAX : layer;
+    entry->mode = mode;
+
+    batch_count++;
+}
+
+/**
+ * @brief Draw all sprites queued with #rdp_batch_sprite
+ *
+ * Sprites are sorted by layer, texture and render mode and then drawn, only loading
+ * textures, switching modes and changing the primitive color when they differ from the
+ * previous sprite.  The render mode, primitive color and palette that were active
+ * before the flush are restored afterwards.
+ *
+ * The RDP must be attached to a display context with clipping set up.
+ */
+void rdp_batch_flush( void )
+{
+    if( batch_count == 0 ) { return; }
+
+    /* Remember what the caller had set so it can be restored */
+    batch_mode saved;
+    uint32_t saved_prim = prim_color;
+
+    saved.other_modes[0] = other_modes[0];
+    saved.other_modes[1] = other_modes[1];
+    saved.combine_mode[0] = combine_mode[0];
+    saved.combine_mode[1] = combine_mode[1];
+    saved.pixel_mode = pixel_mode;
+    saved.palette = use_palette;
+
+    qsort( batch, batch_count, sizeof( batch_entry ), __rdp_batch_compare );
+
+    sprite_t *loaded = 0;
+    int loaded_palette = -1;
+    int mode = -1;
+
+    for( int i = 0; i < batch_count; i++ )
+    {
+        batch_entry *entry = &batch[i];
+
+        if( entry->mode != mode )
+        {
+            /* Mode changes must not affect primitives still in the pipeline */
+            rdp_sync( SYNC_PIPE );
+            __rdp_batch_apply_mode( &batch_modes[entry->mode] );
+            mode = entry->mode;
+        }
+
+        /* The palette is part of the tile set up by the load */
+        if( entry->sprite != loaded || use_palette != loaded_palette )
+        {
+            /* Don't overwrite TMEM while the previous sprite may still read it */
+            if( loaded ) { rdp_sync( SYNC_PIPE ); }
+
+            rdp_load_texture( entry->sprite );
+            loaded = entry->sprite;
+            loaded_palette = use_palette;
+        }
+
+        if( entry->prim_color != prim_color )
+        {
+            uint32_t c = entry->prim_color;
+
+            rdp_set_prim_color( c >> 24, c >> 16, c >> 8, c );
+        }
+
+        rdp_draw_sprite( entry->x, entry->y, entry->flags );
+    }
+
+    batch_count = 0;
+    batch_mode_count = 0;
+
+    /* Leave the RDP in the state the caller expects */
+    rdp_sync( SYNC_PIPE );
+    __rdp_batch_apply_mode( &saved );
+
+    if( saved_prim != prim_color )
+    {
+        rdp_set_prim_color( saved_prim >> 24, saved_prim >> 16, saved_prim >> 8, saved_prim );
+    }
+}
+
 /*** RDP FRAMEBUFFER FUNCTIONS ***/
 
 #define __get_pixel( buffer, x, y ) \
@@ -1108,6 +3274,8 @@ uint32_t get_pixel( display_context_t disp, int x, int y )
 // Function to load textures generated on the fly
 void rdp_load_texbuf( uint16_t *buffer_texture, int sh, int th )
 {	
+    __rdp_tmem_hazard( 0 );
+
     /* Point the RDP at the actual sprite data */
     __rdp_ringbuffer_queue( 0xFD100000 | sh );
     __rdp_ringbuffer_queue( (uint32_t)buffer_texture );
@@ -1132,14 +3300,255 @@ void rdp_load_texbuf( uint16_t *buffer_texture, int sh, int th )
     __rdp_ringbuffer_queue( ((sh << 2) & 0xFFF) << 12 | ((th << 2) & 0xFFF) );
     __rdp_ringbuffer_send();			
 
+    __rdp_tlut_clobber( (((((cache.real_width >> 3) + round_amount) << 1) << 3) * (th + 1)) - TMEM_TLUT_OFFSET );
+
     /* Save sprite width and height for managed sprite commands */
     cache.width = sh;
+    mip_levels = 1;
     cache.height = th;	
     cache.cp_x = 0;
     cache.cp_y = 0;
     cache.cp_start = 0;		
 }	
 
+/**
+ * @brief Allocate an offscreen render target
+ *
+ * The surface can be drawn to by the RDP after #rdp_attach_surface and later used as a
+ * texture with #rdp_load_surface_as_texture, without any CPU copies.
+ *
+ * @param[in] width
+ *            Width in pixels
+ * @param[in] height
+ *            Height in pixels
+ * @param[in] bitdepth
+ *            Bytes per pixel, 2 or 4
+ *
+ * @return A new surface, or 0 if out of memory.
+ */
+surface_t *rdp_surface_alloc( int width, int height, int bitdepth )
+{
+    if( width <= 0 || height <= 0 || (bitdepth != 2 && bitdepth != 4) ) { return 0; }
+
+    surface_t *surface = malloc( sizeof(surface_t) );
+
+    if( !surface ) { return 0; }
+
+    /* The RDP wants color images on a 64 byte boundary */
+    surface->memory = malloc( width * height * bitdepth + 63 );
+
+    if( !surface->memory )
+    {
+        free( surface );
+        return 0;
+    }
+
+    /* Nothing may be left in the cache over the buffer, since it is accessed uncached */
+    data_cache_hit_writeback_invalidate( surface->memory, width * height * bitdepth + 63 );
+
+    surface->buffer = (void *)((((uint32_t)surface->memory | 0xA0000000) + 63) & ~63);
+    surface->width = width;
+    surface->height = height;
+    surface->bitdepth = bitdepth;
+
+    memset( surface->buffer, 0, width * height * bitdepth );
+
+    return surface;
+}
+
+/**
+ * @brief Free a surface allocated with #rdp_surface_alloc
+ *
+ * @note Make sure the RDP is done with the surface first, for example with #rdp_fence_wait.
+ *
+ * @param[in] surface
+ *            Surface to free
+ */
+void rdp_surface_free( surface_t *surface )
+{
+    if( !surface ) { return; }
+
+    if( attached_surface == surface ) { attached_surface = 0; }
+
+    free( surface->memory );
+    free( surface );
+}
+
+/**
+ * @brief Attach the RDP to an offscreen surface
+ *
+ * Following drawing operations render into the surface instead of a display context.
+ * The clipping box is reset to cover the surface.  Use #rdp_attach_display to go back
+ * to rendering to the screen.
+ *
+ * @note The Z-buffer, if any, stays enabled and is shared with the screen.  Surfaces
+ * wider than the screen must not use depth testing.
+ *
+ * @param[in] surface
+ *            Surface allocated with #rdp_surface_alloc
+ */
+void rdp_attach_surface( surface_t *surface )
+{
+    if( !surface ) { return; }
+
+    /* Finish drawing to the previous target before switching */
+    rdp_sync( SYNC_PIPE );
+
+    __rdp_ringbuffer_queue( 0xFF000000 | ((surface->bitdepth == 2) ? 0x00100000 : 0x00180000) | (surface->width - 1) );
+    __rdp_ringbuffer_queue( (uint32_t)surface->buffer );
+    __rdp_ringbuffer_send();
+
+    attached_disp = 0;
+    __rdp_fills_pending = 0;
+    attached_surface = surface;
+    target_width = surface->width;
+    target_height = surface->height;
+
+    rdp_set_default_clipping();
+}
+
+/**
+ * @brief Load a region of a surface into TMEM as a texture
+ *
+ * The RDP samples the surface directly from RDRAM.  After loading, the region can be
+ * drawn like a sprite with #rdp_draw_sprite, #rdp_draw_sprite_scaled or
+ * #rdp_draw_textured_rectangle.
+ *
+ * Texture memory is 4KB, so the region must fit: for example 64x32 pixels at 16bit or
+ * 32x32 pixels at 32bit.  Taller regions are cropped.
+ *
+ * @param[in] surface
+ *            Surface to sample, which must not be the current render target
+ * @param[in] x
+ *            X coordinate of the region in pixels
+ * @param[in] y
+ *            Y coordinate of the region in pixels
+ * @param[in] width
+ *            Width of the region in pixels
+ * @param[in] height
+ *            Height of the region in pixels
+ */
+void rdp_load_surface_as_texture( surface_t *surface, int x, int y, int width, int height )
+{
+    if( !surface || x < 0 || y < 0 || width <= 0 || height <= 0 ) { return; }
+
+    if( x + width > surface->width ) { width = surface->width - x; }
+    if( y + height > surface->height ) { height = surface->height - y; }
+    if( width <= 0 || height <= 0 ) { return; }
+
+    /* Keep within TMEM, 32bit texels are split across both halves */
+    int line_bytes = __rdp_round_to_power( width ) << 1;
+    int tmem_size = (surface->bitdepth == 2) ? 4096 : 2048;
+    if( line_bytes < 8 ) { line_bytes = 8; }
+    if( height * line_bytes > tmem_size ) { height = tmem_size / line_bytes; }
+
+    /* Make sure everything drawn to the surface so far has landed in RDRAM */
+    rdp_sync( SYNC_PIPE );
+
+    __rdp_load_tile_region( surface->buffer, surface->width, surface->bitdepth, x, y, width, height );
+}
+
+/**
+ * @brief Get the counters of the RDP state tracker
+ *
+ * State changes that set a value that is already current and syncs with nothing to
+ * wait for are not sent to the RDP, and syncs are added where a mode change or texture
+ * load would otherwise race with drawing.  These counters report how often that
+ * happened since #rdp_init or #rdp_reset_state_stats.
+ *
+ * @param[out] stats
+ *             Structure receiving the counters
+ */
+void rdp_get_state_stats( rdp_state_stats_t *stats )
+{
+    if( stats ) { *stats = state_stats; }
+}
+
+/**
+ * @brief Reset the counters of the RDP state tracker
+ */
+void rdp_reset_state_stats( void )
+{
+    memset( &state_stats, 0, sizeof(state_stats) );
+}
+
+/**
+ * @brief Start profiling RDP activity
+ *
+ * Resets the RDP clock, busy, pipe busy and TMEM busy counters along with the count of
+ * bytes and submissions sent.  Call at the start of a frame and #rdp_profile_end at its
+ * end to find out whether the frame is bound by the CPU or the RDP.
+ */
+void rdp_profile_begin( void )
+{
+    /* Clear TMEM, pipe, command buffer and clock counters */
+    ((volatile uint32_t *)0xA4100000)[3] = 0x3C0;
+    MEMORY_BARRIER();
+
+    profile_bytes = 0;
+    profile_kicks = 0;
+    profile_start = get_ticks();
+}
+
+/**
+ * @brief Read the RDP activity since #rdp_profile_begin
+ *
+ * The counters keep running, so this may be called several times per frame.
+ *
+ * @param[out] profile
+ *             Structure receiving the counters
+ */
+void rdp_profile_end( rdp_profile_t *profile )
+{
+    if( !profile ) { return; }
+
+    volatile uint32_t *dp = (volatile uint32_t *)0xA4100000;
+
+    /* Counters are 24 bits wide */
+    profile->clock = dp[4] & 0xFFFFFF;
+    profile->busy = dp[5] & 0xFFFFFF;
+    profile->pipe_busy = dp[6] & 0xFFFFFF;
+    profile->tmem_busy = dp[7] & 0xFFFFFF;
+    profile->bytes = profile_bytes;
+    profile->kicks = profile_kicks;
+    profile->cpu_ticks = get_ticks() - profile_start;
+    profile->utilization = profile->clock ? (float)profile->pipe_busy / (float)profile->clock : 0.0f;
+}
+
+/**
+ * @brief Start capturing the commands sent to the RDP
+ *
+ * Every command sent afterwards is also copied into the buffer, until it is full or
+ * #rdp_capture_stop is called.  Once a send does not fit, capturing stops for good, so
+ * the buffer always holds an unbroken stream.  The capture can be saved and inspected on the host with
+ * the rdpdis tool, which decodes the commands and flags malformed or redundant ones.
+ *
+ * @param[out] buffer
+ *             Buffer receiving the command words
+ * @param[in]  max_words
+ *             Capacity of the buffer in 32-bit words
+ */
+void rdp_capture_start( uint32_t *buffer, int max_words )
+{
+    capture_count = 0;
+    capture_max = max_words;
+    capture_truncated = 0;
+    capture_buffer = buffer;
+}
+
+/**
+ * @brief Stop capturing the commands sent to the RDP
+ *
+ * @return Number of 32-bit words captured since #rdp_capture_start.  If the buffer filled
+ *         up and later commands were not captured, the word count is returned negated.
+ */
+int rdp_capture_stop( void )
+{
+    capture_buffer = 0;
+
+    return capture_truncated ? -capture_count : capture_count;
+}
+
 // Create a 16bit texture from the framebuffer
 void rdp_buffer_copy( display_context_t disp, uint16_t *buffer_texture, uint16_t x_buf, uint16_t y_buf, uint16_t width, uint16_t height, uint16_t skip )
 {
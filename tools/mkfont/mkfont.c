@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/* Must match FONT_MAGIC in graphics.h */
+#define FONT_MAGIC          0x464E5431
+
+/* Size of the font header and table entries on the N64 */
+#define HEADER_SIZE         20
+#define GLYPH_SIZE          10
+#define KERNING_SIZE        4
+
+/* TMEM left for a CI4 texture next to the palettes */
+#define TMEM_CI4_BYTES      2048
+
+#define MAX_CHARS           256
+#define MAX_KERNING         4096
+
+typedef struct
+{
+    int present;
+    int width;
+    int height;
+    int x_offset;
+    int y_offset;
+    int advance;
+    int atlas_x;
+    int atlas_y;
+    uint8_t *bits;
+} glyph_t;
+
+typedef struct
+{
+    int first;
+    int second;
+    int amount;
+} kerning_t;
+
+static glyph_t glyphs[MAX_CHARS];
+static kerning_t kerning[MAX_KERNING];
+static int num_kerning = 0;
+
+void print_args( char * name )
+{
+    fprintf( stderr, "Usage: %s [-w <atlas width>] [-k <kerning file>] <input bdf> <output file>\n", name );
+    fprintf( stderr, "\t<atlas width> is the width of the glyph atlas in pixels, a multiple of 16 (default 128).\n" );
+    fprintf( stderr, "\t<kerning file> has one '<first> <second> <pixels>' pair per line, characters given\n" );
+    fprintf( stderr, "\t\teither literally or as decimal codes.\n" );
+    fprintf( stderr, "\t<input bdf> should be a BDF bitmap font, characters 0-255 are converted.\n" );
+    fprintf( stderr, "\t<output file> will be written in binary for inclusion using DragonFS.\n" );
+}
+
+static void write_u8( FILE *fp, int value )
+{
+    fputc( value & 0xFF, fp );
+}
+
+static void write_u16( FILE *fp, int value )
+{
+    /* Big endian, as on the N64 */
+    fputc( (value >> 8) & 0xFF, fp );
+    fputc( value & 0xFF, fp );
+}
+
+static void write_u32( FILE *fp, uint32_t value )
+{
+    write_u16( fp, value >> 16 );
+    write_u16( fp, value & 0xFFFF );
+}
+
+/* Read every glyph of a BDF font, returns the font ascent plus descent or -1 on error */
+static int read_bdf( const char * const infile, int *ascent )
+{
+    FILE *fp = fopen( infile, "r" );
+    char line[1024];
+    int descent = 0;
+    int encoding = -1;
+    int rows = -1;
+    glyph_t cur;
+
+    if( !fp )
+    {
+        fprintf( stderr, "Cannot open %s\n", infile );
+        return -1;
+    }
+
+    *ascent = 0;
+    memset( &cur, 0, sizeof(cur) );
+
+    while( fgets( line, sizeof(line), fp ) )
+    {
+        if( rows >= 0 )
+        {
+            /* Inside BITMAP, one hexadecimal row per line */
+            if( !strncmp( line, "ENDCHAR", 7 ) )
+            {
+                if( encoding >= 0 && encoding < MAX_CHARS )
+                {
+                    cur.present = 1;
+                    free( glyphs[encoding].bits );
+                    glyphs[encoding] = cur;
+                }
+                else
+                {
+                    free( cur.bits );
+                }
+
+                memset( &cur, 0, sizeof(cur) );
+                encoding = -1;
+                rows = -1;
+                continue;
+            }
+
+            if( rows < cur.height )
+            {
+                int bytes = (cur.width + 7) / 8;
+
+                for( int b = 0; b < bytes; b++ )
+                {
+                    unsigned int value = 0;
+
+                    if( sscanf( line + b * 2, "%2x", &value ) != 1 ) { break; }
+
+                    for( int bit = 0; bit < 8 && b * 8 + bit < cur.width; bit++ )
+                    {
+                        cur.bits[rows * cur.width + b * 8 + bit] = (value & (0x80 >> bit)) ? 1 : 0;
+                    }
+                }
+
+                rows++;
+            }
+
+            continue;
+        }
+
+        if( !strncmp( line, "FONT_ASCENT ", 12 ) ) { *ascent = atoi( line + 12 ); }
+        else if( !strncmp( line, "FONT_DESCENT ", 13 ) ) { descent = atoi( line + 13 ); }
+        else if( !strncmp( line, "ENCODING ", 9 ) ) { encoding = atoi( line + 9 ); }
+        else if( !strncmp( line, "DWIDTH ", 7 ) ) { cur.advance = atoi( line + 7 ); }
+        else if( !strncmp( line, "BBX ", 4 ) )
+        {
+            sscanf( line + 4, "%d %d %d %d", &cur.width, &cur.height, &cur.x_offset, &cur.y_offset );
+
+            if( cur.width < 0 || cur.height < 0 || cur.width > 255 || cur.height > 255 )
+            {
+                fprintf( stderr, "Glyph %d is too large\n", encoding );
+                fclose( fp );
+                return -1;
+            }
+        }
+        else if( !strncmp( line, "BITMAP", 6 ) )
+        {
+            cur.bits = calloc( cur.width * cur.height + 1, 1 );
+            rows = 0;
+        }
+    }
+
+    fclose( fp );
+
+    if( *ascent + descent <= 0 )
+    {
+        fprintf( stderr, "%s has no FONT_ASCENT and FONT_DESCENT\n", infile );
+        return -1;
+    }
+
+    return *ascent + descent;
+}
+
+/* Report a value that does not fit its field in the font file, returns -1 if so */
+static int check_range( const char *what, int c, int value, int min, int max )
+{
+    if( value >= min && value <= max ) { return 0; }
+
+    if( c >= 0 ) { fprintf( stderr, "Glyph %d: %s %d is outside %d to %d\n", c, what, value, min, max ); }
+    else { fprintf( stderr, "%s %d is outside %d to %d\n", what, value, min, max ); }
+
+    return -1;
+}
+
+/* Parse a character given literally or as a decimal code */
+static int parse_char( const char *token )
+{
+    if( strlen( token ) == 1 ) { return (unsigned char)token[0]; }
+
+    return atoi( token );
+}
+
+static int kerning_compare( const void *a, const void *b )
+{
+    const kerning_t *ka = a;
+    const kerning_t *kb = b;
+
+    return ((ka->first << 8) | ka->second) - ((kb->first << 8) | kb->second);
+}
+
+static int read_kerning( const char * const infile )
+{
+    FILE *fp = fopen( infile, "r" );
+    char line[256];
+
+    if( !fp )
+    {
+        fprintf( stderr, "Cannot open %s\n", infile );
+        return -1;
+    }
+
+    while( fgets( line, sizeof(line), fp ) && num_kerning < MAX_KERNING )
+    {
+        char first[16], second[16];
+        int amount;
+
+        if( line[0] == '#' ) { continue; }
+        if( sscanf( line, "%15s %15s %d", first, second, &amount ) != 3 ) { continue; }
+
+        if( check_range( "Kerning amount", -1, amount, -128, 127 ) < 0 )
+        {
+            fclose( fp );
+            return -1;
+        }
+
+        kerning[num_kerning].first = parse_char( first ) & 0xFF;
+        kerning[num_kerning].second = parse_char( second ) & 0xFF;
+        kerning[num_kerning].amount = amount;
+        num_kerning++;
+    }
+
+    fclose( fp );
+
+    /* The N64 side binary searches the pairs */
+    qsort( kerning, num_kerning, sizeof(kerning_t), kerning_compare );
+
+    return 0;
+}
+
+/* Place glyphs left to right in rows as tall as their tallest glyph, returns the atlas height */
+static int pack_atlas( int first, int last, int atlas_width )
+{
+    int x = 0;
+    int y = 0;
+    int row_height = 0;
+
+    for( int c = first; c <= last; c++ )
+    {
+        glyph_t *g = &glyphs[c];
+
+        if( !g->present || !g->width || !g->height ) { continue; }
+
+        if( g->width > atlas_width )
+        {
+            fprintf( stderr, "Glyph %d is wider than the atlas\n", c );
+            return -1;
+        }
+
+        /* One pixel of spacing keeps filtered texture lookups from bleeding */
+        if( x + g->width > atlas_width )
+        {
+            x = 0;
+            y += row_height + 1;
+            row_height = 0;
+        }
+
+        g->atlas_x = x;
+        g->atlas_y = y;
+        x += g->width + 1;
+
+        if( g->height > row_height ) { row_height = g->height; }
+    }
+
+    return y + row_height;
+}
+
+int main( int argc, char *argv[] )
+{
+    int atlas_width = 128;
+    const char *kerning_file = NULL;
+    int i;
+
+    for( i = 1; i < argc - 2; i++ )
+    {
+        if( !strcmp( argv[i], "-w" ) && i + 1 < argc - 2 ) { atlas_width = atoi( argv[++i] ); }
+        else if( !strcmp( argv[i], "-k" ) && i + 1 < argc - 2 ) { kerning_file = argv[++i]; }
+        else { break; }
+    }
+
+    if( i != argc - 2 || atlas_width <= 0 || atlas_width > 65520 || (atlas_width & 15) )
+    {
+        print_args( argv[0] );
+        return -EINVAL;
+    }
+
+    const char *infile = argv[argc - 2];
+    const char *outfile = argv[argc - 1];
+    int ascent;
+    int line_height = read_bdf( infile, &ascent );
+
+    if( line_height < 0 ) { return -EINVAL; }
+    if( kerning_file && read_kerning( kerning_file ) < 0 ) { return -EINVAL; }
+
+    int first = -1;
+    int last = -1;
+
+    for( int c = 0; c < MAX_CHARS; c++ )
+    {
+        if( !glyphs[c].present ) { continue; }
+        if( first < 0 ) { first = c; }
+        last = c;
+    }
+
+    if( first < 0 )
+    {
+        fprintf( stderr, "%s has no glyphs between 0 and 255\n", infile );
+        return -EINVAL;
+    }
+
+    if( check_range( "Line height", -1, line_height, 1, 255 ) < 0 ) { return -EINVAL; }
+
+    /* Offsets and advances are stored in single bytes */
+    for( int c = first; c <= last; c++ )
+    {
+        glyph_t *g = &glyphs[c];
+
+        if( !g->present ) { continue; }
+
+        if( check_range( "x offset", c, g->x_offset, -128, 127 ) < 0 ||
+            check_range( "y offset", c, ascent - (g->y_offset + g->height), -128, 127 ) < 0 ||
+            check_range( "advance", c, (g->advance > 0) ? g->advance : 0, 0, 255 ) < 0 )
+        {
+            return -EINVAL;
+        }
+    }
+
+    int atlas_height = pack_atlas( first, last, atlas_width );
+    if( atlas_height < 0 ) { return -EINVAL; }
+    if( atlas_height == 0 ) { atlas_height = 1; }
+    if( check_range( "Atlas height", -1, atlas_height, 1, 65535 ) < 0 ) { return -EINVAL; }
+
+    if( (atlas_width / 2) * atlas_height > TMEM_CI4_BYTES )
+    {
+        fprintf( stderr, "Warning: %dx%d atlas does not fit in TMEM, rdp_draw_text cannot use this font\n",
+                 atlas_width, atlas_height );
+    }
+
+    uint8_t *atlas = calloc( (atlas_width / 2) * atlas_height, 1 );
+
+    for( int c = first; c <= last; c++ )
+    {
+        glyph_t *g = &glyphs[c];
+
+        if( !g->present ) { continue; }
+
+        for( int y = 0; y < g->height; y++ )
+        {
+            for( int x = 0; x < g->width; x++ )
+            {
+                if( !g->bits[y * g->width + x] ) { continue; }
+
+                /* Color index 1, high nibble first */
+                int ax = g->atlas_x + x;
+                atlas[((g->atlas_y + y) * atlas_width + ax) >> 1] |= (ax & 1) ? 0x01 : 0x10;
+            }
+        }
+    }
+
+    FILE *fp = fopen( outfile, "wb" );
+
+    if( !fp )
+    {
+        fprintf( stderr, "Cannot open %s\n", outfile );
+        return -EINVAL;
+    }
+
+    int num_glyphs = last - first + 1;
+    uint32_t kerning_offset = HEADER_SIZE + num_glyphs * GLYPH_SIZE;
+    uint32_t atlas_offset = (kerning_offset + num_kerning * KERNING_SIZE + 7) & ~7;
+
+    /* Header */
+    write_u32( fp, FONT_MAGIC );
+    write_u16( fp, num_glyphs );
+    write_u16( fp, num_kerning );
+    write_u8( fp, first );
+    write_u8( fp, line_height );
+    write_u16( fp, 0 );
+    write_u32( fp, kerning_offset );
+    write_u32( fp, atlas_offset );
+
+    /* Glyph table, offsets relative to the top of the line */
+    for( int c = first; c <= last; c++ )
+    {
+        glyph_t *g = &glyphs[c];
+
+        write_u16( fp, g->atlas_x );
+        write_u16( fp, g->atlas_y );
+        write_u8( fp, g->present ? g->width : 0 );
+        write_u8( fp, g->present ? g->height : 0 );
+        write_u8( fp, g->present ? g->x_offset : 0 );
+        write_u8( fp, g->present ? ascent - (g->y_offset + g->height) : 0 );
+        write_u8( fp, (g->advance > 0) ? g->advance : 0 );
+        write_u8( fp, 0 );
+    }
+
+    /* Kerning pairs */
+    for( i = 0; i < num_kerning; i++ )
+    {
+        write_u8( fp, kerning[i].first );
+        write_u8( fp, kerning[i].second );
+        write_u8( fp, kerning[i].amount );
+        write_u8( fp, 0 );
+    }
+
+    for( uint32_t pos = kerning_offset + num_kerning * KERNING_SIZE; pos < atlas_offset; pos++ )
+    {
+        fputc( 0, fp );
+    }
+
+    /* Atlas as a 4-bit sprite */
+    write_u16( fp, atlas_width );
+    write_u16( fp, atlas_height );
+    write_u8( fp, 0 );
+    write_u8( fp, 0 );
+    write_u8( fp, 1 );
+    write_u8( fp, 1 );
+    fwrite( atlas, 1, (atlas_width / 2) * atlas_height, fp );
+
+    fclose( fp );
+    free( atlas );
+
+    for( int c = 0; c < MAX_CHARS; c++ ) { free( glyphs[c].bits ); }
+
+    return 0;
+}
@@ -34,7 +34,58 @@ void write_value( uint8_t *colorbuf, FILE *fp, int bitdepth )
     }
 }
 
-int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslices )
+/* Write an RGBA image, optionally padded to a multiple of 8 bytes so that the next level stays aligned */
+void write_image( uint8_t *rgba, int width, int height, FILE *fp, int bitdepth, int pad )
+{
+    int bytes = width * height * ((bitdepth == BITDEPTH_16BPP) ? 2 : 4);
+
+    for( int i = 0; i < width * height; i++ )
+    {
+        write_value( &rgba[i * 4], fp, bitdepth );
+    }
+
+    for( ; pad && (bytes & 7); bytes++ )
+    {
+        fputc( 0, fp );
+    }
+}
+
+/* Halve an RGBA image with a 2x2 box filter, returns the new image or NULL */
+uint8_t *downsample( uint8_t *rgba, int width, int height, int *out_width, int *out_height )
+{
+    int nw = (width > 1) ? width / 2 : 1;
+    int nh = (height > 1) ? height / 2 : 1;
+    uint8_t *out = malloc( nw * nh * 4 );
+
+    if( out == NULL ) { return NULL; }
+
+    for( int j = 0; j < nh; j++ )
+    {
+        int y0 = (j * 2 < height) ? j * 2 : height - 1;
+        int y1 = (j * 2 + 1 < height) ? j * 2 + 1 : y0;
+
+        for( int i = 0; i < nw; i++ )
+        {
+            int x0 = (i * 2 < width) ? i * 2 : width - 1;
+            int x1 = (i * 2 + 1 < width) ? i * 2 + 1 : x0;
+
+            for( int c = 0; c < 4; c++ )
+            {
+                int sum = rgba[(y0 * width + x0) * 4 + c] + rgba[(y0 * width + x1) * 4 + c] +
+                          rgba[(y1 * width + x0) * 4 + c] + rgba[(y1 * width + x1) * 4 + c];
+
+                out[(j * nw + i) * 4 + c] = (sum + 2) / 4;
+            }
+        }
+    }
+
+    *out_width = nw;
+    *out_height = nh;
+
+    return out;
+}
+
+int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslices, int levels )
 {
     png_structp png_ptr;
     png_infop info_ptr;
@@ -143,6 +194,17 @@ int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslice
 
     /* Keep the variably sized array scoped so we can goto past it */
     {
+        /* Whole image as 8 bit RGBA, so that mipmaps can be generated */
+        uint8_t *rgba = malloc( width * height * 4 );
+
+        if( rgba == NULL )
+        {
+            fprintf(stderr, "Unable to allocate space for image!\n");
+
+            err = -ENOMEM;
+            goto exitpng;
+        }
+
         /* The easiest way to read the image (all at once) */
         png_bytep row_pointers[height];
         memset( row_pointers, 0, sizeof( png_bytep ) * height );
@@ -174,32 +236,56 @@ int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslice
                 {
                     for( int i = 0; i < width; i++ )
                     {
-                        uint8_t buf[4];
+                        uint8_t *buf = &rgba[(j * width + i) * 4];
 
                         buf[0] = row_pointers[j][(i * 3)];
                         buf[1] = row_pointers[j][(i * 3) + 1];
                         buf[2] = row_pointers[j][(i * 3) + 2];
                         buf[3] = 255;
-
-                        write_value( buf, op, depth );
                     }
                 }
 
                 break;
             case PNG_COLOR_TYPE_RGB_ALPHA:
-                /* Easy, just dump rows or convert */
+                /* Easy, just copy rows */
                 for( int row = 0; row < height; row++ )
                 {
-                    for( int col = 0; col < width; col++ )
-                    {
-                        write_value( &row_pointers[row][col * 4], op, depth );
-                    }
+                    memcpy( &rgba[row * width * 4], row_pointers[row], width * 4 );
                 }
 
                 break;
         }
 
+        /* Full size image, then each mipmap level at half the size of the previous one */
+        int level_width = width;
+        int level_height = height;
+
+        for( int level = 0; level < levels; level++ )
+        {
+            if( level > 0 )
+            {
+                uint8_t *next = downsample( rgba, level_width, level_height, &level_width, &level_height );
+
+                if( next == NULL )
+                {
+                    fprintf(stderr, "Unable to allocate space for mipmap!\n");
+
+                    err = -ENOMEM;
+                    break;
+                }
+
+                free( rgba );
+                rgba = next;
+            }
+
+            write_image( rgba, level_width, level_height, op, depth, levels > 1 );
+
+            if( level_width == 1 && level_height == 1 ) { break; }
+        }
+
 exitmem:
+        free( rgba );
+
         /* Free the row pointers memory */
         for( int row = 0; row < height; row++ )
         {
@@ -225,7 +311,9 @@ exitfiles:
 
 void print_args( char * name )
 {
-    fprintf( stderr, "Usage: %s <bit depth> [<horizontal slices> <vertical slices>] <input png> <output file>\n", name );
+    fprintf( stderr, "Usage: %s [-m <levels>] <bit depth> [<horizontal slices> <vertical slices>] <input png> <output file>\n", name );
+    fprintf( stderr, "\t<levels> is the number of mipmap levels to store, including the full size image.  Each level is\n" );
+    fprintf( stderr, "\t\thalf the size of the previous one and is appended after it.  Use with rdp_load_texture_mipmap.\n" );
     fprintf( stderr, "\t<bit depth> should be 16 or 32.\n" );
     fprintf( stderr, "\t<horizontal slices> should be a number two or greater signifying how many images are in this spritemap horizontally.\n" );
     fprintf( stderr, "\t<vertical slices> should be a number two or greater signifying how many images are in this spritemap vertically.\n" );
@@ -236,6 +324,23 @@ void print_args( char * name )
 int main( int argc, char *argv[] )
 {
     int bitdepth;
+    int levels = 1;
+
+    /* Optional mipmap level count */
+    if( argc > 2 && !strcmp( argv[1], "-m" ) )
+    {
+        levels = atoi( argv[2] );
+
+        if( levels < 1 || levels > 8 )
+        {
+            print_args( argv[0] );
+            return -EINVAL;
+        }
+
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
 
     if( argc != 4 && argc != 6 )
     {
@@ -263,7 +368,7 @@ int main( int argc, char *argv[] )
     if( argc == 4 )
     {
         /* Translate, return result */
-        return read_png( argv[2], argv[3], bitdepth, 1, 1 );
+        return read_png( argv[2], argv[3], bitdepth, 1, 1, levels );
     }
     else
     {
@@ -271,6 +376,6 @@ int main( int argc, char *argv[] )
         int vslices = atoi( argv[3] );
 
         /* Translate, return result */
-        return read_png( argv[4], argv[5], bitdepth, hslices, vslices );
+        return read_png( argv[4], argv[5], bitdepth, hslices, vslices, levels );
     }
 }
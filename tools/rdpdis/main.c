@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "rdpdis.h"
+
+#define MAX_WORDS (16 * 1024 * 1024)
+
+void print_help( const char * const prog_name )
+{
+    fprintf( stderr, "Usage: %s [-q] [-t] [-s] <capture file>\n\n", prog_name );
+    fprintf( stderr, "Disassembles and validates an RDP command stream captured with rdp_capture_start.\n\n" );
+    fprintf( stderr, "  -q  Only print problems, not every command\n" );
+    fprintf( stderr, "  -t  Capture is text, whitespace separated hexadecimal words\n" );
+    fprintf( stderr, "  -s  Print a summary line of counters at the end\n\n" );
+    fprintf( stderr, "Binary captures are big endian 32-bit words as stored in N64 memory.\n" );
+    fprintf( stderr, "Exits with 1 if any command is malformed.\n" );
+}
+
+/* Read big endian words from a binary capture */
+static int read_binary( FILE *fp, uint32_t *words, int max )
+{
+    uint8_t b[4];
+    int count = 0;
+
+    while( count < max && fread( b, 1, 4, fp ) == 4 )
+    {
+        words[count++] = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    }
+
+    return count;
+}
+
+/* Read hexadecimal words from a text capture */
+static int read_text( FILE *fp, uint32_t *words, int max )
+{
+    unsigned int word;
+    int count = 0;
+
+    while( count < max && fscanf( fp, "%x", &word ) == 1 )
+    {
+        words[count++] = word;
+    }
+
+    return count;
+}
+
+int main( int argc, char *argv[] )
+{
+    int flags = RDPDIS_LIST | RDPDIS_WARN;
+    int text = 0;
+    int summary = 0;
+    const char *file = 0;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( !strcmp( argv[i], "-q" ) ) { flags &= ~RDPDIS_LIST; }
+        else if( !strcmp( argv[i], "-t" ) ) { text = 1; }
+        else if( !strcmp( argv[i], "-s" ) ) { summary = 1; }
+        else if( argv[i][0] == '-' && argv[i][1] ) { print_help( argv[0] ); return -1; }
+        else { file = argv[i]; }
+    }
+
+    if( !file )
+    {
+        print_help( argv[0] );
+        return -1;
+    }
+
+    FILE *fp = strcmp( file, "-" ) ? fopen( file, text ? "r" : "rb" ) : stdin;
+
+    if( !fp )
+    {
+        fprintf( stderr, "Cannot open %s\n", file );
+        return -1;
+    }
+
+    uint32_t *words = malloc( MAX_WORDS * sizeof(uint32_t) );
+
+    if( !words )
+    {
+        fprintf( stderr, "Out of memory!\n" );
+        return -1;
+    }
+
+    int count = text ? read_text( fp, words, MAX_WORDS ) : read_binary( fp, words, MAX_WORDS );
+
+    if( fp != stdin ) { fclose( fp ); }
+
+    rdpdis_stats_t stats;
+    memset( &stats, 0, sizeof(stats) );
+
+    rdpdis_decode( words, count, stdout, flags, &stats );
+
+    if( summary )
+    {
+        printf( "commands=%d primitives=%d syncs=%d malformed=%d redundant=%d unnecessary_syncs=%d hazards=%d\n",
+                stats.commands, stats.primitives, stats.syncs, stats.malformed, stats.redundant,
+                stats.unnecessary_syncs, stats.hazards );
+    }
+
+    free( words );
+
+    return stats.malformed ? 1 : 0;
+}
@@ -0,0 +1,543 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "rdpdis.h"
+
+/* Opcodes, the upper 6 bits of the first command byte */
+#define OP_NOP              0x00
+#define OP_TRI_FIRST        0x08
+#define OP_TRI_LAST         0x0F
+#define OP_TEXRECT          0x24
+#define OP_TEXRECT_FLIP     0x25
+#define OP_SYNC_LOAD        0x26
+#define OP_SYNC_PIPE        0x27
+#define OP_SYNC_TILE        0x28
+#define OP_SYNC_FULL        0x29
+#define OP_SET_KEY_GB       0x2A
+#define OP_SET_KEY_R        0x2B
+#define OP_SET_CONVERT      0x2C
+#define OP_SET_SCISSOR      0x2D
+#define OP_SET_PRIM_DEPTH   0x2E
+#define OP_SET_OTHER_MODES  0x2F
+#define OP_LOAD_TLUT        0x30
+#define OP_SET_TILE_SIZE    0x32
+#define OP_LOAD_BLOCK       0x33
+#define OP_LOAD_TILE        0x34
+#define OP_SET_TILE         0x35
+#define OP_FILL_RECT        0x36
+#define OP_SET_FILL_COLOR   0x37
+#define OP_SET_FOG_COLOR    0x38
+#define OP_SET_BLEND_COLOR  0x39
+#define OP_SET_PRIM_COLOR   0x3A
+#define OP_SET_ENV_COLOR    0x3B
+#define OP_SET_COMBINE      0x3C
+#define OP_SET_TEX_IMAGE    0x3D
+#define OP_SET_Z_IMAGE      0x3E
+#define OP_SET_COLOR_IMAGE  0x3F
+
+/* Triangle type bits */
+#define TRI_ZBUFFER         0x01
+#define TRI_TEXTURE         0x02
+#define TRI_SHADE           0x04
+
+#define OPCODE(w)           (((w) >> 24) & 0x3F)
+
+static const char *command_names[64] =
+{
+    [OP_NOP]                = "NOP",
+    [0x08]                  = "TRI_FILL",
+    [0x09]                  = "TRI_FILL_Z",
+    [0x0A]                  = "TRI_TEX",
+    [0x0B]                  = "TRI_TEX_Z",
+    [0x0C]                  = "TRI_SHADE",
+    [0x0D]                  = "TRI_SHADE_Z",
+    [0x0E]                  = "TRI_SHADE_TEX",
+    [0x0F]                  = "TRI_SHADE_TEX_Z",
+    [OP_TEXRECT]            = "TEXRECT",
+    [OP_TEXRECT_FLIP]       = "TEXRECT_FLIP",
+    [OP_SYNC_LOAD]          = "SYNC_LOAD",
+    [OP_SYNC_PIPE]          = "SYNC_PIPE",
+    [OP_SYNC_TILE]          = "SYNC_TILE",
+    [OP_SYNC_FULL]          = "SYNC_FULL",
+    [OP_SET_KEY_GB]         = "SET_KEY_GB",
+    [OP_SET_KEY_R]          = "SET_KEY_R",
+    [OP_SET_CONVERT]        = "SET_CONVERT",
+    [OP_SET_SCISSOR]        = "SET_SCISSOR",
+    [OP_SET_PRIM_DEPTH]     = "SET_PRIM_DEPTH",
+    [OP_SET_OTHER_MODES]    = "SET_OTHER_MODES",
+    [OP_LOAD_TLUT]          = "LOAD_TLUT",
+    [OP_SET_TILE_SIZE]      = "SET_TILE_SIZE",
+    [OP_LOAD_BLOCK]         = "LOAD_BLOCK",
+    [OP_LOAD_TILE]          = "LOAD_TILE",
+    [OP_SET_TILE]           = "SET_TILE",
+    [OP_FILL_RECT]          = "FILL_RECT",
+    [OP_SET_FILL_COLOR]     = "SET_FILL_COLOR",
+    [OP_SET_FOG_COLOR]      = "SET_FOG_COLOR",
+    [OP_SET_BLEND_COLOR]    = "SET_BLEND_COLOR",
+    [OP_SET_PRIM_COLOR]     = "SET_PRIM_COLOR",
+    [OP_SET_ENV_COLOR]      = "SET_ENV_COLOR",
+    [OP_SET_COMBINE]        = "SET_COMBINE",
+    [OP_SET_TEX_IMAGE]      = "SET_TEX_IMAGE",
+    [OP_SET_Z_IMAGE]        = "SET_Z_IMAGE",
+    [OP_SET_COLOR_IMAGE]    = "SET_COLOR_IMAGE",
+};
+
+static const char *format_names[8] = { "RGBA", "YUV", "CI", "IA", "I", "?5", "?6", "?7" };
+static const char *size_names[4] = { "4", "8", "16", "32" };
+static const char *cycle_names[4] = { "1CYC", "2CYC", "COPY", "FILL" };
+
+/* Shadow of the state the stream has set so far */
+typedef struct
+{
+    /* Last words of each single-command state setter, indexed by opcode */
+    uint32_t value[64][2];
+    /* Whether value holds anything for the opcode */
+    uint8_t valid[64];
+
+    /* Tile descriptors and sizes */
+    uint32_t tile[8][2];
+    uint8_t tile_valid[8];
+    uint32_t tile_size[8][2];
+    uint8_t tile_size_valid[8];
+
+    /* Something was drawn since the last sync of each kind */
+    int drawn_since_pipe;
+    int drawn_since_tile;
+    int drawn_since_load;
+
+    /* Tiles sampled since the last tile sync */
+    uint8_t tile_busy;
+    /* A textured primitive was drawn since the last load or pipe sync */
+    int textured_since_load;
+} rdp_state_t;
+
+int rdpdis_command_size( uint32_t word )
+{
+    int op = OPCODE( word );
+
+    if( op >= OP_TRI_FIRST && op <= OP_TRI_LAST )
+    {
+        int size = 8;
+
+        if( op & TRI_SHADE ) { size += 16; }
+        if( op & TRI_TEXTURE ) { size += 16; }
+        if( op & TRI_ZBUFFER ) { size += 4; }
+
+        return size;
+    }
+
+    if( op == OP_TEXRECT || op == OP_TEXRECT_FLIP ) { return 4; }
+
+    return 2;
+}
+
+const char *rdpdis_command_name( uint32_t word )
+{
+    return command_names[OPCODE( word )];
+}
+
+/* Print a 10.2 fixed point coordinate */
+static void print_10_2( FILE *out, const char *name, uint32_t v )
+{
+    fprintf( out, " %s=%d.%02d", name, (int)(v >> 2), (int)(v & 3) * 25 );
+}
+
+/* Sign extend a value of the given number of bits */
+static int32_t sign_extend( uint32_t v, int bits )
+{
+    return (int32_t)(v << (32 - bits)) >> (32 - bits);
+}
+
+static void print_triangle( FILE *out, const uint32_t *w )
+{
+    int op = OPCODE( w[0] );
+
+    fprintf( out, " %s tile=%d level=%d", (w[0] & 0x00800000) ? "right" : "left",
+             (int)((w[0] >> 16) & 7), (int)((w[0] >> 19) & 7) );
+    fprintf( out, " yl=%.2f ym=%.2f yh=%.2f",
+             sign_extend( w[0] & 0x3FFF, 14 ) / 4.0,
+             sign_extend( (w[1] >> 16) & 0x3FFF, 14 ) / 4.0,
+             sign_extend( w[1] & 0x3FFF, 14 ) / 4.0 );
+    fprintf( out, " xl=%.4f dxldy=%.4f xh=%.4f dxhdy=%.4f xm=%.4f dxmdy=%.4f",
+             (int32_t)w[2] / 65536.0, (int32_t)w[3] / 65536.0,
+             (int32_t)w[4] / 65536.0, (int32_t)w[5] / 65536.0,
+             (int32_t)w[6] / 65536.0, (int32_t)w[7] / 65536.0 );
+
+    if( op & TRI_SHADE ) { fprintf( out, " +shade" ); }
+    if( op & TRI_TEXTURE ) { fprintf( out, " +texture" ); }
+    if( op & TRI_ZBUFFER ) { fprintf( out, " +z" ); }
+}
+
+static void print_arguments( FILE *out, const uint32_t *w )
+{
+    int op = OPCODE( w[0] );
+
+    if( op >= OP_TRI_FIRST && op <= OP_TRI_LAST )
+    {
+        print_triangle( out, w );
+        return;
+    }
+
+    switch( op )
+    {
+        case OP_TEXRECT:
+        case OP_TEXRECT_FLIP:
+            fprintf( out, " tile=%d", (int)((w[1] >> 24) & 7) );
+            print_10_2( out, "xh", (w[1] >> 12) & 0xFFF );
+            print_10_2( out, "yh", w[1] & 0xFFF );
+            print_10_2( out, "xl", (w[0] >> 12) & 0xFFF );
+            print_10_2( out, "yl", w[0] & 0xFFF );
+            fprintf( out, " s=%.3f t=%.3f dsdx=%.4f dtdy=%.4f",
+                     (int16_t)(w[2] >> 16) / 32.0, (int16_t)(w[2] & 0xFFFF) / 32.0,
+                     (int16_t)(w[3] >> 16) / 1024.0, (int16_t)(w[3] & 0xFFFF) / 1024.0 );
+            break;
+        case OP_FILL_RECT:
+            print_10_2( out, "xh", (w[1] >> 12) & 0xFFF );
+            print_10_2( out, "yh", w[1] & 0xFFF );
+            print_10_2( out, "xl", (w[0] >> 12) & 0xFFF );
+            print_10_2( out, "yl", w[0] & 0xFFF );
+            break;
+        case OP_SET_SCISSOR:
+            print_10_2( out, "xh", (w[0] >> 12) & 0xFFF );
+            print_10_2( out, "yh", w[0] & 0xFFF );
+            print_10_2( out, "xl", (w[1] >> 12) & 0xFFF );
+            print_10_2( out, "yl", w[1] & 0xFFF );
+            if( w[1] & 0x02000000 ) { fprintf( out, " interlace=%s", (w[1] & 0x01000000) ? "odd" : "even" ); }
+            break;
+        case OP_SET_OTHER_MODES:
+            fprintf( out, " %s hi=%06X lo=%08X", cycle_names[(w[0] >> 20) & 3], (unsigned)(w[0] & 0xFFFFFF), (unsigned)w[1] );
+            break;
+        case OP_SET_COMBINE:
+            fprintf( out, " %06X %08X", (unsigned)(w[0] & 0xFFFFFF), (unsigned)w[1] );
+            break;
+        case OP_SET_FILL_COLOR:
+            fprintf( out, " %08X", (unsigned)w[1] );
+            break;
+        case OP_SET_FOG_COLOR:
+        case OP_SET_BLEND_COLOR:
+        case OP_SET_PRIM_COLOR:
+        case OP_SET_ENV_COLOR:
+            fprintf( out, " r=%d g=%d b=%d a=%d", (int)(w[1] >> 24), (int)((w[1] >> 16) & 0xFF),
+                     (int)((w[1] >> 8) & 0xFF), (int)(w[1] & 0xFF) );
+            if( op == OP_SET_PRIM_COLOR ) { fprintf( out, " minlevel=%d lodfrac=%d", (int)((w[0] >> 8) & 0x1F), (int)(w[0] & 0xFF) ); }
+            break;
+        case OP_SET_PRIM_DEPTH:
+            fprintf( out, " z=%04X dz=%04X", (unsigned)(w[1] >> 16), (unsigned)(w[1] & 0xFFFF) );
+            break;
+        case OP_SET_TEX_IMAGE:
+        case OP_SET_COLOR_IMAGE:
+            fprintf( out, " fmt=%s size=%s width=%d", format_names[(w[0] >> 21) & 7], size_names[(w[0] >> 19) & 3], (int)(w[0] & 0x3FF) + 1 );
+            /* Fall through */
+        case OP_SET_Z_IMAGE:
+            fprintf( out, " addr=%08X", (unsigned)w[1] );
+            break;
+        case OP_SET_TILE:
+            fprintf( out, " tile=%d fmt=%s size=%s line=%d tmem=%03X palette=%d",
+                     (int)((w[1] >> 24) & 7), format_names[(w[0] >> 21) & 7], size_names[(w[0] >> 19) & 3],
+                     (int)((w[0] >> 9) & 0x1FF), (unsigned)(w[0] & 0x1FF), (int)((w[1] >> 20) & 15) );
+            fprintf( out, " ct=%d mt=%d maskt=%d shiftt=%d cs=%d ms=%d masks=%d shifts=%d",
+                     (int)((w[1] >> 19) & 1), (int)((w[1] >> 18) & 1), (int)((w[1] >> 14) & 15), (int)((w[1] >> 10) & 15),
+                     (int)((w[1] >> 9) & 1), (int)((w[1] >> 8) & 1), (int)((w[1] >> 4) & 15), (int)(w[1] & 15) );
+            break;
+        case OP_LOAD_BLOCK:
+            fprintf( out, " tile=%d sl=%d tl=%d sh=%d dxt=%03X", (int)((w[1] >> 24) & 7),
+                     (int)((w[0] >> 12) & 0xFFF), (int)(w[0] & 0xFFF), (int)((w[1] >> 12) & 0xFFF), (unsigned)(w[1] & 0xFFF) );
+            break;
+        case OP_LOAD_TLUT:
+        case OP_LOAD_TILE:
+        case OP_SET_TILE_SIZE:
+            fprintf( out, " tile=%d", (int)((w[1] >> 24) & 7) );
+            print_10_2( out, "sl", (w[0] >> 12) & 0xFFF );
+            print_10_2( out, "tl", w[0] & 0xFFF );
+            print_10_2( out, "sh", (w[1] >> 12) & 0xFFF );
+            print_10_2( out, "th", w[1] & 0xFFF );
+            break;
+        default:
+            break;
+    }
+}
+
+/* Report a problem with the command at the given word offset */
+static void report( FILE *out, int flags, int offset, const char *kind, const char *what )
+{
+    if( out && (flags & RDPDIS_WARN) )
+    {
+        fprintf( out, "%s%08X: %s: %s\n", (flags & RDPDIS_LIST) ? "  ^ " : "", offset << 2, kind, what );
+    }
+}
+
+/* Check a state command against the shadow, returns nonzero if it changes nothing */
+static int same_state( rdp_state_t *state, const uint32_t *w )
+{
+    int op = OPCODE( w[0] );
+    uint32_t hi = w[0] & 0x00FFFFFF;
+
+    if( state->valid[op] && state->value[op][0] == hi && state->value[op][1] == w[1] ) { return 1; }
+
+    state->valid[op] = 1;
+    state->value[op][0] = hi;
+    state->value[op][1] = w[1];
+
+    return 0;
+}
+
+/* Validate one command and update the shadow state */
+static void check_command( rdp_state_t *state, const uint32_t *w, int offset, FILE *out, int flags, rdpdis_stats_t *stats )
+{
+    int op = OPCODE( w[0] );
+    int tile = (w[1] >> 24) & 7;
+
+    if( op >= OP_TRI_FIRST && op <= OP_TRI_LAST )
+    {
+        int32_t yl = sign_extend( w[0] & 0x3FFF, 14 );
+        int32_t ym = sign_extend( (w[1] >> 16) & 0x3FFF, 14 );
+        int32_t yh = sign_extend( w[1] & 0x3FFF, 14 );
+
+        if( yh > ym || ym > yl )
+        {
+            report( out, flags, offset, "malformed", "triangle Y coordinates are not sorted" );
+            stats->malformed++;
+        }
+
+        stats->primitives++;
+        state->drawn_since_pipe = state->drawn_since_tile = state->drawn_since_load = 1;
+
+        if( op & TRI_TEXTURE )
+        {
+            state->tile_busy |= 1 << ((w[0] >> 16) & 7);
+            state->textured_since_load = 1;
+        }
+
+        return;
+    }
+
+    switch( op )
+    {
+        case OP_TEXRECT:
+        case OP_TEXRECT_FLIP:
+        case OP_FILL_RECT:
+            if( ((w[1] >> 12) & 0xFFF) > ((w[0] >> 12) & 0xFFF) || (w[1] & 0xFFF) > (w[0] & 0xFFF) )
+            {
+                report( out, flags, offset, "malformed", "rectangle has negative size" );
+                stats->malformed++;
+            }
+
+            stats->primitives++;
+            state->drawn_since_pipe = state->drawn_since_tile = state->drawn_since_load = 1;
+
+            if( op != OP_FILL_RECT )
+            {
+                state->tile_busy |= 1 << tile;
+                state->textured_since_load = 1;
+            }
+            break;
+
+        case OP_SYNC_PIPE:
+        case OP_SYNC_TILE:
+        case OP_SYNC_LOAD:
+        {
+            int *drawn = (op == OP_SYNC_PIPE) ? &state->drawn_since_pipe :
+                         (op == OP_SYNC_TILE) ? &state->drawn_since_tile : &state->drawn_since_load;
+
+            stats->syncs++;
+
+            if( !*drawn )
+            {
+                report( out, flags, offset, "unnecessary", "nothing drawn since the last sync of this kind" );
+                stats->unnecessary_syncs++;
+            }
+
+            *drawn = 0;
+
+            if( op == OP_SYNC_TILE || op == OP_SYNC_PIPE ) { state->tile_busy = 0; }
+            if( op == OP_SYNC_LOAD || op == OP_SYNC_PIPE ) { state->textured_since_load = 0; }
+            break;
+        }
+
+        case OP_SYNC_FULL:
+            stats->syncs++;
+            state->drawn_since_pipe = state->drawn_since_tile = state->drawn_since_load = 0;
+            state->tile_busy = 0;
+            state->textured_since_load = 0;
+            break;
+
+        case OP_SET_OTHER_MODES:
+        case OP_SET_COMBINE:
+        case OP_SET_COLOR_IMAGE:
+        case OP_SET_Z_IMAGE:
+        case OP_SET_FILL_COLOR:
+        case OP_SET_FOG_COLOR:
+        case OP_SET_BLEND_COLOR:
+        case OP_SET_SCISSOR:
+        case OP_SET_ENV_COLOR:
+        case OP_SET_PRIM_DEPTH:
+        case OP_SET_KEY_GB:
+        case OP_SET_KEY_R:
+        case OP_SET_CONVERT:
+            if( (op == OP_SET_COLOR_IMAGE || op == OP_SET_Z_IMAGE) && (w[1] & 0x3F) )
+            {
+                report( out, flags, offset, "malformed", "image address is not 64 byte aligned" );
+                stats->malformed++;
+            }
+
+            if( same_state( state, w ) )
+            {
+                report( out, flags, offset, "redundant", "value is already set" );
+                stats->redundant++;
+            }
+            else if( state->drawn_since_pipe )
+            {
+                report( out, flags, offset, "hazard", "state change after drawing without SYNC_PIPE" );
+                stats->hazards++;
+            }
+            break;
+
+        case OP_SET_PRIM_COLOR:
+            /* Latched per primitive and needs no sync */
+            if( same_state( state, w ) )
+            {
+                report( out, flags, offset, "redundant", "value is already set" );
+                stats->redundant++;
+            }
+            break;
+
+        case OP_SET_TEX_IMAGE:
+            if( w[1] & 0x7 )
+            {
+                report( out, flags, offset, "malformed", "texture address is not 8 byte aligned" );
+                stats->malformed++;
+            }
+
+            if( same_state( state, w ) )
+            {
+                report( out, flags, offset, "redundant", "value is already set" );
+                stats->redundant++;
+            }
+            break;
+
+        case OP_SET_TILE:
+            if( state->tile_valid[tile] && state->tile[tile][0] == (w[0] & 0x00FFFFFF) && state->tile[tile][1] == w[1] )
+            {
+                report( out, flags, offset, "redundant", "tile descriptor is already set" );
+                stats->redundant++;
+                break;
+            }
+
+            if( state->tile_busy & (1 << tile) )
+            {
+                report( out, flags, offset, "hazard", "tile changed while in use without SYNC_TILE" );
+                stats->hazards++;
+            }
+
+            state->tile_valid[tile] = 1;
+            state->tile[tile][0] = w[0] & 0x00FFFFFF;
+            state->tile[tile][1] = w[1];
+            break;
+
+        case OP_SET_TILE_SIZE:
+            if( state->tile_size_valid[tile] && state->tile_size[tile][0] == (w[0] & 0x00FFFFFF) && state->tile_size[tile][1] == w[1] )
+            {
+                report( out, flags, offset, "redundant", "tile size is already set" );
+                stats->redundant++;
+                break;
+            }
+
+            if( state->tile_busy & (1 << tile) )
+            {
+                report( out, flags, offset, "hazard", "tile size changed while in use without SYNC_TILE" );
+                stats->hazards++;
+            }
+
+            state->tile_size_valid[tile] = 1;
+            state->tile_size[tile][0] = w[0] & 0x00FFFFFF;
+            state->tile_size[tile][1] = w[1];
+            break;
+
+        case OP_LOAD_TLUT:
+        case OP_LOAD_TILE:
+        case OP_LOAD_BLOCK:
+            if( !state->valid[OP_SET_TEX_IMAGE] )
+            {
+                report( out, flags, offset, "malformed", "load without a texture image" );
+                stats->malformed++;
+            }
+
+            if( !state->tile_valid[tile] )
+            {
+                report( out, flags, offset, "malformed", "load into an undefined tile" );
+                stats->malformed++;
+            }
+
+            if( op == OP_LOAD_TLUT && (int)((w[1] >> 14) & 0x3FF) - (int)((w[0] >> 14) & 0x3FF) >= 256 )
+            {
+                report( out, flags, offset, "malformed", "palette is larger than 256 entries" );
+                stats->malformed++;
+            }
+
+            if( state->textured_since_load )
+            {
+                report( out, flags, offset, "hazard", "TMEM load after texturing without SYNC_LOAD" );
+                stats->hazards++;
+            }
+
+            /* Loads update the tile size */
+            state->tile_size_valid[tile] = (op != OP_LOAD_BLOCK);
+            state->tile_size[tile][0] = w[0] & 0x00FFFFFF;
+            state->tile_size[tile][1] = w[1] & 0x00FFFFFF;
+            break;
+
+        default:
+            break;
+    }
+}
+
+int rdpdis_decode( const uint32_t *words, int count, FILE *out, int flags, rdpdis_stats_t *stats )
+{
+    rdp_state_t state;
+    rdpdis_stats_t local;
+    int malformed;
+
+    if( !stats ) { stats = &local; memset( stats, 0, sizeof(local) ); }
+    malformed = stats->malformed;
+
+    memset( &state, 0, sizeof(state) );
+
+    for( int i = 0; i < count; )
+    {
+        const char *name = rdpdis_command_name( words[i] );
+        int size = rdpdis_command_size( words[i] );
+
+        if( !name )
+        {
+            if( out && (flags & (RDPDIS_LIST | RDPDIS_WARN)) )
+            {
+                fprintf( out, "%08X: unknown command %08X\n", i << 2, (unsigned)words[i] );
+            }
+
+            stats->malformed++;
+            i += 2;
+            continue;
+        }
+
+        if( i + size > count )
+        {
+            report( out, flags | RDPDIS_WARN, i, "malformed", "command is truncated" );
+            stats->malformed++;
+            break;
+        }
+
+        if( out && (flags & RDPDIS_LIST) )
+        {
+            fprintf( out, "%08X: %-16s", i << 2, name );
+            print_arguments( out, &words[i] );
+            fprintf( out, "\n" );
+        }
+
+        stats->commands++;
+        check_command( &state, &words[i], i, out, flags, stats );
+
+        i += size;
+    }
+
+    return stats->malformed - malformed;
+}
@@ -0,0 +1,42 @@
+#ifndef RDPDIS_H
+#define RDPDIS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Counters gathered while walking a command stream */
+typedef struct
+{
+    /* Number of commands decoded */
+    int commands;
+    /* Number of drawing commands (triangles and rectangles) */
+    int primitives;
+    /* Number of sync commands */
+    int syncs;
+    /* Commands that are truncated, unknown or have invalid arguments */
+    int malformed;
+    /* State commands that set a value that is already current */
+    int redundant;
+    /* Syncs with nothing to wait for */
+    int unnecessary_syncs;
+    /* State changes directly after drawing without the required sync */
+    int hazards;
+} rdpdis_stats_t;
+
+/* Print every command, not only problems */
+#define RDPDIS_LIST     1
+/* Print problems */
+#define RDPDIS_WARN     2
+
+/* Return the length in 32-bit words of the command starting with the given word */
+int rdpdis_command_size( uint32_t word );
+
+/* Return the name of the command starting with the given word, or 0 if unknown */
+const char *rdpdis_command_name( uint32_t word );
+
+/* Decode a command stream of count 32-bit words, printing to out according to
+   flags and accumulating counters into stats.  Returns the number of malformed
+   commands found. */
+int rdpdis_decode( const uint32_t *words, int count, FILE *out, int flags, rdpdis_stats_t *stats );
+
+#endif
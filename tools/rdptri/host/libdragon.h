@@ -0,0 +1,31 @@
+#ifndef RDPTRI_HOST_LIBDRAGON_H
+#define RDPTRI_HOST_LIBDRAGON_H
+
+/* Host stand-in for libdragon.h so that src/rdp.c can be compiled into the test.
+   Only the triangle setup is exercised, the hardware entry points do nothing. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "display.h"
+#include "graphics.h"
+#include "rdp.h"
+
+#define INTERRUPTS_ENABLED  1
+#define MEMORY_BARRIER()
+
+static inline void disable_interrupts( void ) { }
+static inline void enable_interrupts( void ) { }
+static inline int get_interrupts_state( void ) { return INTERRUPTS_ENABLED; }
+static inline void register_DP_handler( void (*callback)() ) { (void)callback; }
+static inline void unregister_DP_handler( void (*callback)() ) { (void)callback; }
+static inline void set_DP_interrupt( int active ) { (void)active; }
+static inline void data_cache_hit_writeback( volatile void *addr, unsigned long length ) { (void)addr; (void)length; }
+static inline void data_cache_hit_writeback_invalidate( volatile void *addr, unsigned long length ) { (void)addr; (void)length; }
+static inline unsigned long get_ticks( void ) { return 0; }
+
+static inline int dfs_open( const char * const path ) { (void)path; return -1; }
+static inline int dfs_size( int handle ) { (void)handle; return 0; }
+static inline int dfs_read( void * const buf, int size, int count, int handle ) { (void)buf; (void)size; (void)count; (void)handle; return 0; }
+static inline int dfs_close( int handle ) { (void)handle; return 0; }
+
+#endif
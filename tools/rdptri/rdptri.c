@@ -0,0 +1,262 @@
+/* Host test for the RDP triangle coefficient setup in src/rdp.c.  Triangles of all
+   eight triangle types are queued with __rdp_queue_triangle and the shade, texture and
+   Z coefficients in the command stream are compared against a double precision plane
+   fitted through the vertices. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+/* The triangle setup is static, so build it into this test directly */
+#include "../../src/rdp.c"
+
+/* Display and graphics state the RDP code links against */
+uint32_t __bitdepth = 2;
+uint32_t __width = 320;
+uint32_t __height = 240;
+void *__safe_buffer[3];
+void *__safe_zbuffer;
+
+void display_flush( display_context_t disp ) { (void)disp; }
+void display_show( display_context_t disp ) { (void)disp; }
+const font_glyph_t *graphics_get_glyph( const font_t *font, char ch ) { (void)font; (void)ch; return 0; }
+int graphics_get_kerning( const font_t *font, char first, char second ) { (void)font; (void)first; (void)second; return 0; }
+sprite_t *graphics_get_font_atlas( font_t *font ) { (void)font; return 0; }
+
+#define NUM_TRIANGLES   2000
+
+/* Attribute values at the three vertices and the reference plane through them */
+typedef struct
+{
+    double x[3];
+    double y[3];
+    double a[3];
+} plane_t;
+
+static int failures = 0;
+
+/* Evaluate the plane through the vertices at any point using barycentric weights */
+static double plane_at( const plane_t *p, double x, double y )
+{
+    double det = (p->y[1] - p->y[2]) * (p->x[0] - p->x[2]) + (p->x[2] - p->x[1]) * (p->y[0] - p->y[2]);
+    double l0 = ((p->y[1] - p->y[2]) * (x - p->x[2]) + (p->x[2] - p->x[1]) * (y - p->y[2])) / det;
+    double l1 = ((p->y[2] - p->y[0]) * (x - p->x[2]) + (p->x[0] - p->x[2]) * (y - p->y[2])) / det;
+
+    return l0 * p->a[0] + l1 * p->a[1] + (1.0 - l0 - l1) * p->a[2];
+}
+
+/* Compare one 16.16 coefficient, modulo 2^32 like the RDP adders */
+static void check( const char *what, int tri, int opcode, int32_t got, double expected, double tolerance )
+{
+    int32_t ref = (int32_t)(uint32_t)(int64_t)llround( expected * 65536.0 );
+    int32_t diff = (int32_t)((uint32_t)got - (uint32_t)ref);
+
+    if( diff > tolerance || diff < -tolerance )
+    {
+        if( failures < 20 )
+        {
+            fprintf( stderr, "opcode %02X triangle %d: %s is %.6f, expected %.6f\n",
+                     0x08 | opcode, tri, what, got / 65536.0, expected );
+        }
+
+        failures++;
+    }
+}
+
+/* Check base, DxDx, DxDe and DxDy of one attribute against the reference plane */
+static void check_attr( const char *name, int tri, int opcode, const plane_t *p, double sx, double sy, double ish,
+                        int32_t base, int32_t dx, int32_t de, int32_t dy )
+{
+    char what[32];
+    double a = plane_at( p, sx, sy );
+
+    /* The setup works in single precision, so gradients lose bits in proportion to the
+       attribute size times the triangle extent over its area */
+    double amax = fmax( fabs( p->a[0] ), fmax( fabs( p->a[1] ), fabs( p->a[2] ) ) );
+    double area = fabs( (p->x[1] - p->x[0]) * (p->y[2] - p->y[0]) - (p->x[2] - p->x[0]) * (p->y[1] - p->y[0]) );
+    double tolerance = 16.0 + 8.0 * FLT_EPSILON * amax * 320.0 / area * 65536.0 * (1.0 + fabs( ish ));
+
+    snprintf( what, sizeof(what), "%s", name );
+    check( what, tri, opcode, base, a, tolerance + 8.0 * FLT_EPSILON * amax * 65536.0 );
+    snprintf( what, sizeof(what), "D%sDx", name );
+    check( what, tri, opcode, dx, plane_at( p, sx + 1.0, sy ) - a, tolerance );
+    snprintf( what, sizeof(what), "D%sDe", name );
+    check( what, tri, opcode, de, plane_at( p, sx + ish, sy + 1.0 ) - a, tolerance );
+    snprintf( what, sizeof(what), "D%sDy", name );
+    check( what, tri, opcode, dy, plane_at( p, sx, sy + 1.0 ) - a, tolerance );
+}
+
+/* Rebuild 16.16 values from a shade or texture block, integer parts first */
+static void unpack_attr4( const uint32_t *w, int32_t base[4], int32_t dx[4], int32_t de[4], int32_t dy[4] )
+{
+    int32_t * const out[4] = { base, dx, de, dy };
+
+    for( int b = 0; b < 2; b++, w += 8 )
+    {
+        for( int v = 0; v < 2; v++ )
+        {
+            int32_t *c = out[b * 2 + v];
+
+            c[0] = (w[v * 2] & 0xFFFF0000) | (w[4 + v * 2] >> 16);
+            c[1] = (w[v * 2] << 16) | (w[4 + v * 2] & 0xFFFF);
+            c[2] = (w[v * 2 + 1] & 0xFFFF0000) | (w[4 + v * 2 + 1] >> 16);
+            c[3] = (w[v * 2 + 1] << 16) | (w[4 + v * 2 + 1] & 0xFFFF);
+        }
+    }
+}
+
+static float frand( float lo, float hi )
+{
+    return lo + (hi - lo) * (rand() / (float)RAND_MAX);
+}
+
+/* Queue a random triangle of the current type and check every coefficient block */
+static void test_triangle( int tri, int opcode )
+{
+    rdp_vertex_t v[3];
+    double area;
+
+    /* Skip slivers, whose gradients are too ill-conditioned to compare */
+    do
+    {
+        for( int i = 0; i < 3; i++ )
+        {
+            v[i].x = frand( 0.0f, 319.0f );
+            v[i].y = frand( 0.0f, 239.0f );
+            v[i].z = frand( 0.0f, 1.0f );
+            v[i].s = frand( 0.0f, 64.0f );
+            v[i].t = frand( 0.0f, 64.0f );
+            v[i].inv_w = frand( 0.1f, 1.0f );
+            v[i].r = rand() & 0xFF;
+            v[i].g = rand() & 0xFF;
+            v[i].b = rand() & 0xFF;
+            v[i].a = rand() & 0xFF;
+        }
+
+        area = fabs( (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y) ) / 2.0;
+    } while( area < 200.0 );
+
+    rdp_start = 0;
+    rdp_end = 0;
+    __rdp_queue_triangle( &v[0], &v[1], &v[2] );
+
+    const uint32_t *w = rdp_ringbuffer;
+    int shade = opcode & 4;
+    int texture = opcode & 2;
+    int zbuffer = opcode & 1;
+    int words = 8 + (shade ? 16 : 0) + (texture ? 16 : 0) + (zbuffer ? 4 : 0);
+
+    if( (int)(rdp_end >> 2) != words || ((w[0] >> 24) & 0x3F) != (uint32_t)(0x08 | opcode) )
+    {
+        fprintf( stderr, "opcode %02X triangle %d: command %08X is %d words, expected %d\n",
+                 0x08 | opcode, tri, (unsigned int)w[0], (int)(rdp_end >> 2), words );
+        failures++;
+        return;
+    }
+
+    /* Sort like the RDP, top vertex first */
+    const rdp_vertex_t *s[3] = { &v[0], &v[1], &v[2] };
+
+    for( int i = 0; i < 2; i++ )
+    {
+        for( int j = 0; j < 2 - i; j++ )
+        {
+            if( s[j]->y > s[j + 1]->y ) { const rdp_vertex_t *t = s[j]; s[j] = s[j + 1]; s[j + 1] = t; }
+        }
+    }
+
+    /* Attributes start on the major edge at the scanline containing the top vertex */
+    double ish = (double)(s[2]->x - s[0]->x) / (s[2]->y - s[0]->y);
+    double sy = floor( s[0]->y );
+    double sx = s[0]->x + (sy - s[0]->y) * ish;
+    plane_t p;
+
+    for( int i = 0; i < 3; i++ )
+    {
+        p.x[i] = s[i]->x;
+        p.y[i] = s[i]->y;
+    }
+
+    w += 8;
+
+    if( shade )
+    {
+        int32_t base[4], dx[4], de[4], dy[4];
+        static const char * const names[4] = { "R", "G", "B", "A" };
+
+        unpack_attr4( w, base, dx, de, dy );
+
+        for( int c = 0; c < 4; c++ )
+        {
+            for( int i = 0; i < 3; i++ )
+            {
+                const uint8_t *rgba = &s[i]->r;
+                p.a[i] = rgba[c];
+            }
+
+            check_attr( names[c], tri, opcode, &p, sx, sy, ish, base[c], dx[c], de[c], dy[c] );
+        }
+
+        w += 16;
+    }
+
+    if( texture )
+    {
+        int32_t base[4], dx[4], de[4], dy[4];
+        double maxw = s[0]->inv_w;
+
+        if( s[1]->inv_w > maxw ) { maxw = s[1]->inv_w; }
+        if( s[2]->inv_w > maxw ) { maxw = s[2]->inv_w; }
+
+        unpack_attr4( w, base, dx, de, dy );
+
+        /* S and T are 10.5 and divided by W, W is normalized to 1.0 = 0x7FFF */
+        for( int i = 0; i < 3; i++ ) { p.a[i] = s[i]->s * 32.0 * s[i]->inv_w / maxw; }
+        check_attr( "S", tri, opcode, &p, sx, sy, ish, base[0], dx[0], de[0], dy[0] );
+        for( int i = 0; i < 3; i++ ) { p.a[i] = s[i]->t * 32.0 * s[i]->inv_w / maxw; }
+        check_attr( "T", tri, opcode, &p, sx, sy, ish, base[1], dx[1], de[1], dy[1] );
+        for( int i = 0; i < 3; i++ ) { p.a[i] = 32767.0 * s[i]->inv_w / maxw; }
+        check_attr( "W", tri, opcode, &p, sx, sy, ish, base[2], dx[2], de[2], dy[2] );
+
+        w += 16;
+    }
+
+    if( zbuffer )
+    {
+        for( int i = 0; i < 3; i++ ) { p.a[i] = s[i]->z * 32767.0; }
+        check_attr( "Z", tri, opcode, &p, sx, sy, ish, w[0], w[1], w[2], w[3] );
+    }
+}
+
+int main( int argc, char *argv[] )
+{
+    (void)argc;
+    (void)argv;
+
+    srand( 1 );
+
+    /* Opcodes 0x08-0x0F: bit 2 shade, bit 1 texture, bit 0 Z-buffer */
+    for( int opcode = 0; opcode < 8; opcode++ )
+    {
+        /* rdp_triangle_setup numbers them shade = 1, texture = 2, Z-buffer = 4 */
+        rdp_triangle_setup( ((opcode & 4) ? 1 : 0) | (opcode & 2) | ((opcode & 1) ? 4 : 0) );
+
+        for( int tri = 0; tri < NUM_TRIANGLES; tri++ )
+        {
+            test_triangle( tri, opcode );
+        }
+    }
+
+    if( failures )
+    {
+        fprintf( stderr, "%d coefficients out of tolerance\n", failures );
+        return 1;
+    }
+
+    printf( "All triangle coefficients match the reference\n" );
+
+    return 0;
+}